@@ -0,0 +1,288 @@
+#include "attr_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+
+/*
+ * Seconds since the given CLOCK_MONOTONIC time.
+ */
+double timespec_elapsed(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/* FNV-1a */
+static size_t hash_path(const char *path)
+{
+    size_t hash = 14695981039346656037ULL;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash % ATTR_CACHE_BUCKETS;
+}
+
+void attr_cache_init(struct attr_cache *cache, double timeout, double negative_timeout,
+        double lease_timeout)
+{
+    memset(cache, 0, sizeof(struct attr_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->timeout = timeout;
+    cache->negative_timeout = negative_timeout;
+    cache->lease_timeout = lease_timeout;
+}
+
+static bool cache_enabled(const struct attr_cache *cache)
+{
+    return cache->timeout > 0 || cache->lease_timeout > 0;
+}
+
+static struct attr_lru *entry_lru(struct attr_cache *cache, struct attr_entry *entry)
+{
+    return entry->negative ? &cache->negative : &cache->positive;
+}
+
+static void lru_unlink(struct attr_lru *lru, struct attr_entry *entry)
+{
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru->head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru->tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+    lru->count--;
+}
+
+static void lru_push(struct attr_lru *lru, struct attr_entry *entry)
+{
+    entry->lru_next = lru->head;
+    if (lru->head != NULL) {
+        lru->head->lru_prev = entry;
+    }
+    lru->head = entry;
+    if (lru->tail == NULL) {
+        lru->tail = entry;
+    }
+    lru->count++;
+}
+
+static struct attr_entry *find_entry(struct attr_cache *cache, const char *path)
+{
+    struct attr_entry *entry = cache->buckets[hash_path(path)];
+    while (entry != NULL && strcmp(entry->path, path) != 0) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+static void remove_entry(struct attr_cache *cache, struct attr_entry *entry)
+{
+    struct attr_entry **link = &cache->buckets[hash_path(entry->path)];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    lru_unlink(entry_lru(cache, entry), entry);
+    free(entry->path);
+    free(entry);
+}
+
+/*
+ * Finds the entry for path, or adds an empty one, and moves it to the front
+ * of the LRU list for its kind, evicting the oldest entry of that kind if the
+ * list is full. Called with the lock held.
+ */
+static struct attr_entry *claim_entry(struct attr_cache *cache, const char *path, bool negative)
+{
+    struct attr_entry *entry = find_entry(cache, path);
+    if (entry != NULL) {
+        lru_unlink(entry_lru(cache, entry), entry);
+    } else {
+        entry = calloc(1, sizeof(struct attr_entry));
+        if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+            perror("calloc");
+            free(entry);
+            return NULL;
+        }
+        size_t bucket = hash_path(path);
+        entry->hash_next = cache->buckets[bucket];
+        cache->buckets[bucket] = entry;
+    }
+
+    entry->negative = negative;
+    struct attr_lru *lru = entry_lru(cache, entry);
+    size_t max = negative ? ATTR_CACHE_MAX_NEGATIVE : ATTR_CACHE_MAX_ENTRIES;
+    if (lru->count >= max) {
+        remove_entry(cache, lru->tail);
+    }
+    lru_push(lru, entry);
+    clock_gettime(CLOCK_MONOTONIC, &entry->fetched);
+    return entry;
+}
+
+/*
+ * Copies the cached attributes of path into atst if they are still within the
+ * timeout, or the lease timeout if they are leased.
+ */
+bool attr_cache_lookup(struct attr_cache *cache, const char *path, struct attr_stat *atst)
+{
+    bool found = false;
+
+    if (!cache_enabled(cache)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    struct attr_entry *entry = find_entry(cache, path);
+    if (entry != NULL && !entry->negative
+            && timespec_elapsed(&entry->fetched)
+                < (entry->leased ? cache->lease_timeout : cache->timeout)) {
+        *atst = entry->atst;
+        lru_unlink(&cache->positive, entry);
+        lru_push(&cache->positive, entry);
+        found = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return found;
+}
+
+/*
+ * The generation to pass to attr_cache_store for attributes about to be
+ * asked for
+ */
+uint64_t attr_cache_generation(struct attr_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    uint64_t generation = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+    return generation;
+}
+
+/*
+ * Records freshly fetched attributes. leased says the reply came with a
+ * lease; attributes without one keep the lease of the entry they replace.
+ * Either only counts if nothing was recalled since generation was read.
+ * Returns true if path was already cached with a different mtime or size,
+ * meaning anything derived from its old contents is stale.
+ */
+bool attr_cache_store(struct attr_cache *cache, const char *path, const struct attr_stat *atst,
+        uint64_t generation, bool leased)
+{
+    bool changed = false;
+
+    if (!cache_enabled(cache)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    struct attr_entry *entry = find_entry(cache, path);
+    if (entry != NULL && !entry->negative) {
+        changed = entry->atst.size != atst->size
+            || entry->atst.mtim.tv_sec != atst->mtim.tv_sec
+            || entry->atst.mtim.tv_nsec != atst->mtim.tv_nsec;
+        leased = leased || entry->leased;
+    }
+    leased = leased && cache->lease_timeout > 0 && generation == cache->generation;
+
+    entry = claim_entry(cache, path, false);
+    if (entry != NULL) {
+        entry->atst = *atst;
+        entry->leased = leased;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (changed) {
+        LOG("Attributes of %s changed\n", path);
+    }
+    return changed;
+}
+
+/*
+ * Returns true if path is cached as missing and the entry is still within
+ * the negative timeout. The caller must still check that the parent
+ * directory's mtime matches parent_mtim before trusting it.
+ */
+bool attr_cache_lookup_negative(struct attr_cache *cache, const char *path,
+        struct timespec *parent_mtim)
+{
+    bool found = false;
+
+    if (cache->negative_timeout <= 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    struct attr_entry *entry = find_entry(cache, path);
+    if (entry != NULL && entry->negative
+            && timespec_elapsed(&entry->fetched) < cache->negative_timeout) {
+        *parent_mtim = entry->parent_mtim;
+        lru_unlink(&cache->negative, entry);
+        lru_push(&cache->negative, entry);
+        found = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return found;
+}
+
+void attr_cache_store_negative(struct attr_cache *cache, const char *path,
+        const struct timespec *parent_mtim)
+{
+    if (cache->negative_timeout <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    struct attr_entry *entry = claim_entry(cache, path, true);
+    if (entry != NULL) {
+        entry->parent_mtim = *parent_mtim;
+        entry->leased = false;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void attr_cache_invalidate(struct attr_cache *cache, const char *path)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct attr_entry *entry = find_entry(cache, path);
+    if (entry != NULL) {
+        remove_entry(cache, entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Drops whatever is cached for path, or everything if path is NULL, because
+ * the server recalled the lease on it
+ */
+void attr_cache_recall(struct attr_cache *cache, const char *path)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->generation++;
+    if (path == NULL) {
+        while (cache->positive.head != NULL) {
+            remove_entry(cache, cache->positive.head);
+        }
+        while (cache->negative.head != NULL) {
+            remove_entry(cache, cache->negative.head);
+        }
+    } else {
+        struct attr_entry *entry = find_entry(cache, path);
+        if (entry != NULL) {
+            remove_entry(cache, entry);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
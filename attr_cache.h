@@ -0,0 +1,82 @@
+/**
+ * attr_cache.h
+ *
+ * Client-side cache of file attributes keyed by path. Entries are answered
+ * from memory until they are older than the configured timeout; after that
+ * the caller fetches fresh attributes from the server and stores them again,
+ * which also tells it whether the file changed (mtime or size) in the
+ * meantime.
+ *
+ * Paths the server reported missing are kept as negative entries along with
+ * the mtime their parent directory had at the time. They remain valid until
+ * the negative timeout runs out or the parent's mtime moves, since a directory
+ * can't gain an entry without its mtime changing.
+ *
+ * When the server grants leases, attributes fetched under one are kept for
+ * the much longer lease timeout instead, until the server recalls the lease.
+ * Every recall bumps the cache's generation; callers read it before asking
+ * the server, so a result that raced with a recall is only kept for the
+ * ordinary timeout.
+ */
+
+#ifndef _ATTR_CACHE_H_
+#define _ATTR_CACHE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "net.h"
+
+#define ATTR_CACHE_BUCKETS 16384
+#define ATTR_CACHE_MAX_ENTRIES 65536
+#define ATTR_CACHE_MAX_NEGATIVE 16384
+
+struct attr_entry {
+    char *path;
+    bool negative;
+    bool leased;                    /* Kept until recalled or lease_timeout */
+    struct attr_stat atst;          /* Valid for positive entries */
+    struct timespec parent_mtim;    /* Valid for negative entries */
+    struct timespec fetched;
+    struct attr_entry *hash_next;
+    struct attr_entry *lru_prev;
+    struct attr_entry *lru_next;
+};
+
+/* Positive and negative entries are evicted separately, each in LRU order */
+struct attr_lru {
+    struct attr_entry *head;    /* Most recently used */
+    struct attr_entry *tail;    /* Next to be evicted */
+    size_t count;
+};
+
+struct attr_cache {
+    pthread_mutex_t lock;
+    double timeout;
+    double negative_timeout;
+    double lease_timeout;       /* 0 without leases */
+    uint64_t generation;        /* Bumped by every recall */
+    struct attr_entry *buckets[ATTR_CACHE_BUCKETS];
+    struct attr_lru positive;
+    struct attr_lru negative;
+};
+
+void attr_cache_init(struct attr_cache *cache, double timeout, double negative_timeout,
+        double lease_timeout);
+bool attr_cache_lookup(struct attr_cache *cache, const char *path, struct attr_stat *atst);
+uint64_t attr_cache_generation(struct attr_cache *cache);
+bool attr_cache_store(struct attr_cache *cache, const char *path, const struct attr_stat *atst,
+        uint64_t generation, bool leased);
+bool attr_cache_lookup_negative(struct attr_cache *cache, const char *path,
+        struct timespec *parent_mtim);
+void attr_cache_store_negative(struct attr_cache *cache, const char *path,
+        const struct timespec *parent_mtim);
+void attr_cache_invalidate(struct attr_cache *cache, const char *path);
+void attr_cache_recall(struct attr_cache *cache, const char *path);
+
+double timespec_elapsed(const struct timespec *since);
+
+#endif
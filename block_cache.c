@@ -0,0 +1,446 @@
+#include "block_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+
+/* FNV-1a over the path, then the block index */
+static size_t hash_block(const char *path, uint64_t index)
+{
+    size_t hash = 14695981039346656037ULL;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= index;
+    hash *= 1099511628211ULL;
+    return hash % BLOCK_CACHE_BUCKETS;
+}
+
+static bool same_version(const struct cache_block *block, const struct open_file *file)
+{
+    return block->file_size == file->size
+        && block->mtim.tv_sec == file->mtim.tv_sec
+        && block->mtim.tv_nsec == file->mtim.tv_nsec;
+}
+
+static void lru_unlink(struct block_cache *cache, struct cache_block *block)
+{
+    if (block->lru_prev != NULL) {
+        block->lru_prev->lru_next = block->lru_next;
+    } else {
+        cache->lru_head = block->lru_next;
+    }
+    if (block->lru_next != NULL) {
+        block->lru_next->lru_prev = block->lru_prev;
+    } else {
+        cache->lru_tail = block->lru_prev;
+    }
+    block->lru_prev = NULL;
+    block->lru_next = NULL;
+}
+
+static void lru_push(struct block_cache *cache, struct cache_block *block)
+{
+    block->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL) {
+        cache->lru_head->lru_prev = block;
+    }
+    cache->lru_head = block;
+    if (cache->lru_tail == NULL) {
+        cache->lru_tail = block;
+    }
+}
+
+static void free_block(struct cache_block *block)
+{
+    free(block->data);
+    free(block->path);
+    free(block);
+}
+
+/*
+ * Takes a block out of the table so no new reader can find it. The memory
+ * goes once the last reader or loader lets go. Called with the lock held.
+ */
+static void unhash_block(struct block_cache *cache, struct cache_block *block)
+{
+    struct cache_block **link = &cache->buckets[hash_block(block->path, block->index)];
+    while (*link != block) {
+        link = &(*link)->hash_next;
+    }
+    *link = block->hash_next;
+    lru_unlink(cache, block);
+    cache->bytes -= BLOCK_CACHE_BLOCK_SIZE;
+    block->hashed = false;
+
+    if (block->refs == 0) {
+        free_block(block);
+    }
+}
+
+static void put_block(struct cache_block *block)
+{
+    if (--block->refs == 0 && !block->hashed) {
+        free_block(block);
+    }
+}
+
+/*
+ * Evicts unused blocks from the cold end of the LRU list until the cache fits
+ * in its budget. Blocks still being loaded or read are skipped.
+ */
+static void evict_blocks(struct block_cache *cache)
+{
+    struct cache_block *block = cache->lru_tail;
+    while (cache->bytes > cache->max_bytes && block != NULL) {
+        struct cache_block *prev = block->lru_prev;
+        if (block->refs == 0) {
+            unhash_block(cache, block);
+        }
+        block = prev;
+    }
+}
+
+/*
+ * Finds the block of file at index, or adds an empty one for the caller to
+ * load, in which case *created is set. Either way the caller holds a
+ * reference to it and must give it back with put_block. Called with the lock
+ * held.
+ */
+static struct cache_block *claim_block(struct block_cache *cache,
+        struct open_file *file, uint64_t index, bool *created)
+{
+    size_t bucket = hash_block(file->path, index);
+    struct cache_block *block = cache->buckets[bucket];
+    while (block != NULL && (block->index != index
+                || !same_version(block, file)
+                || strcmp(block->path, file->path) != 0)) {
+        block = block->hash_next;
+    }
+
+    *created = block == NULL;
+    if (block != NULL) {
+        lru_unlink(cache, block);
+        lru_push(cache, block);
+        block->refs++;
+        return block;
+    }
+
+    block = calloc(1, sizeof(struct cache_block));
+    if (block == NULL
+            || (block->path = strdup(file->path)) == NULL
+            || (block->data = malloc(BLOCK_CACHE_BLOCK_SIZE)) == NULL) {
+        perror("malloc");
+        if (block != NULL) {
+            free(block->path);
+            free(block);
+        }
+        return NULL;
+    }
+    block->index = index;
+    block->mtim = file->mtim;
+    block->file_size = file->size;
+    block->state = BLOCK_LOADING;
+    block->refs = 1;
+    block->hashed = true;
+
+    block->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = block;
+    lru_push(cache, block);
+    cache->bytes += BLOCK_CACHE_BLOCK_SIZE;
+    evict_blocks(cache);
+    return block;
+}
+
+/*
+ * Fetches the contents of a block from the server and wakes up anyone waiting
+ * for it. Failed blocks are unhashed so the next reader tries again. Called
+ * with the lock held; it is dropped during the fetch.
+ */
+static void load_block(struct block_cache *cache, struct open_file *file,
+        struct cache_block *block)
+{
+    pthread_mutex_unlock(&cache->lock);
+    ssize_t res = cache->fetch(file, (off_t) block->index * BLOCK_CACHE_BLOCK_SIZE,
+            BLOCK_CACHE_BLOCK_SIZE, block->data);
+    pthread_mutex_lock(&cache->lock);
+
+    if (res < 0) {
+        block->state = BLOCK_FAILED;
+        block->error = res;
+        if (block->hashed) {
+            unhash_block(cache, block);
+        }
+    } else {
+        block->state = BLOCK_READY;
+        block->len = res;
+    }
+    pthread_cond_broadcast(&cache->loaded);
+}
+
+static void *readahead_thread(void *arg)
+{
+    struct block_cache *cache = arg;
+
+    pthread_mutex_lock(&cache->lock);
+    for (;;) {
+        while (cache->jobs_head == NULL) {
+            pthread_cond_wait(&cache->job_ready, &cache->lock);
+        }
+        struct readahead_job *job = cache->jobs_head;
+        cache->jobs_head = job->next;
+        if (cache->jobs_head == NULL) {
+            cache->jobs_tail = NULL;
+        }
+
+        load_block(cache, job->file, job->block);
+        put_block(job->block);
+        job->file->inflight--;
+        pthread_cond_broadcast(&cache->job_done);
+        free(job);
+    }
+    return NULL;
+}
+
+/*
+ * Sets up an empty cache and starts the readahead threads. A max_bytes of 0
+ * turns caching off and sends every read straight to the server.
+ */
+int block_cache_init(struct block_cache *cache, size_t max_bytes,
+        unsigned max_readahead, block_fetch_fn fetch)
+{
+    memset(cache, 0, sizeof(struct block_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+    pthread_cond_init(&cache->job_ready, NULL);
+    pthread_cond_init(&cache->job_done, NULL);
+    cache->fetch = fetch;
+    cache->max_bytes = max_bytes;
+
+    // Blocks read ahead must not push each other out before they are used
+    size_t max_blocks = max_bytes / BLOCK_CACHE_BLOCK_SIZE;
+    cache->max_readahead = max_readahead < max_blocks / 2 ? max_readahead : max_blocks / 2;
+
+    if (max_bytes == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < BLOCK_CACHE_READAHEAD_THREADS; i++) {
+        int err = pthread_create(&cache->threads[i], NULL, readahead_thread, cache);
+        if (err != 0) {
+            errno = err;
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Queues the blocks that follow the end of a sequential read, up to the
+ * file's readahead window, skipping ones that are already cached or
+ * requested. Called with the lock held.
+ */
+static void queue_readahead(struct block_cache *cache, struct open_file *file,
+        uint64_t last_index)
+{
+    uint64_t first = file->readahead_next > last_index + 1
+        ? file->readahead_next : last_index + 1;
+    uint64_t end = last_index + 1 + file->readahead_window;
+    uint64_t num_blocks = (file->size + BLOCK_CACHE_BLOCK_SIZE - 1) / BLOCK_CACHE_BLOCK_SIZE;
+    if (end > num_blocks) {
+        end = num_blocks;
+    }
+
+    for (uint64_t index = first; index < end; index++) {
+        bool created;
+        struct cache_block *block = claim_block(cache, file, index, &created);
+        if (block == NULL) {
+            break;
+        }
+        if (!created) {
+            put_block(block);
+            continue;
+        }
+
+        struct readahead_job *job = malloc(sizeof(struct readahead_job));
+        if (job == NULL) {
+            perror("malloc");
+            block->state = BLOCK_FAILED;
+            block->error = -ENOMEM;
+            unhash_block(cache, block);
+            put_block(block);
+            break;
+        }
+        job->file = file;
+        job->block = block;
+        job->next = NULL;
+        if (cache->jobs_tail != NULL) {
+            cache->jobs_tail->next = job;
+        } else {
+            cache->jobs_head = job;
+        }
+        cache->jobs_tail = job;
+        file->inflight++;
+        pthread_cond_signal(&cache->job_ready);
+    }
+
+    if (end > file->readahead_next) {
+        file->readahead_next = end;
+    }
+}
+
+/*
+ * Reads size bytes of an open file at offset into buf, from cached blocks
+ * where possible. Returns the number of bytes read, which is short only at
+ * the end of the file, or a negative errno.
+ */
+ssize_t block_cache_read(struct block_cache *cache, struct open_file *file,
+        char *buf, size_t size, off_t offset)
+{
+    if (cache->max_bytes == 0) {
+        return cache->fetch(file, offset, size, buf);
+    }
+
+    ssize_t res = 0;
+    size_t copied = 0;
+    bool retried = false;
+
+    pthread_mutex_lock(&cache->lock);
+    while (copied < size) {
+        off_t pos = offset + copied;
+        uint64_t index = pos / BLOCK_CACHE_BLOCK_SIZE;
+        size_t in_block = pos % BLOCK_CACHE_BLOCK_SIZE;
+
+        bool created;
+        struct cache_block *block = claim_block(cache, file, index, &created);
+        if (block == NULL) {
+            res = -ENOMEM;
+            break;
+        }
+        if (created) {
+            load_block(cache, file, block);
+        }
+        while (block->state == BLOCK_LOADING) {
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+        }
+
+        if (block->state == BLOCK_FAILED) {
+            res = block->error;
+            put_block(block);
+            // A block someone else failed to read ahead (or gave up on when
+            // its file was closed) is worth one fetch of our own
+            if (!created && !retried) {
+                retried = true;
+                continue;
+            }
+            break;
+        }
+
+        // Loaded blocks never change, so they can be copied without the lock
+        size_t len = 0;
+        if (in_block < block->len) {
+            len = block->len - in_block;
+            if (len > size - copied) {
+                len = size - copied;
+            }
+            pthread_mutex_unlock(&cache->lock);
+            memcpy(buf + copied, block->data + in_block, len);
+            pthread_mutex_lock(&cache->lock);
+        }
+        bool eof = block->len < BLOCK_CACHE_BLOCK_SIZE;
+        put_block(block);
+
+        copied += len;
+        retried = false;
+        res = 0;
+        if (eof || len == 0) {
+            break;
+        }
+    }
+
+    // Reads that carry on where the last one stopped grow the readahead
+    // window; anything else means the file isn't being streamed
+    if (copied > 0) {
+        if (offset == file->next_offset) {
+            if (file->readahead_window == 0) {
+                file->readahead_window = 2;
+            } else if (file->readahead_window * 2 <= cache->max_readahead) {
+                file->readahead_window *= 2;
+            } else {
+                file->readahead_window = cache->max_readahead;
+            }
+        } else {
+            file->readahead_window = 0;
+            file->readahead_next = 0;
+        }
+        file->next_offset = offset + copied;
+
+        if (file->readahead_window > 0 && cache->max_readahead > 0) {
+            queue_readahead(cache, file, (offset + copied - 1) / BLOCK_CACHE_BLOCK_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return copied > 0 ? (ssize_t) copied : res;
+}
+
+/*
+ * Cancels the readahead still queued for a file that is being closed and
+ * waits for the jobs already running, so the file's state and server handle
+ * can be let go afterwards.
+ */
+void block_cache_close(struct block_cache *cache, struct open_file *file)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct readahead_job **link = &cache->jobs_head;
+    cache->jobs_tail = NULL;
+    while (*link != NULL) {
+        struct readahead_job *job = *link;
+        if (job->file != file) {
+            cache->jobs_tail = job;
+            link = &job->next;
+            continue;
+        }
+
+        *link = job->next;
+        job->block->state = BLOCK_FAILED;
+        job->block->error = -ECANCELED;
+        if (job->block->hashed) {
+            unhash_block(cache, job->block);
+        }
+        put_block(job->block);
+        file->inflight--;
+        free(job);
+    }
+    pthread_cond_broadcast(&cache->loaded);
+
+    while (file->inflight > 0) {
+        pthread_cond_wait(&cache->job_done, &cache->lock);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Drops every cached block of path, for when its attributes show that it
+ * changed on the server.
+ */
+void block_cache_invalidate(struct block_cache *cache, const char *path)
+{
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < BLOCK_CACHE_BUCKETS; i++) {
+        struct cache_block *block = cache->buckets[i];
+        while (block != NULL) {
+            struct cache_block *next = block->hash_next;
+            if (strcmp(block->path, path) == 0) {
+                unhash_block(cache, block);
+            }
+            block = next;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
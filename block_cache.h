@@ -0,0 +1,104 @@
+/**
+ * block_cache.h
+ *
+ * Client-side cache of file contents in fixed-size blocks. Reads are served
+ * from cached blocks and only the missing ones are fetched from the server,
+ * a whole block at a time. Blocks are tagged with the mtime and size the file
+ * had when it was opened, so once either changes the old blocks no longer
+ * match and are dropped.
+ *
+ * Every open file tracks where its last read ended. When reads keep following
+ * on from each other, the next blocks are fetched ahead of time by background
+ * threads, with the window doubling on every sequential read up to the
+ * configured maximum. Memory use is capped, and the least recently used
+ * blocks are evicted once the cap is reached.
+ */
+
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define BLOCK_CACHE_BLOCK_SIZE (128 * 1024)
+#define BLOCK_CACHE_BUCKETS 4096
+#define BLOCK_CACHE_READAHEAD_THREADS 4
+
+enum block_state {
+    BLOCK_LOADING,
+    BLOCK_READY,
+    BLOCK_FAILED,
+};
+
+struct cache_block {
+    char *path;
+    uint64_t index;
+    struct timespec mtim;       /* Version of the file the data belongs to */
+    int64_t file_size;
+    char *data;
+    size_t len;                 /* Less than a block at the end of the file */
+    enum block_state state;
+    int error;                  /* Negative errno if the fetch failed */
+    int refs;                   /* Readers and loaders using the block */
+    bool hashed;                /* Still findable; freed on last ref if not */
+    struct cache_block *hash_next;
+    struct cache_block *lru_prev;
+    struct cache_block *lru_next;
+};
+
+/* Per-open state, kept in fuse_file_info's fh */
+struct open_file {
+    char *path;
+    uint64_t handle;            /* Server handle from MSG_OPEN, 0 if inlined */
+    char *inline_data;          /* Whole file, if the server sent it with the */
+    size_t inline_len;          /* reply to MSG_OPEN */
+    struct timespec mtim;
+    int64_t size;
+    off_t next_offset;          /* Where the last read ended */
+    uint64_t readahead_next;    /* First block not yet requested */
+    unsigned readahead_window;  /* Blocks to keep requested ahead */
+    int inflight;               /* Readahead jobs queued or running */
+};
+
+/*
+ * Fetches size bytes of an open file starting at offset into buf. Returns the
+ * number of bytes read (fewer at the end of the file) or a negative errno.
+ */
+typedef ssize_t (*block_fetch_fn)(const struct open_file *file,
+        off_t offset, size_t size, char *buf);
+
+struct readahead_job {
+    struct open_file *file;
+    struct cache_block *block;
+    struct readahead_job *next;
+};
+
+struct block_cache {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;      /* A block finished loading */
+    pthread_cond_t job_ready;
+    pthread_cond_t job_done;
+    block_fetch_fn fetch;
+    size_t max_bytes;
+    size_t bytes;
+    unsigned max_readahead;     /* Blocks */
+    struct cache_block *buckets[BLOCK_CACHE_BUCKETS];
+    struct cache_block *lru_head;   /* Most recently used */
+    struct cache_block *lru_tail;   /* Next to be evicted */
+    struct readahead_job *jobs_head;
+    struct readahead_job *jobs_tail;
+    pthread_t threads[BLOCK_CACHE_READAHEAD_THREADS];
+};
+
+int block_cache_init(struct block_cache *cache, size_t max_bytes,
+        unsigned max_readahead, block_fetch_fn fetch);
+ssize_t block_cache_read(struct block_cache *cache, struct open_file *file,
+        char *buf, size_t size, off_t offset);
+void block_cache_close(struct block_cache *cache, struct open_file *file);
+void block_cache_invalidate(struct block_cache *cache, const char *path);
+
+#endif
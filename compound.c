@@ -0,0 +1,133 @@
+#include "compound.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "logging.h"
+#include "net.h"
+
+void compound_init(struct compound *compound)
+{
+    memset(compound, 0, sizeof(struct compound));
+}
+
+void compound_free(struct compound *compound)
+{
+    free(compound->body);
+    free(compound->reply);
+    compound_init(compound);
+}
+
+static int body_append(struct compound *compound, const void *data, size_t len)
+{
+    if (compound->len + len > compound->cap) {
+        size_t cap = compound->cap > 0 ? compound->cap : 1024;
+        while (cap < compound->len + len) {
+            cap *= 2;
+        }
+        char *body = realloc(compound->body, cap);
+        if (body == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        compound->body = body;
+        compound->cap = cap;
+    }
+    memcpy(compound->body + compound->len, data, len);
+    compound->len += len;
+    return 0;
+}
+
+/*
+ * Adds an operation about node and path; a NULL path stands for the node and
+ * path the compound is sent with. reply_max is the most reply data the
+ * operation can produce. Returns -1 if the compound or its reply would grow
+ * larger than the server accepts, in which case the caller sends what it has
+ * and starts another.
+ */
+int compound_add(struct compound *compound, uint16_t type, uint64_t node,
+        const char *path, const void *args, size_t args_len, size_t reply_max)
+{
+    struct netfs_compound_op op = { 0 };
+    op.msg_type = type;
+    op.path_len = path != NULL ? strlen(path) + 1 : 0;
+    op.node = node;
+
+    size_t len = sizeof(struct netfs_compound_op) + op.path_len + args_len;
+    size_t reply_len = sizeof(struct netfs_compound_result) + reply_max;
+    if (compound->count >= NETFS_COMPOUND_MAX_OPS
+            || op.path_len > MAXIMUM_PATH
+            || compound->len + len > NETFS_COMPOUND_MAX_BODY
+            || reply_max > NETFS_COMPOUND_MAX_REPLY
+            || compound->reply_cap + reply_len > NETFS_COMPOUND_MAX_REPLY) {
+        return -1;
+    }
+
+    size_t old_len = compound->len;
+    if (body_append(compound, &op, sizeof(struct netfs_compound_op)) == -1
+            || (op.path_len > 0 && body_append(compound, path, op.path_len) == -1)
+            || (args_len > 0 && body_append(compound, args, args_len) == -1)) {
+        compound->len = old_len;
+        return -1;
+    }
+
+    compound->count++;
+    compound->reply_cap += reply_len;
+    return 0;
+}
+
+/*
+ * Sends every operation added so far in a single request and waits for the
+ * results. Returns 0 once they can be read with compound_next_result, or a
+ * negative errno if the compound as a whole failed.
+ */
+int compound_call(struct conn_pool *pool, struct compound *compound, uint64_t node,
+        const char *path)
+{
+    free(compound->reply);
+    compound->reply = malloc(compound->reply_cap > 0 ? compound->reply_cap : 1);
+    compound->reply_len = 0;
+    compound->reply_pos = 0;
+    if (compound->reply == NULL) {
+        perror("malloc");
+        return -ENOMEM;
+    }
+
+    struct netfs_compound_args args = { 0 };
+    args.count = compound->count;
+    args.body_len = compound->len;
+
+    return conn_call_body(pool, MSG_COMPOUND, node, path, &args, sizeof(args),
+            compound->body, compound->len,
+            compound->reply, compound->reply_cap, &compound->reply_len);
+}
+
+/*
+ * Gets the result of the next operation, in the order they were added.
+ * Returns -1 if the reply holds no more results.
+ */
+int compound_next_result(struct compound *compound, struct compound_result *result)
+{
+    struct netfs_compound_result header;
+    size_t pos = compound->reply_pos;
+
+    if (pos + sizeof(struct netfs_compound_result) > compound->reply_len) {
+        return -1;
+    }
+    memcpy(&header, compound->reply + pos, sizeof(struct netfs_compound_result));
+    pos += sizeof(struct netfs_compound_result);
+    if (pos + header.len > compound->reply_len) {
+        LOG_WARN("%s\n", "Truncated compound result");
+        return -1;
+    }
+
+    result->msg_type = header.msg_type;
+    result->status = -header.status;
+    result->data = compound->reply + pos;
+    result->len = header.len;
+    compound->reply_pos = pos + header.len;
+    return 0;
+}
@@ -0,0 +1,44 @@
+/**
+ * compound.h
+ *
+ * Client-side builder for MSG_COMPOUND requests. Operations are added one at
+ * a time along with the most reply data each may produce; the whole list is
+ * then sent in one round-trip and the results are walked in the same order.
+ */
+
+#ifndef _COMPOUND_H_
+#define _COMPOUND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conn_pool.h"
+
+struct compound {
+    char *body;                 /* Encoded operations */
+    size_t len;
+    size_t cap;
+    uint16_t count;
+    size_t reply_cap;           /* Most reply data the operations can produce */
+    char *reply;                /* Filled in by compound_call */
+    size_t reply_len;
+    size_t reply_pos;           /* Where compound_next_result is up to */
+};
+
+/* One operation's result, pointing into the compound's reply buffer */
+struct compound_result {
+    uint16_t msg_type;
+    int status;                 /* 0 or a negative errno */
+    const char *data;
+    size_t len;
+};
+
+void compound_init(struct compound *compound);
+void compound_free(struct compound *compound);
+int compound_add(struct compound *compound, uint16_t type, uint64_t node,
+        const char *path, const void *args, size_t args_len, size_t reply_max);
+int compound_call(struct conn_pool *pool, struct compound *compound, uint64_t node,
+        const char *path);
+int compound_next_result(struct compound *compound, struct compound_result *result);
+
+#endif
@@ -0,0 +1,332 @@
+#include "compress.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "logging.h"
+#include "net.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+/* The format wants the last 5 bytes as literals, and no match starting in
+ * the last 12 */
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+/* Blocks that don't shrink below this fraction (in 1/8ths) are sent raw */
+#define COMPRESS_WORTH_EIGHTHS 7
+
+#define COMPRESS_MAX_BACKOFF 64
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(uint32_t));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Appends one sequence: literals, then a match of match_len bytes offset
+ * bytes back, or no match at all for the last sequence (match_len 0).
+ * Returns -1 if it doesn't fit in cap.
+ */
+static int lz_emit(unsigned char *dst, size_t cap, size_t *pos,
+        const unsigned char *literals, size_t literal_len, size_t offset,
+        size_t match_len)
+{
+    size_t need = 1 + literal_len / 255 + 1 + literal_len + 2 + match_len / 255 + 1;
+    if (*pos + need > cap) {
+        return -1;
+    }
+
+    unsigned char *out = dst + *pos;
+    unsigned char *token = out++;
+    size_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    *token = (literal_len < 15 ? literal_len : 15) << 4
+            | (match_code < 15 ? match_code : 15);
+
+    if (literal_len >= 15) {
+        size_t rest = literal_len - 15;
+        for (; rest >= 255; rest -= 255) {
+            *out++ = 255;
+        }
+        *out++ = rest;
+    }
+    memcpy(out, literals, literal_len);
+    out += literal_len;
+
+    if (match_len > 0) {
+        *out++ = offset & 0xff;
+        *out++ = offset >> 8;
+        if (match_code >= 15) {
+            size_t rest = match_code - 15;
+            for (; rest >= 255; rest -= 255) {
+                *out++ = 255;
+            }
+            *out++ = rest;
+        }
+    }
+
+    *pos = out - dst;
+    return 0;
+}
+
+/*
+ * Compresses len bytes into dst in LZ4 block format, with a single-probe hash
+ * table that skips ahead faster the longer it goes without a match. Returns
+ * the compressed length, or 0 if that would be more than cap.
+ */
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap)
+{
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t pos = 0;
+    size_t anchor = 0;
+    size_t written = 0;
+
+    if (len > LZ_MATCH_LIMIT) {
+        size_t limit = len - LZ_MATCH_LIMIT;
+        size_t match_end = len - LZ_LAST_LITERALS;
+        while (pos < limit) {
+            uint32_t sequence = read32(in + pos);
+            uint32_t hash = lz_hash(sequence);
+            size_t ref = table[hash];
+            table[hash] = pos;
+
+            if (ref >= pos || pos - ref > LZ_MAX_OFFSET
+                    || read32(in + ref) != sequence) {
+                pos += 1 + ((pos - anchor) >> 6);
+                continue;
+            }
+
+            size_t match_len = LZ_MIN_MATCH;
+            while (pos + match_len < match_end && in[ref + match_len] == in[pos + match_len]) {
+                match_len++;
+            }
+
+            if (lz_emit(out, cap, &written, in + anchor, pos - anchor,
+                        pos - ref, match_len) == -1) {
+                return 0;
+            }
+            pos += match_len;
+            anchor = pos;
+        }
+    }
+
+    if (lz_emit(out, cap, &written, in + anchor, len - anchor, 0, 0) == -1) {
+        return 0;
+    }
+    return written;
+}
+
+/*
+ * Reads an LZ4 length continuation: bytes of 255 followed by one that isn't
+ */
+static int lz_length(const unsigned char *in, size_t len, size_t *pos, size_t *value)
+{
+    unsigned char byte;
+    do {
+        if (*pos >= len) {
+            return -1;
+        }
+        byte = in[(*pos)++];
+        *value += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/*
+ * Decompresses an LZ4 block into dst. Returns the decompressed length, or -1
+ * if the input is malformed or wouldn't fit in cap.
+ */
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t cap)
+{
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *out = (unsigned char *) dst;
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < len) {
+        unsigned char token = in[ip++];
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && lz_length(in, len, &ip, &literal_len) == -1) {
+            return -1;
+        }
+        if (literal_len > len - ip || literal_len > cap - op) {
+            return -1;
+        }
+        memcpy(out + op, in + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        // The last sequence has no match
+        if (ip == len) {
+            break;
+        }
+
+        if (len - ip < 2) {
+            return -1;
+        }
+        size_t offset = in[ip] | (size_t) in[ip + 1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && lz_length(in, len, &ip, &match_len) == -1) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > cap - op) {
+            return -1;
+        }
+
+        // Matches may overlap what they produce, so copy forwards bytewise
+        // unless they are far enough back not to
+        const unsigned char *match = out + op - offset;
+        if (offset >= match_len) {
+            memcpy(out + op, match, match_len);
+        } else {
+            for (size_t i = 0; i < match_len; i++) {
+                out[op + i] = match[i];
+            }
+        }
+        op += match_len;
+    }
+    return op;
+}
+
+/*
+ * Most bytes compress_stream can produce from len bytes: every block raw,
+ * plus its header
+ */
+size_t compress_bound(size_t len)
+{
+    size_t blocks = (len + NETFS_BLOCK_SIZE - 1) / NETFS_BLOCK_SIZE;
+    return len + blocks * sizeof(struct netfs_block);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Records that compression didn't pay for a block, so the next ones are sent
+ * raw for a while
+ */
+static void adapt_give_up(struct compress_adapt *adapt)
+{
+    int backoff = __atomic_load_n(&adapt->backoff, __ATOMIC_RELAXED);
+    backoff = backoff == 0 ? 1 : backoff * 2;
+    if (backoff > COMPRESS_MAX_BACKOFF) {
+        backoff = COMPRESS_MAX_BACKOFF;
+    }
+    __atomic_store_n(&adapt->backoff, backoff, __ATOMIC_RELAXED);
+    __atomic_store_n(&adapt->skip, backoff, __ATOMIC_RELAXED);
+}
+
+/*
+ * Tries to compress one block into dst. Returns the compressed length, or 0
+ * if the block should be sent raw.
+ */
+static size_t compress_block(struct compress_adapt *adapt, const char *src,
+        size_t len, char *dst)
+{
+    if (__atomic_load_n(&adapt->skip, __ATOMIC_RELAXED) > 0) {
+        __atomic_fetch_sub(&adapt->skip, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    uint64_t start = adapt->min_rate > 0 ? now_ns() : 0;
+    size_t compressed = lz_compress(src, len, dst, len * COMPRESS_WORTH_EIGHTHS / 8);
+    if (compressed == 0) {
+        adapt_give_up(adapt);
+        return 0;
+    }
+
+    // Compressing slower than the link can carry the raw bytes only delays
+    // them. MiB/s is close enough to bytes per microsecond for this.
+    if (adapt->min_rate > 0 && len / ((now_ns() - start) / 1000 + 1) < adapt->min_rate) {
+        adapt_give_up(adapt);
+    } else {
+        __atomic_store_n(&adapt->backoff, 0, __ATOMIC_RELAXED);
+    }
+    return compressed;
+}
+
+/*
+ * Encodes len bytes as a stream of blocks into dst, which must hold
+ * compress_bound(len) bytes. Returns the length of the stream.
+ */
+size_t compress_stream(struct compress_adapt *adapt, const char *src, size_t len,
+        char *dst)
+{
+    size_t out = 0;
+    for (size_t pos = 0; pos < len; pos += NETFS_BLOCK_SIZE) {
+        struct netfs_block block = { 0 };
+        block.raw_len = len - pos < NETFS_BLOCK_SIZE ? len - pos : NETFS_BLOCK_SIZE;
+
+        char *data = dst + out + sizeof(struct netfs_block);
+        block.len = compress_block(adapt, src + pos, block.raw_len, data);
+        if (block.len > 0) {
+            block.flags = NETFS_BLOCK_COMPRESSED;
+        } else {
+            memcpy(data, src + pos, block.raw_len);
+            block.len = block.raw_len;
+        }
+
+        memcpy(dst + out, &block, sizeof(struct netfs_block));
+        out += sizeof(struct netfs_block) + block.len;
+    }
+    return out;
+}
+
+/*
+ * Decodes a stream of blocks into dst. Returns the decoded length, or -1 if
+ * the stream is malformed or holds more than cap bytes.
+ */
+ssize_t decompress_stream(const char *src, size_t len, char *dst, size_t cap)
+{
+    size_t pos = 0;
+    size_t out = 0;
+
+    while (pos < len) {
+        struct netfs_block block;
+        if (len - pos < sizeof(struct netfs_block)) {
+            return -1;
+        }
+        memcpy(&block, src + pos, sizeof(struct netfs_block));
+        pos += sizeof(struct netfs_block);
+        if (block.len > len - pos || block.raw_len > cap - out) {
+            return -1;
+        }
+
+        if (block.flags & NETFS_BLOCK_COMPRESSED) {
+            ssize_t res = lz_decompress(src + pos, block.len, dst + out, block.raw_len);
+            if (res != (ssize_t) block.raw_len) {
+                LOG_WARN("Bad compressed block: %zd of %u bytes\n", res, block.raw_len);
+                return -1;
+            }
+        } else if (block.len != block.raw_len) {
+            return -1;
+        } else {
+            memcpy(dst + out, src + pos, block.len);
+        }
+        pos += block.len;
+        out += block.raw_len;
+    }
+    return out;
+}
@@ -0,0 +1,36 @@
+/**
+ * compress.h
+ *
+ * Built-in LZ4 block-format codec and the block stream that compressed reply
+ * bodies travel in (see struct netfs_block in net.h). The encoder is adaptive:
+ * after a block that compression didn't shrink enough, or that compressed
+ * more slowly than the link can carry it raw, the next few blocks are sent as
+ * they are, backing off further each time compression still doesn't pay.
+ */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Adaptive state for one connection. Several workers may be compressing
+ * replies for it at once; the fields are only hints, so they are updated
+ * without a lock.
+ */
+struct compress_adapt {
+    unsigned min_rate;          /* MiB/s compression must beat; 0 for any */
+    int skip;                   /* Blocks still to send uncompressed */
+    int backoff;                /* What skip is set to the next time */
+};
+
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap);
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t cap);
+
+size_t compress_bound(size_t len);
+size_t compress_stream(struct compress_adapt *adapt, const char *src, size_t len,
+        char *dst);
+ssize_t decompress_stream(const char *src, size_t len, char *dst, size_t cap);
+
+#endif
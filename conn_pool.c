@@ -0,0 +1,579 @@
+#define _GNU_SOURCE
+
+#include "conn_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "compress.h"
+#include "logging.h"
+#include "net.h"
+
+/* What a reader thread needs to know about the connection it serves */
+struct reader_args {
+    struct conn_pool *pool;
+    struct pool_conn *conn;
+    int fd;
+    uint32_t compress_types;
+    bool leases;
+};
+
+/* Where a reader decodes compressed replies, grown as needed */
+struct reader_buf {
+    char *data;
+    size_t cap;
+};
+
+static char *reader_buf_get(struct reader_buf *buf, size_t len)
+{
+    if (len > buf->cap) {
+        char *data = realloc(buf->data, len);
+        if (data == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        buf->data = data;
+        buf->cap = len;
+    }
+    return buf->data;
+}
+
+int conn_pool_init(struct conn_pool *pool, char *hostname, int port)
+{
+    memset(pool, 0, sizeof(struct conn_pool));
+    if (resolve_host(hostname, port, &pool->addr) == -1) {
+        return -1;
+    }
+    for (int i = 0; i < CONN_POOL_SIZE; i++) {
+        pthread_mutex_init(&pool->conns[i].send_lock, NULL);
+        pthread_mutex_init(&pool->conns[i].lock, NULL);
+        pool->conns[i].fd = -1;
+    }
+    return 0;
+}
+
+/*
+ * Shuts the connections down; their reader threads fail whatever is still
+ * outstanding and exit.
+ */
+void conn_pool_destroy(struct conn_pool *pool)
+{
+    for (int i = 0; i < CONN_POOL_SIZE; i++) {
+        struct pool_conn *conn = &pool->conns[i];
+        pthread_mutex_lock(&conn->lock);
+        conn->closing = true;
+        if (conn->fd != -1) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&conn->lock);
+    }
+}
+
+/*
+ * Removes and returns the pending call with the given ID. Called with the
+ * lock held.
+ */
+static struct pending_call *take_pending(struct pool_conn *conn, uint64_t id)
+{
+    struct pending_call **link = &conn->pending[id % CONN_PENDING_BUCKETS];
+    while (*link != NULL && (*link)->id != id) {
+        link = &(*link)->next;
+    }
+
+    struct pending_call *call = *link;
+    if (call != NULL) {
+        *link = call->next;
+    }
+    return call;
+}
+
+/*
+ * Marks the connection as broken and fails every request still waiting on
+ * it. The socket is closed under the send lock so nobody is writing to it, or
+ * to whatever later reuses its number. Connections the pool shut down itself
+ * go quietly.
+ */
+static void conn_fail(struct pool_conn *conn, int fd)
+{
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->closing) {
+        LOG_WARN("Dropping server connection: %d\n", fd);
+    }
+    conn->fd = -1;
+    for (int i = 0; i < CONN_PENDING_BUCKETS; i++) {
+        while (conn->pending[i] != NULL) {
+            struct pending_call *call = conn->pending[i];
+            conn->pending[i] = call->next;
+            call->failed = true;
+            call->done = true;
+            pthread_cond_signal(&call->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    pthread_mutex_lock(&conn->send_lock);
+    close(fd);
+    pthread_mutex_unlock(&conn->send_lock);
+}
+
+/*
+ * Moves len bytes from the socket into a pipe without copying them through
+ * user space. The pipe must have room for all of them.
+ */
+static int splice_len(int fd, int pipe_fd, size_t len)
+{
+    while (len > 0) {
+        ssize_t bytes = splice(fd, NULL, pipe_fd, NULL, len, SPLICE_F_MOVE);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("splice");
+            return -1;
+        } else if (bytes == 0) {
+            LOG("%s\n", "Stream reached EOF");
+            return -1;
+        }
+        len -= bytes;
+    }
+    return 0;
+}
+
+/*
+ * Reads a compressed reply body and decodes it for the caller. Returns the
+ * decoded length, or -EIO if the body doesn't decode, or -1 if the stream
+ * broke.
+ */
+static ssize_t read_compressed(int fd, struct pending_call *call, size_t len,
+        struct reader_buf *wire, struct reader_buf *raw)
+{
+    char *data = reader_buf_get(wire, len);
+    if (data == NULL || read_len(fd, data, len) <= 0) {
+        return -1;
+    }
+
+    // Replies that go to a pipe are decoded aside first
+    char *out = call->buf;
+    if (call->pipe_fd != -1) {
+        out = reader_buf_get(raw, call->cap);
+        if (out == NULL) {
+            return -EIO;
+        }
+    }
+
+    ssize_t decoded = decompress_stream(data, len, out, call->cap);
+    if (decoded < 0) {
+        LOG_WARN("Undecodable reply: id %llu\n", (unsigned long long) call->id);
+        return -EIO;
+    }
+    if (call->pipe_fd != -1 && decoded > 0 && write_len(call->pipe_fd, out, decoded) <= 0) {
+        return -EIO;
+    }
+    return decoded;
+}
+
+static void recall_all(struct conn_pool *pool)
+{
+    if (pool->recall != NULL) {
+        pool->recall(NULL, pool->recall_arg);
+    }
+}
+
+/*
+ * Reads a message the server pushed and passes it on. Returns -1 if the
+ * stream can't be trusted any more.
+ */
+static int read_push(struct conn_pool *pool, int fd, size_t len)
+{
+    char body[sizeof(struct netfs_push) + MAXIMUM_PATH];
+    struct netfs_push push;
+    if (len <= sizeof(struct netfs_push) || len > sizeof(body)
+            || read_len(fd, body, len) <= 0) {
+        LOG_WARN("Bad push: %zu bytes\n", len);
+        return -1;
+    }
+    memcpy(&push, body, sizeof(struct netfs_push));
+    body[len - 1] = '\0';
+
+    if (push.msg_type == MSG_INVALIDATE && pool->recall != NULL) {
+        const char *path = body + sizeof(struct netfs_push);
+        LOG("Lease recalled: %s\n", path);
+        pool->recall((push.flags & NETFS_INVALIDATE_ALL) ? NULL : path, pool->recall_arg);
+    }
+    return 0;
+}
+
+/*
+ * Reads replies off one connection for as long as it lasts, copying each body
+ * straight into the buffer of the caller waiting for it, or splicing it into
+ * the caller's pipe.
+ */
+static void *reader_thread(void *arg)
+{
+    struct reader_args *args = arg;
+    struct conn_pool *pool = args->pool;
+    struct pool_conn *conn = args->conn;
+    int fd = args->fd;
+    uint32_t compress_types = args->compress_types;
+    bool leases = args->leases;
+    free(args);
+
+    struct reader_buf wire = { 0 };
+    struct reader_buf raw = { 0 };
+
+    while (true) {
+        struct netfs_reply_header header;
+        if (read_len(fd, &header, sizeof(struct netfs_reply_header)) <= 0) {
+            break;
+        }
+
+        if (header.request_id == NETFS_PUSH_ID) {
+            if (read_push(pool, fd, header.len) == -1) {
+                break;
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        struct pending_call *call = take_pending(conn, header.request_id);
+        pthread_mutex_unlock(&conn->lock);
+
+        // Callers never give up on a request, so an unknown ID or a body that
+        // doesn't fit means the stream can't be trusted any more
+        bool compressed = call != NULL && call->type < 32
+                && (compress_types & (1u << call->type));
+        size_t cap = 0;
+        if (call != NULL) {
+            cap = compressed ? compress_bound(call->cap) : call->cap;
+        }
+        if (call == NULL || header.len > cap) {
+            LOG_WARN("Unexpected reply: id %llu, %llu bytes\n",
+                    (unsigned long long) header.request_id,
+                    (unsigned long long) header.len);
+            if (call != NULL) {
+                pthread_mutex_lock(&conn->lock);
+                call->failed = true;
+                call->done = true;
+                pthread_cond_signal(&call->done_cond);
+                pthread_mutex_unlock(&conn->lock);
+            }
+            break;
+        }
+
+        bool failed;
+        if (compressed && header.len > 0) {
+            ssize_t decoded = read_compressed(fd, call, header.len, &wire, &raw);
+            failed = decoded == -1;
+            if (decoded < 0) {
+                header.status = EIO;
+                header.len = 0;
+            } else {
+                header.len = decoded;
+            }
+        } else if (call->pipe_fd != -1) {
+            failed = splice_len(fd, call->pipe_fd, header.len) == -1;
+        } else {
+            failed = header.len > 0 && read_len(fd, call->buf, header.len) <= 0;
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        call->status = header.status;
+        call->len = header.len;
+        call->failed = failed;
+        call->done = true;
+        pthread_cond_signal(&call->done_cond);
+        pthread_mutex_unlock(&conn->lock);
+
+        if (failed) {
+            break;
+        }
+    }
+
+    free(wire.data);
+    free(raw.data);
+    conn_fail(conn, fd);
+    if (leases) {
+        recall_all(pool);
+    }
+    return NULL;
+}
+
+/*
+ * Asks the server for the compression, leases and node IDs the pool wants,
+ * before anything else is sent on fd, and fills in agreed with what it
+ * granted.
+ * Returns -1 if the connection failed.
+ */
+static int conn_hello(struct conn_pool *pool, int fd, struct netfs_hello_args *agreed)
+{
+    struct netfs_hello_args args = { 0 };
+    args.compress_types = pool->compress_types;
+    args.codecs = NETFS_CODEC_LZ4;
+    if (__atomic_load_n(&pool->leases, __ATOMIC_RELAXED)) {
+        args.features = NETFS_FEATURE_LEASES;
+    }
+    if (pool->client_id != 0) {
+        args.features |= NETFS_FEATURE_NODES;
+        args.client_id = pool->client_id;
+    }
+    if (write_request(fd, MSG_HELLO, 0, 0, "/", &args, sizeof(args)) == -1) {
+        return -1;
+    }
+
+    struct netfs_reply_header header;
+    memset(agreed, 0, sizeof(struct netfs_hello_args));
+    if (read_len(fd, &header, sizeof(struct netfs_reply_header)) <= 0
+            || header.len > sizeof(struct netfs_hello_args)
+            || (header.len > 0 && read_len(fd, agreed, header.len) <= 0)) {
+        return -1;
+    }
+    if (header.status != 0 || header.len != sizeof(struct netfs_hello_args)) {
+        memset(agreed, 0, sizeof(struct netfs_hello_args));
+    } else if (!(agreed->codecs & NETFS_CODEC_LZ4)) {
+        agreed->compress_types = 0;
+    }
+    return 0;
+}
+
+/*
+ * Connects a pool connection and starts its reader. Called with the send lock
+ * held.
+ */
+static int conn_open(struct conn_pool *pool, struct pool_conn *conn)
+{
+    int fd = connect_addr(&pool->addr);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct netfs_hello_args agreed = { 0 };
+    bool leases = __atomic_load_n(&pool->leases, __ATOMIC_RELAXED);
+    if ((pool->compress_types != 0 || leases || pool->client_id != 0)
+            && conn_hello(pool, fd, &agreed) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (pool->client_id != 0 && !(agreed.features & NETFS_FEATURE_NODES)) {
+        LOG_WARN("%s\n", "Server won't give out node IDs");
+    }
+
+    // Whatever was cached under a lease can't be told apart from what came
+    // over this connection, so nothing is trusted past the usual timeouts
+    if (leases && !(agreed.features & NETFS_FEATURE_LEASES)) {
+        LOG_WARN("%s\n", "Server grants no leases");
+        __atomic_store_n(&pool->leases, false, __ATOMIC_RELAXED);
+        recall_all(pool);
+        leases = false;
+    }
+
+    struct reader_args *args = malloc(sizeof(struct reader_args));
+    if (args == NULL) {
+        perror("malloc");
+        close(fd);
+        return -1;
+    }
+    args->pool = pool;
+    args->conn = conn;
+    args->fd = fd;
+    args->compress_types = agreed.compress_types;
+    args->leases = leases;
+
+    pthread_t reader;
+    int err = pthread_create(&reader, NULL, reader_thread, args);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_create");
+        free(args);
+        close(fd);
+        return -1;
+    }
+    pthread_detach(reader);
+
+    pthread_mutex_lock(&conn->lock);
+    conn->fd = fd;
+    pthread_mutex_unlock(&conn->lock);
+
+    LOG_INFO("Opened new server connection: %d\n", fd);
+    return 0;
+}
+
+/*
+ * Sends a request on the next of the pool's connections without waiting for
+ * the reply. The caller sets up call's buf, pipe_fd and cap first. Returns
+ * -EIO if the request couldn't be sent, in which case there is nothing to
+ * wait for.
+ */
+static int call_send(struct conn_pool *pool, struct pending_call *call,
+        uint16_t type, uint64_t node, const char *path, const void *args,
+        size_t args_len, const void *body, size_t body_len)
+{
+    unsigned index = __atomic_fetch_add(&pool->next_conn, 1, __ATOMIC_RELAXED);
+    struct pool_conn *conn = &pool->conns[index % CONN_POOL_SIZE];
+
+    call->conn = conn;
+    call->type = type;
+    call->done = false;
+    call->failed = false;
+    pthread_cond_init(&call->done_cond, NULL);
+
+    pthread_mutex_lock(&conn->send_lock);
+
+    pthread_mutex_lock(&conn->lock);
+    bool connected = conn->fd != -1;
+    pthread_mutex_unlock(&conn->lock);
+    if (!connected && conn_open(pool, conn) == -1) {
+        pthread_mutex_unlock(&conn->send_lock);
+        pthread_cond_destroy(&call->done_cond);
+        return -EIO;
+    }
+
+    // The reply may come back before write_request returns, so the call has
+    // to be findable first. The reader may also have given up on the
+    // connection since we looked.
+    pthread_mutex_lock(&conn->lock);
+    int fd = conn->fd;
+    if (fd == -1) {
+        pthread_mutex_unlock(&conn->lock);
+        pthread_mutex_unlock(&conn->send_lock);
+        pthread_cond_destroy(&call->done_cond);
+        return -EIO;
+    }
+    call->id = conn->next_id++;
+    struct pending_call **bucket = &conn->pending[call->id % CONN_PENDING_BUCKETS];
+    call->next = *bucket;
+    *bucket = call;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (write_request_body(fd, type, call->id, node, path, args, args_len,
+                body, body_len) == -1) {
+        // Make the reader notice too, so everyone else on this connection
+        // gets failed rather than waiting forever
+        shutdown(fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conn->send_lock);
+    return 0;
+}
+
+/*
+ * Waits for the reply to a call that call_send sent. Returns 0, the negated
+ * errno the server reported, or -EIO if the connection broke.
+ */
+static int call_wait(struct pending_call *call, size_t *reply_len)
+{
+    struct pool_conn *conn = call->conn;
+
+    pthread_mutex_lock(&conn->lock);
+    while (!call->done) {
+        pthread_cond_wait(&call->done_cond, &conn->lock);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    pthread_cond_destroy(&call->done_cond);
+
+    if (call->failed) {
+        return -EIO;
+    }
+    if (reply_len != NULL) {
+        *reply_len = call->len;
+    }
+    return -call->status;
+}
+
+/*
+ * Does the work of every conn_call variant. The reply body goes to reply, or
+ * is spliced into pipe_fd if that isn't -1.
+ */
+static int send_call(struct conn_pool *pool, uint16_t type, uint64_t node,
+        const char *path, const void *args, size_t args_len, const void *body,
+        size_t body_len, void *reply, int pipe_fd, size_t reply_cap,
+        size_t *reply_len)
+{
+    struct pending_call call = { 0 };
+    call.buf = reply;
+    call.pipe_fd = pipe_fd;
+    call.cap = reply_cap;
+
+    int res = call_send(pool, &call, type, node, path, args, args_len, body,
+            body_len);
+    if (res != 0) {
+        return res;
+    }
+    return call_wait(&call, reply_len);
+}
+
+/*
+ * Sends a request about node and path (see net.h) on one of the pool's
+ * connections and waits for its reply, whose body (at most reply_cap bytes)
+ * is stored in reply. Other threads' requests go out on the same connection
+ * in the meantime. Returns 0, the negated errno the server reported, or -EIO
+ * if the server couldn't be reached.
+ */
+int conn_call(struct conn_pool *pool, uint16_t type, uint64_t node, const char *path,
+        const void *args, size_t args_len, void *reply, size_t reply_cap,
+        size_t *reply_len)
+{
+    return conn_call_body(pool, type, node, path, args, args_len, NULL, 0,
+            reply, reply_cap, reply_len);
+}
+
+/*
+ * conn_call for requests with a variable-length body after their arguments.
+ */
+int conn_call_body(struct conn_pool *pool, uint16_t type, uint64_t node,
+        const char *path, const void *args, size_t args_len, const void *body,
+        size_t body_len, void *reply, size_t reply_cap, size_t *reply_len)
+{
+    return send_call(pool, type, node, path, args, args_len, body, body_len,
+            reply, -1, reply_cap, reply_len);
+}
+
+/*
+ * conn_call that splices the reply body into pipe_fd instead of copying it
+ * into memory. The pipe must be empty and able to hold reply_cap bytes.
+ */
+int conn_call_splice(struct conn_pool *pool, uint16_t type, uint64_t node,
+        const char *path, const void *args, size_t args_len, int pipe_fd,
+        size_t reply_cap, size_t *reply_len)
+{
+    return send_call(pool, type, node, path, args, args_len, NULL, 0,
+            NULL, pipe_fd, reply_cap, reply_len);
+} 
+
+/*
+ * Sends a batch of requests, spread over the pool's connections, before
+ * waiting for any of them, so the server works on them all at once. Each
+ * request's res is set as conn_call would return it.
+ */
+void conn_call_all(struct conn_pool *pool, struct conn_request *requests, int count)
+{
+    struct pending_call *calls = calloc(count, sizeof(struct pending_call));
+    if (calls == NULL) {
+        perror("calloc");
+        for (int i = 0; i < count; i++) {
+            requests[i].res = -ENOMEM;
+        }
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct conn_request *request = &requests[i];
+        calls[i].buf = request->reply;
+        calls[i].pipe_fd = -1;
+        calls[i].cap = request->reply_cap;
+        request->reply_len = 0;
+        request->res = call_send(pool, &calls[i], request->type, request->node,
+                request->path, request->args, request->args_len, NULL, 0);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (requests[i].res == 0) {
+            requests[i].res = call_wait(&calls[i], &requests[i].reply_len);
+        }
+    }
+    free(calls);
+}
@@ -0,0 +1,102 @@
+/**
+ * conn_pool.h
+ *
+ * Long-lived client connections to the netfs server. The server address is
+ * resolved once and a small, fixed set of connections is shared by every FUSE
+ * operation. Requests are pipelined: any number of callers can have requests
+ * out on the same connection, each tagged with a request ID, and a reader
+ * thread per connection hands every reply to the caller waiting for its ID in
+ * whatever order the server finishes them.
+ *
+ * If the pool is set up to want compression, every connection starts with a
+ * MSG_HELLO asking for it, and the reader decompresses those replies the
+ * server agreed to compress.
+ *
+ * A pool can ask for leases and node IDs the same way. Invalidations the
+ * server pushes are handed to the pool's recall callback by the reader, in
+ * order with the replies around them. Leases die with their connection, so a broken
+ * connection, or one the server wouldn't grant leases on, recalls them all.
+ */
+
+#ifndef _CONN_POOL_H_
+#define _CONN_POOL_H_
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONN_POOL_SIZE 4
+#define CONN_PENDING_BUCKETS 64
+
+struct pool_conn;
+
+/* Told the path whose lease the server recalled, or NULL for every lease.
+ * Runs on a reader thread, which handles no replies until it returns. */
+typedef void (*conn_recall_fn)(const char *path, void *arg);
+
+/* A request waiting for its reply, on the stack of the calling thread */
+struct pending_call {
+    uint64_t id;
+    uint16_t type;
+    struct pool_conn *conn;     /* Connection it went out on */
+    void *buf;                  /* Where the reply body goes */
+    int pipe_fd;                /* Or a pipe it is spliced into, if not -1 */
+    size_t cap;
+    size_t len;                 /* Body length received */
+    int32_t status;             /* From the reply header */
+    bool failed;                /* The connection broke first */
+    bool done;
+    pthread_cond_t done_cond;
+    struct pending_call *next;
+};
+
+struct pool_conn {
+    pthread_mutex_t send_lock;  /* Held while connecting or writing a request */
+    pthread_mutex_t lock;       /* Guards fd and pending */
+    int fd;                     /* -1 while disconnected */
+    bool closing;               /* Shut down by conn_pool_destroy */
+    uint64_t next_id;
+    struct pending_call *pending[CONN_PENDING_BUCKETS];
+};
+
+struct conn_pool {
+    struct sockaddr_in addr;
+    uint32_t compress_types;    /* Replies to ask for compressed; 0 for none */
+    bool leases;                /* Ask for leases; cleared if one isn't granted */
+    uint64_t client_id;         /* Ask for node IDs with this, if not 0 */
+    conn_recall_fn recall;
+    void *recall_arg;
+    unsigned next_conn;
+    struct pool_conn conns[CONN_POOL_SIZE];
+};
+
+/* One request of a batch sent with conn_call_all */
+struct conn_request {
+    uint16_t type;
+    uint64_t node;
+    const char *path;
+    const void *args;
+    size_t args_len;
+    void *reply;
+    size_t reply_cap;
+    size_t reply_len;           /* Filled in with the result */
+    int res;
+};
+
+int conn_pool_init(struct conn_pool *pool, char *hostname, int port);
+void conn_pool_destroy(struct conn_pool *pool);
+
+int conn_call(struct conn_pool *pool, uint16_t type, uint64_t node, const char *path,
+        const void *args, size_t args_len, void *reply, size_t reply_cap,
+        size_t *reply_len);
+int conn_call_body(struct conn_pool *pool, uint16_t type, uint64_t node,
+        const char *path, const void *args, size_t args_len, const void *body,
+        size_t body_len, void *reply, size_t reply_cap, size_t *reply_len);
+int conn_call_splice(struct conn_pool *pool, uint16_t type, uint64_t node,
+        const char *path, const void *args, size_t args_len, int pipe_fd,
+        size_t reply_cap, size_t *reply_len);
+void conn_call_all(struct conn_pool *pool, struct conn_request *requests, int count);
+
+#endif
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+
+#include "dirfd_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/* FNV-1a */
+static uint64_t hash_path(const char *path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path != '\0'; path++) {
+        hash = (hash ^ (unsigned char) *path) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static struct dirfd_entry **bucket_of(struct dirfd_cache *cache, uint64_t hash)
+{
+    return &cache->buckets[hash % DIRFD_CACHE_BUCKETS];
+}
+
+static struct dirfd_entry *find_entry(struct dirfd_cache *cache, const char *path,
+        uint64_t hash)
+{
+    struct dirfd_entry *entry = *bucket_of(cache, hash);
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0)) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+static void lru_unlink(struct dirfd_cache *cache, struct dirfd_entry *entry)
+{
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push(struct dirfd_cache *cache, struct dirfd_entry *entry)
+{
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL) {
+        cache->lru_head->lru_prev = entry;
+    }
+    cache->lru_head = entry;
+    if (cache->lru_tail == NULL) {
+        cache->lru_tail = entry;
+    }
+}
+
+static void free_entry(struct dirfd_entry *entry)
+{
+    close(entry->fd);
+    free(entry->path);
+    free(entry);
+}
+
+/*
+ * Takes entry out of the cache. Requests still resolving in it keep its
+ * descriptor until they are done. Called with the lock held.
+ */
+static void remove_entry(struct dirfd_cache *cache, struct dirfd_entry *entry)
+{
+    struct dirfd_entry **link = bucket_of(cache, entry->hash);
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    lru_unlink(cache, entry);
+    cache->count--;
+    entry->cached = false;
+    if (entry->refs == 0) {
+        free_entry(entry);
+    }
+}
+
+/*
+ * Caches fd under dir, closing the least recently used descriptor if the
+ * cache is full. Returns the new entry, or NULL if there is no memory for
+ * it. Called with the lock held.
+ */
+static struct dirfd_entry *insert_entry(struct dirfd_cache *cache, const char *dir,
+        uint64_t hash, int fd)
+{
+    struct dirfd_entry *entry = calloc(1, sizeof(struct dirfd_entry));
+    if (entry == NULL || (entry->path = strdup(dir)) == NULL) {
+        free(entry);
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->fd = fd;
+    entry->cached = true;
+    struct dirfd_entry **bucket = bucket_of(cache, hash);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lru_push(cache, entry);
+    cache->count++;
+    if (cache->count > cache->max_entries) {
+        remove_entry(cache, cache->lru_tail);
+    }
+    return entry;
+}
+
+/*
+ * Checks that path is absolute and has no empty, "." or ".." components.
+ * Returns 0 or a negative errno.
+ */
+static int check_path(const char *path)
+{
+    if (path[0] != '/') {
+        return -EINVAL;
+    }
+    if (strnlen(path, MAXIMUM_PATH) >= MAXIMUM_PATH) {
+        return -ENAMETOOLONG;
+    }
+    if (strcmp(path, "/") == 0) {
+        return 0;
+    }
+
+    const char *component = path + 1;
+    while (true) {
+        size_t len = strcspn(component, "/");
+        if (len == 0 || (len == 1 && component[0] == '.')
+                || (len == 2 && component[0] == '.' && component[1] == '.')) {
+            return -EINVAL;
+        }
+        if (component[len] == '\0') {
+            return 0;
+        }
+        component += len + 1;
+    }
+}
+
+/*
+ * Sets up an empty cache of at most max_entries descriptors, 0 to open each
+ * request's directory afresh. Paths are resolved from the current directory,
+ * which must be the export root. Returns -1 if it can't be opened.
+ */
+int dirfd_cache_init(struct dirfd_cache *cache, size_t max_entries)
+{
+    memset(cache, 0, sizeof(struct dirfd_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->max_entries = max_entries;
+    cache->root_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cache->root_fd == -1) {
+        perror("open");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Has watch asked about every directory above one before its descriptor is
+ * cached. Without it nothing is. Set it up before the cache is used.
+ */
+void dirfd_cache_watch(struct dirfd_cache *cache, dirfd_watch_fn watch, void *arg)
+{
+    cache->watch_arg = arg;
+    cache->watch = watch;
+}
+
+/*
+ * Whether a descriptor of dir, a directory below the root, can be cached:
+ * the root and every directory down to dir's parent have to be watched
+ */
+static bool watched_above(struct dirfd_cache *cache, const char *dir)
+{
+    if (cache->max_entries == 0 || cache->watch == NULL
+            || !cache->watch("/", cache->watch_arg)) {
+        return false;
+    }
+
+    char above[MAXIMUM_PATH];
+    for (const char *slash = strchr(dir + 1, '/'); slash != NULL;
+            slash = strchr(slash + 1, '/')) {
+        snprintf(above, sizeof(above), "%.*s", (int) (slash - dir), dir);
+        if (!cache->watch(above, cache->watch_arg)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Resolves client path to a name in the descriptor of its parent directory,
+ * which is taken from the cache or opened from the export root and cached.
+ * ref->name points into path, which has to outlive ref. Returns 0 or a
+ * negative errno, EINVAL for a path that isn't allowed; ref has to be
+ * released with dirfd_cache_release if it succeeds.
+ */
+int dirfd_cache_resolve(struct dirfd_cache *cache, const char *path, struct dirfd_ref *ref)
+{
+    memset(ref, 0, sizeof(struct dirfd_ref));
+    int res = check_path(path);
+    if (res < 0) {
+        return res;
+    }
+
+    const char *slash = strrchr(path, '/');
+    if (slash == path) {
+        ref->fd = cache->root_fd;
+        ref->name = path[1] == '\0' ? "." : path + 1;
+        return 0;
+    }
+    ref->name = slash + 1;
+
+    char dir[MAXIMUM_PATH];
+    snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path), path);
+    uint64_t hash = hash_path(dir);
+
+    pthread_mutex_lock(&cache->lock);
+    struct dirfd_entry *entry = find_entry(cache, dir, hash);
+    if (entry != NULL) {
+        lru_unlink(cache, entry);
+        lru_push(cache, entry);
+        entry->refs++;
+        pthread_mutex_unlock(&cache->lock);
+        ref->fd = entry->fd;
+        ref->entry = entry;
+        return 0;
+    }
+    uint64_t generation = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+
+    // Watch everything above first, so a rename after the open is seen
+    bool cacheable = watched_above(cache, dir);
+    int fd = openat(cache->root_fd, dir + 1, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -errno;
+    }
+
+    if (cacheable) {
+        pthread_mutex_lock(&cache->lock);
+        if (cache->generation == generation) {
+            entry = find_entry(cache, dir, hash);
+            if (entry != NULL) {
+                // Another request opened it first
+                lru_unlink(cache, entry);
+                lru_push(cache, entry);
+            } else if ((entry = insert_entry(cache, dir, hash, fd)) != NULL) {
+                fd = -1;
+            }
+            if (entry != NULL) {
+                entry->refs++;
+                ref->fd = entry->fd;
+                ref->entry = entry;
+            }
+        }
+        pthread_mutex_unlock(&cache->lock);
+        if (ref->entry != NULL) {
+            if (fd != -1) {
+                close(fd);
+            }
+            return 0;
+        }
+    }
+
+    ref->fd = fd;
+    ref->owned = true;
+    return 0;
+}
+
+/*
+ * Lets go of the directory a path was resolved in
+ */
+void dirfd_cache_release(struct dirfd_cache *cache, struct dirfd_ref *ref)
+{
+    if (ref->entry != NULL) {
+        pthread_mutex_lock(&cache->lock);
+        struct dirfd_entry *entry = ref->entry;
+        entry->refs--;
+        if (entry->refs == 0 && !entry->cached) {
+            free_entry(entry);
+        }
+        pthread_mutex_unlock(&cache->lock);
+    } else if (ref->owned) {
+        close(ref->fd);
+    }
+    ref->entry = NULL;
+    ref->owned = false;
+    ref->fd = -1;
+}
+
+/*
+ * Drops the descriptor cached under path, or all of them if path is NULL
+ */
+void dirfd_cache_invalidate(struct dirfd_cache *cache, const char *path)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->generation++;
+    if (path == NULL) {
+        while (cache->lru_head != NULL) {
+            remove_entry(cache, cache->lru_head);
+        }
+    } else {
+        struct dirfd_entry *entry = find_entry(cache, path, hash_path(path));
+        if (entry != NULL) {
+            remove_entry(cache, entry);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,78 @@
+/**
+ * dirfd_cache.h
+ *
+ * Server-side cache of open directory descriptors, keyed by the client path
+ * of the directory. A request that names a file by path is resolved as a
+ * name in its parent's descriptor with fstatat() or openat(), so the kernel
+ * only walks the last component rather than the whole path from the export
+ * root. The least recently used descriptors are closed once the cache is
+ * full.
+ *
+ * Paths are checked before anything is resolved. They have to be absolute,
+ * and empty, "." and ".." components are refused, so a request can't reach
+ * outside the export through the path it sends. Symlinks in the export are
+ * followed, as everywhere else on the server.
+ *
+ * A descriptor follows its directory through renames, but the path it is
+ * cached under doesn't. Descriptors are only cached once a callback says
+ * every directory above theirs is watched for changes, and the cache is told
+ * of changed paths the way the attribute cache tells its listener: a path
+ * drops the descriptor cached under it, and NULL, which renamed directories
+ * bring, drops them all. A generation bumped by each of these keeps a
+ * descriptor opened before a change from being cached after it.
+ */
+
+#ifndef _DIRFD_CACHE_H_
+#define _DIRFD_CACHE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIRFD_CACHE_BUCKETS 4096
+#define DEFAULT_DIRFD_CACHE_ENTRIES 512
+
+/* Makes sure changes to the entries of directory dir are seen, and says
+ * whether they are */
+typedef bool (*dirfd_watch_fn)(const char *dir, void *arg);
+
+struct dirfd_entry {
+    char *path;
+    uint64_t hash;
+    int fd;                     /* O_PATH descriptor of the directory */
+    unsigned refs;              /* Requests resolving in it */
+    bool cached;                /* Closed with its last reference once not */
+    struct dirfd_entry *hash_next;
+    struct dirfd_entry *lru_prev;
+    struct dirfd_entry *lru_next;
+};
+
+struct dirfd_cache {
+    pthread_mutex_t lock;
+    int root_fd;
+    size_t max_entries;
+    size_t count;
+    uint64_t generation;        /* Bumped by every invalidation */
+    dirfd_watch_fn watch;
+    void *watch_arg;
+    struct dirfd_entry *buckets[DIRFD_CACHE_BUCKETS];
+    struct dirfd_entry *lru_head;   /* Most recently used */
+    struct dirfd_entry *lru_tail;   /* Next to be closed */
+};
+
+/* Where a path was resolved to: name in the directory fd */
+struct dirfd_ref {
+    int fd;
+    const char *name;           /* Last component of the path, "." for the root */
+    struct dirfd_entry *entry;  /* Cached descriptor held, if any */
+    bool owned;                 /* fd was opened for this request alone */
+};
+
+int dirfd_cache_init(struct dirfd_cache *cache, size_t max_entries);
+void dirfd_cache_watch(struct dirfd_cache *cache, dirfd_watch_fn watch, void *arg);
+int dirfd_cache_resolve(struct dirfd_cache *cache, const char *path, struct dirfd_ref *ref);
+void dirfd_cache_release(struct dirfd_cache *cache, struct dirfd_ref *ref);
+void dirfd_cache_invalidate(struct dirfd_cache *cache, const char *path);
+
+#endif
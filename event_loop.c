@@ -0,0 +1,1351 @@
+#define _GNU_SOURCE
+
+#include "event_loop.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "net.h"
+#include "server.h"
+#include "stats.h"
+#include "uring.h"
+#include "work_pool.h"
+
+enum conn_state {
+    CONN_HEADER,    /* Waiting for a struct netfs_msg_header */
+    CONN_PATH,      /* Waiting for header.msg_len bytes of path */
+    CONN_PAYLOAD,   /* Waiting for the fixed arguments of the message type */
+    CONN_BODY       /* Copying in the variable-length body, if it has one */
+};
+
+struct event_loop;
+struct netfs_conn;
+
+/* What an io_uring completion is for */
+enum uring_op_kind {
+    OP_ACCEPT,
+    OP_WAKEUP,      /* Workers finished something */
+    OP_RECV,
+    OP_SEND,        /* Buffered part of a reply */
+    OP_SPLICE_IN,   /* File part of a reply, into the connection's pipe */
+    OP_SPLICE_OUT   /* And from there out to the socket */
+};
+
+/* Pointed to by the user_data of every io_uring submission */
+struct uring_op {
+    enum uring_op_kind kind;
+    struct netfs_conn *conn;
+};
+
+/* One request on its way through a worker and back out to the client */
+struct netfs_call {
+    struct netfs_conn *conn;
+    int result;
+    bool pushed;                /* Server-initiated, not yet counted in num_calls */
+    uint64_t queued;            /* When it was handed to the workers */
+    struct netfs_call *next;    /* In the done list, reply queue or free list */
+    struct netfs_request req;
+    struct netfs_reply reply;
+};
+
+struct netfs_conn {
+    int fd;                     /* -1 once closed */
+    enum conn_state state;
+    uint32_t events;
+    struct event_loop *loop;
+    char in[CONN_BUFFER_SIZE];
+    size_t in_start;
+    size_t in_end;
+    size_t payload_len;
+    size_t body_read;
+    struct netfs_call *parsing;         /* Request being read in */
+    int num_calls;                      /* Parsed but not fully answered */
+    struct netfs_call *replies_head;    /* Finished, waiting to be sent */
+    struct netfs_call *replies_tail;
+    struct netfs_call *free_calls;
+    struct netfs_conn *next_closed;
+    struct netfs_session session;
+    bool push_failed;           /* A push couldn't be queued; set by workers */
+    struct netfs_conn *next_failed;
+    int pipe_fds[2];            /* For splicing file data, made when needed */
+    size_t piped;               /* Bytes in the pipe not yet sent */
+
+    /* io_uring engine only. A connection has at most one receive and one
+     * send step in flight */
+    struct uring_op recv_op;
+    struct uring_op send_op;
+    bool receiving;
+    bool sending;
+};
+
+struct event_loop {
+    pthread_t thread;
+    int epoll_fd;
+    int listen_fd;
+    struct work_pool *pool;
+
+    /* Calls whose reply a worker has finished, signalled by event_fd */
+    int event_fd;
+    pthread_mutex_t done_lock;
+    struct netfs_call *done_head;
+    struct netfs_call *done_tail;
+    struct netfs_conn *failed;  /* Connections whose pushes failed, to close */
+
+    /* Connections closed during this round of events, freed after it */
+    struct netfs_conn *closed;
+
+    /* io_uring engine only */
+    bool use_uring;
+    struct uring ring;
+    struct uring_op accept_op;
+    struct uring_op wakeup_op;
+    uint64_t wakeup_count;
+};
+
+/* Marks the eventfd in epoll events, as opposed to a listener (NULL) or a
+ * connection */
+static char event_fd_tag;
+
+/* Set once any loop has stopped, which stops the server */
+static pthread_mutex_t stopped_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stopped_cond = PTHREAD_COND_INITIALIZER;
+static bool stopped;
+
+/*
+ * Reply buffer management. Buffers are kept between requests so a busy
+ * connection doesn't allocate for every reply.
+ */
+void reply_init(struct netfs_reply *reply)
+{
+    memset(reply, 0, sizeof(struct netfs_reply));
+    reply->file_fd = -1;
+}
+
+void reply_reset(struct netfs_reply *reply)
+{
+    if (reply->file_fd != -1) {
+        close(reply->file_fd);
+    }
+    if (reply->file_done != NULL) {
+        reply->file_done(reply->file_done_arg);
+    }
+    reply->status = 0;
+    reply->len = 0;
+    reply->sent = 0;
+    reply->file_fd = -1;
+    reply->file_offset = 0;
+    reply->file_len = 0;
+    reply->file_data = NULL;
+    reply->file_done = NULL;
+    reply->file_done_arg = NULL;
+}
+
+void reply_free(struct netfs_reply *reply)
+{
+    reply_reset(reply);
+    free(reply->buf);
+    reply->buf = NULL;
+    reply->cap = 0;
+}
+
+int reply_append(struct netfs_reply *reply, const void *data, size_t len)
+{
+    if (reply->len + len > reply->cap) {
+        size_t cap = reply->cap > 0 ? reply->cap : 256;
+        while (cap < reply->len + len) {
+            cap *= 2;
+        }
+        char *buf = realloc(reply->buf, cap);
+        if (buf == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        reply->buf = buf;
+        reply->cap = cap;
+    }
+    memcpy(reply->buf + reply->len, data, len);
+    reply->len += len;
+    return 0;
+}
+
+/*
+ * Queues len bytes of fd after the buffered part of the reply. The reply takes
+ * ownership of fd and closes it once it has been sent.
+ */
+void reply_sendfile(struct netfs_reply *reply, int fd, off_t offset, size_t len)
+{
+    reply->file_fd = fd;
+    reply->file_offset = offset;
+    reply->file_len = len;
+}
+
+/*
+ * Queues len bytes of memory mapped from a file after the buffered part of
+ * the reply. Its pages go to the socket by reference, so the data has to stay
+ * mapped, and unchanged but for changes to the file itself, until done is
+ * called with arg once the reply has been sent. Replies that are compressed
+ * or nested in a compound read their file part with pread() and can't use
+ * this.
+ */
+void reply_send_mapped(struct netfs_reply *reply, const char *data, size_t len,
+        void (*done)(void *arg), void *arg)
+{
+    reply->file_data = data;
+    reply->file_len = len;
+    reply->file_done = done;
+    reply->file_done_arg = arg;
+}
+
+static struct netfs_call *get_call(struct netfs_conn *conn)
+{
+    struct netfs_call *call = conn->free_calls;
+    if (call != NULL) {
+        conn->free_calls = call->next;
+    } else {
+        call = calloc(1, sizeof(struct netfs_call));
+        if (call == NULL) {
+            perror("calloc");
+            return NULL;
+        }
+        reply_init(&call->reply);
+    }
+    call->conn = conn;
+    call->next = NULL;
+    call->req.session = &conn->session;
+    return call;
+}
+
+/*
+ * Keeps a finished call and its reply buffer around for the connection's next
+ * request.
+ */
+static void put_call(struct netfs_conn *conn, struct netfs_call *call)
+{
+    reply_reset(&call->reply);
+    call->next = conn->free_calls;
+    conn->free_calls = call;
+}
+
+static void free_calls(struct netfs_call *call)
+{
+    while (call != NULL) {
+        struct netfs_call *next = call->next;
+        reply_free(&call->reply);
+        free(call->req.body);
+        free(call);
+        call = next;
+    }
+}
+
+/*
+ * Queues a closed connection to be freed once no worker or io_uring operation
+ * refers to it any more.
+ */
+static void conn_release(struct event_loop *loop, struct netfs_conn *conn)
+{
+    if (conn->fd == -1 && conn->num_calls == 0
+            && !conn->receiving && !conn->sending) {
+        // No handler is using the session any more, so once they let go of
+        // it nothing can be pushed to it either. Pushes from before are
+        // dropped.
+        session_closed(&conn->session);
+        pthread_mutex_lock(&loop->done_lock);
+        struct netfs_conn **failed = &loop->failed;
+        while (*failed != NULL && *failed != conn) {
+            failed = &(*failed)->next_failed;
+        }
+        if (*failed != NULL) {
+            *failed = conn->next_failed;
+        }
+        struct netfs_call **link = &loop->done_head;
+        loop->done_tail = NULL;
+        while (*link != NULL) {
+            struct netfs_call *call = *link;
+            if (call->pushed && call->conn == conn) {
+                *link = call->next;
+                call->next = NULL;
+                free_calls(call);
+            } else {
+                loop->done_tail = call;
+                link = &call->next;
+            }
+        }
+        pthread_mutex_unlock(&loop->done_lock);
+
+        conn->next_closed = loop->closed;
+        loop->closed = conn;
+    }
+}
+
+/*
+ * Stops serving a connection. Calls still out with workers keep the
+ * connection struct alive until they come back; the rest of it is freed at
+ * the end of the current round of events, which may still mention it.
+ */
+static void conn_close(struct event_loop *loop, struct netfs_conn *conn)
+{
+    if (conn->fd == -1) {
+        return;
+    }
+
+    LOG_INFO("Closing connection: %d\n", conn->fd);
+
+    if (loop->use_uring) {
+        // Receives and sends in flight hold on to the socket; this makes
+        // them finish
+        shutdown(conn->fd, SHUT_RDWR);
+    } else {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    close(conn->fd);
+    conn->fd = -1;
+    stats_conn_closed();
+
+    while (conn->replies_head != NULL) {
+        struct netfs_call *call = conn->replies_head;
+        conn->replies_head = call->next;
+        put_call(conn, call);
+        conn->num_calls--;
+    }
+    conn->replies_tail = NULL;
+    if (conn->parsing != NULL) {
+        put_call(conn, conn->parsing);
+        conn->parsing = NULL;
+    }
+
+    conn_release(loop, conn);
+}
+
+static void free_closed(struct event_loop *loop)
+{
+    while (loop->closed != NULL) {
+        struct netfs_conn *conn = loop->closed;
+        loop->closed = conn->next_closed;
+        free_calls(conn->free_calls);
+        if (conn->pipe_fds[0] != -1) {
+            close(conn->pipe_fds[0]);
+            close(conn->pipe_fds[1]);
+        }
+        free(conn);
+    }
+}
+
+static int conn_watch(struct event_loop *loop, struct netfs_conn *conn, uint32_t events)
+{
+    if (conn->events == events) {
+        return 0;
+    }
+    conn->events = events;
+
+    struct epoll_event ev = { 0 };
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Advances the read side of the state machine over whatever is buffered.
+ * Returns 1 once conn->parsing holds a complete request, 0 if more input is
+ * needed, or -1 if the client sent something malformed.
+ */
+static int conn_parse(struct netfs_conn *conn)
+{
+    while (true) {
+        size_t avail = conn->in_end - conn->in_start;
+        char *data = conn->in + conn->in_start;
+        struct netfs_call *call = conn->parsing;
+
+        switch (conn->state) {
+            case CONN_HEADER:
+                if (avail < sizeof(struct netfs_msg_header)) {
+                    return 0;
+                }
+                call = get_call(conn);
+                if (call == NULL) {
+                    return -1;
+                }
+                conn->parsing = call;
+                memcpy(&call->req.header, data, sizeof(struct netfs_msg_header));
+                conn->in_start += sizeof(struct netfs_msg_header);
+                if (call->req.header.version != NETFS_PROTOCOL_VERSION) {
+                    LOG_WARN("Unsupported protocol version: %d\n",
+                            call->req.header.version);
+                    return -1;
+                }
+                if (call->req.header.msg_len == 0
+                        || call->req.header.msg_len > MAXIMUM_PATH) {
+                    LOG_WARN("Bad path length: %zu\n",
+                            (size_t) call->req.header.msg_len);
+                    return -1;
+                }
+                conn->payload_len = request_payload_len(call->req.header.msg_type);
+                conn->state = CONN_PATH;
+                break;
+
+            case CONN_PATH:
+                if (avail < call->req.header.msg_len) {
+                    return 0;
+                }
+                memcpy(call->req.path, data, call->req.header.msg_len);
+                call->req.path[call->req.header.msg_len - 1] = '\0';
+                conn->in_start += call->req.header.msg_len;
+                conn->state = CONN_PAYLOAD;
+                break;
+
+            case CONN_PAYLOAD:
+                if (avail < conn->payload_len) {
+                    return 0;
+                }
+                memcpy(call->req.payload, data, conn->payload_len);
+                conn->in_start += conn->payload_len;
+
+                call->req.body_len = request_body_len(call->req.header.msg_type,
+                        call->req.payload);
+                if (call->req.body_len > NETFS_COMPOUND_MAX_BODY) {
+                    LOG_WARN("Bad body length: %zu\n", call->req.body_len);
+                    return -1;
+                }
+                if (call->req.body_len > call->req.body_cap) {
+                    char *body = realloc(call->req.body, call->req.body_len);
+                    if (body == NULL) {
+                        perror("realloc");
+                        return -1;
+                    }
+                    call->req.body = body;
+                    call->req.body_cap = call->req.body_len;
+                }
+                conn->body_read = 0;
+                conn->state = CONN_BODY;
+                break;
+
+            case CONN_BODY:
+                // Bodies can be bigger than the input buffer, so they are
+                // copied out as they arrive
+                if (avail > call->req.body_len - conn->body_read) {
+                    avail = call->req.body_len - conn->body_read;
+                }
+                memcpy(call->req.body + conn->body_read, data, avail);
+                conn->body_read += avail;
+                conn->in_start += avail;
+                if (conn->body_read < call->req.body_len) {
+                    return 0;
+                }
+                conn->state = CONN_HEADER;
+                return 1;
+        }
+    }
+}
+
+/*
+ * Makes the connection's pipe for splicing file data if it has none yet
+ */
+static int conn_pipe(struct netfs_conn *conn)
+{
+    if (conn->pipe_fds[0] == -1 && pipe2(conn->pipe_fds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        conn->pipe_fds[0] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Hands as much of a reply's mapped file data to the connection's pipe as it
+ * takes, by reference. The pipe must be empty. Returns -1 on error.
+ */
+static int conn_vmsplice(struct netfs_conn *conn, struct netfs_reply *reply)
+{
+    if (conn_pipe(conn) == -1) {
+        return -1;
+    }
+    struct iovec iov;
+    iov.iov_base = (void *) reply->file_data;
+    iov.iov_len = reply->file_len;
+    ssize_t res = vmsplice(conn->pipe_fds[1], &iov, 1, SPLICE_F_NONBLOCK);
+    if (res <= 0) {
+        // EFAULT if the file shrank under the mapping; the client can't
+        // resync the stream
+        perror("vmsplice");
+        return -1;
+    }
+    reply->file_data += res;
+    reply->file_len -= res;
+    conn->piped = res;
+    return 0;
+}
+
+/*
+ * Writes as much of a finished reply as the socket accepts. Returns 1 when
+ * the reply is complete, 0 if the socket is full, or -1 on error. more says
+ * whether another reply is queued behind this one, in which case the kernel
+ * may hold on to a partial packet until it arrives.
+ */
+static int conn_flush(struct netfs_conn *conn, struct netfs_reply *reply, bool more)
+{
+    while (reply->sent < reply->len) {
+        int flags = MSG_NOSIGNAL;
+        if (more || reply->file_len > 0) {
+            flags |= MSG_MORE;
+        }
+        ssize_t bytes = send(conn->fd, reply->buf + reply->sent,
+                reply->len - reply->sent, flags);
+        if (bytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("send");
+            return -1;
+        }
+        reply->sent += bytes;
+    }
+
+    while (reply->file_fd != -1 && reply->file_len > 0) {
+        uint64_t start = stats_now();
+        ssize_t sent = sendfile(conn->fd, reply->file_fd,
+                &reply->file_offset, reply->file_len);
+        stats_time(TIMER_SENDFILE, stats_now() - start);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("sendfile");
+            return -1;
+        } else if (sent == 0) {
+            // The file shrank under us; the client can't resync the stream
+            LOG_WARN("%s\n", "File truncated during sendfile");
+            return -1;
+        }
+        reply->file_len -= sent;
+    }
+
+    while (conn->piped > 0 || reply->file_len > 0) {
+        if (conn->piped == 0 && conn_vmsplice(conn, reply) == -1) {
+            return -1;
+        }
+        unsigned flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+        if (more || reply->file_len > 0) {
+            flags |= SPLICE_F_MORE;
+        }
+        ssize_t sent = splice(conn->pipe_fds[0], NULL, conn->fd, NULL, conn->piped, flags);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("splice");
+            return -1;
+        }
+        conn->piped -= sent;
+    }
+
+    return 1;
+}
+
+static void loop_wake(struct event_loop *loop)
+{
+    uint64_t one = 1;
+    if (write(loop->event_fd, &one, sizeof(uint64_t)) == -1) {
+        perror("write");
+    }
+}
+
+/*
+ * Hands a finished call to its loop from another thread
+ */
+static void loop_done(struct event_loop *loop, struct netfs_call *call)
+{
+    pthread_mutex_lock(&loop->done_lock);
+    if (loop->done_tail != NULL) {
+        loop->done_tail->next = call;
+    } else {
+        loop->done_head = call;
+    }
+    loop->done_tail = call;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    loop_wake(loop);
+}
+
+/*
+ * Has the loop close a connection a push to it was lost on, from another
+ * thread. Only the loop touches the socket, which it may have closed already.
+ */
+static void loop_push_failed(struct event_loop *loop, struct netfs_conn *conn)
+{
+    if (__atomic_exchange_n(&conn->push_failed, true, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    pthread_mutex_lock(&loop->done_lock);
+    conn->next_failed = loop->failed;
+    loop->failed = conn;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    loop_wake(loop);
+}
+
+int session_push(struct netfs_session *session, const void *body, size_t len)
+{
+    struct netfs_conn *conn = (struct netfs_conn *) ((char *) session
+            - offsetof(struct netfs_conn, session));
+
+    struct netfs_reply_header header = { 0 };
+    header.request_id = NETFS_PUSH_ID;
+    header.len = len;
+
+    struct netfs_call *call = calloc(1, sizeof(struct netfs_call));
+    if (call == NULL) {
+        perror("calloc");
+        loop_push_failed(conn->loop, conn);
+        return -1;
+    }
+    reply_init(&call->reply);
+    if (reply_append(&call->reply, &header, sizeof(struct netfs_reply_header)) == -1
+            || reply_append(&call->reply, body, len) == -1) {
+        free_calls(call);
+        loop_push_failed(conn->loop, conn);
+        return -1;
+    }
+    call->conn = conn;
+    call->pushed = true;
+
+    loop_done(conn->loop, call);
+    return 0;
+}
+
+/*
+ * Runs on a worker: builds the reply behind a header echoing the request ID
+ * and hands the call back to its connection's event loop.
+ */
+static void conn_work(void *arg)
+{
+    struct netfs_call *call = arg;
+    struct event_loop *loop = call->conn->loop;
+    struct netfs_reply *reply = &call->reply;
+    struct netfs_reply_header header = { 0 };
+
+    uint64_t start = stats_now();
+    stats_time(TIMER_QUEUE_WAIT, start - call->queued);
+
+    call->result = reply_append(reply, &header, sizeof(struct netfs_reply_header));
+    if (call->result == 0) {
+        call->result = handle_request(&call->req, reply);
+    }
+
+    if (call->result == 0) {
+        header.request_id = call->req.header.request_id;
+        header.status = reply->status;
+        header.len = reply->len - sizeof(struct netfs_reply_header) + reply->file_len;
+        memcpy(reply->buf, &header, sizeof(struct netfs_reply_header));
+        stats_request(call->req.header.msg_type, reply->status,
+                reply->len + reply->file_len, stats_now() - start);
+    }
+
+    loop_done(loop, call);
+}
+
+/* Drops the reply at the front of the queue once it has all been sent */
+static void conn_reply_sent(struct netfs_conn *conn)
+{
+    struct netfs_call *call = conn->replies_head;
+    conn->replies_head = call->next;
+    if (conn->replies_head == NULL) {
+        conn->replies_tail = NULL;
+    }
+    put_call(conn, call);
+    conn->num_calls--;
+}
+
+static void uring_arm(struct event_loop *loop, struct netfs_conn *conn);
+
+/*
+ * Moves a connection along: sends whatever replies are finished, then parses
+ * and hands out requests until the input runs dry or CONN_MAX_CALLS are
+ * outstanding. Updates the epoll interest set, or the io_uring operations in
+ * flight, to match.
+ */
+static void conn_process(struct event_loop *loop, struct netfs_conn *conn)
+{
+    // With io_uring, replies are sent a step at a time as completions come in
+    while (!loop->use_uring && conn->replies_head != NULL) {
+        struct netfs_call *call = conn->replies_head;
+        int res = conn_flush(conn, &call->reply, call->next != NULL);
+        if (res == -1) {
+            conn_close(loop, conn);
+            return;
+        } else if (res == 0) {
+            break;
+        }
+        conn_reply_sent(conn);
+    }
+
+    while (conn->num_calls < CONN_MAX_CALLS) {
+        int res = conn_parse(conn);
+        if (res == -1) {
+            conn_close(loop, conn);
+            return;
+        } else if (res == 0) {
+            break;
+        }
+
+        struct netfs_call *call = conn->parsing;
+        conn->parsing = NULL;
+        conn->num_calls++;
+        call->queued = stats_now();
+        if (work_pool_submit(loop->pool, conn_work, call) == -1) {
+            conn->num_calls--;
+            put_call(conn, call);
+            conn_close(loop, conn);
+            return;
+        }
+    }
+
+    // Keep partial requests at the front so there is room for the rest. A
+    // receive in flight is writing just past them, so that has to wait.
+    if (conn->in_start > 0 && !conn->receiving) {
+        memmove(conn->in, conn->in + conn->in_start, conn->in_end - conn->in_start);
+        conn->in_end -= conn->in_start;
+        conn->in_start = 0;
+    }
+
+    if (loop->use_uring) {
+        uring_arm(loop, conn);
+        return;
+    }
+
+    // Stop reading while the client has as many requests out as it may
+    uint32_t events = 0;
+    if (conn->num_calls < CONN_MAX_CALLS) {
+        events |= EPOLLIN;
+    }
+    if (conn->replies_head != NULL) {
+        events |= EPOLLOUT;
+    }
+    if (conn_watch(loop, conn, events) == -1) {
+        conn_close(loop, conn);
+    }
+}
+
+/*
+ * Picks up replies that workers have finished and queues them on their
+ * connections in the order they finished, then closes connections that
+ * missed a push.
+ */
+static void finish_work(struct event_loop *loop)
+{
+    pthread_mutex_lock(&loop->done_lock);
+    struct netfs_call *call = loop->done_head;
+    loop->done_head = NULL;
+    loop->done_tail = NULL;
+    struct netfs_conn *failed = loop->failed;
+    loop->failed = NULL;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    while (call != NULL) {
+        struct netfs_call *next = call->next;
+        struct netfs_conn *conn = call->conn;
+        call->next = NULL;
+
+        // Pushes are sent like replies once they reach their connection,
+        // unless it closed while they were on their way
+        if (call->pushed) {
+            call->pushed = false;
+            if (conn->fd == -1) {
+                put_call(conn, call);
+                call = next;
+                continue;
+            }
+            conn->num_calls++;
+        }
+
+        if (conn->fd == -1 || call->result == -1) {
+            put_call(conn, call);
+            conn->num_calls--;
+            if (conn->fd == -1) {
+                conn_release(loop, conn);
+            } else {
+                conn_close(loop, conn);
+            }
+        } else {
+            if (conn->replies_tail != NULL) {
+                conn->replies_tail->next = call;
+            } else {
+                conn->replies_head = call;
+            }
+            conn->replies_tail = call;
+            conn_process(loop, conn);
+        }
+        call = next;
+    }
+
+    while (failed != NULL) {
+        struct netfs_conn *conn = failed;
+        failed = conn->next_failed;
+        conn_close(loop, conn);
+    }
+}
+
+static void conn_readable(struct event_loop *loop, struct netfs_conn *conn)
+{
+    while (conn->in_end < CONN_BUFFER_SIZE) {
+        ssize_t bytes = read(conn->fd, conn->in + conn->in_end,
+                CONN_BUFFER_SIZE - conn->in_end);
+        if (bytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("read");
+            conn_close(loop, conn);
+            return;
+        } else if (bytes == 0) {
+            conn_close(loop, conn);
+            return;
+        }
+        conn->in_end += bytes;
+    }
+
+    conn_process(loop, conn);
+}
+
+/*
+ * Sets up the state for a newly accepted client. Closes the socket if that
+ * fails.
+ */
+static struct netfs_conn *conn_new(struct event_loop *loop, int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+
+    struct netfs_conn *conn = calloc(1, sizeof(struct netfs_conn));
+    if (conn == NULL) {
+        perror("calloc");
+        close(fd);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->state = CONN_HEADER;
+    conn->events = EPOLLIN;
+    conn->loop = loop;
+    conn->recv_op.kind = OP_RECV;
+    conn->recv_op.conn = conn;
+    conn->send_op.kind = OP_SEND;
+    conn->send_op.conn = conn;
+    conn->pipe_fds[0] = -1;
+    conn->pipe_fds[1] = -1;
+    stats_conn_opened();
+    return conn;
+}
+
+static void accept_clients(struct event_loop *loop)
+{
+    while (true) {
+        int client_fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+
+        struct netfs_conn *conn = conn_new(loop, client_fd);
+        if (conn == NULL) {
+            continue;
+        }
+
+        struct epoll_event ev = { 0 };
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+            perror("epoll_ctl");
+            close(client_fd);
+            free(conn);
+            stats_conn_closed();
+            continue;
+        }
+        LOG_INFO("Accepted connection: %d\n", client_fd);
+    }
+}
+
+/*
+ * Ends a loop thread that can't go on, with err the errno of what failed if
+ * there is one. Its connections would be left without anyone serving them
+ * while its listener still took new ones, so the whole server stops.
+ */
+static void *loop_failed(const char *what, int err)
+{
+    if (err != 0) {
+        LOG_ERROR("%s: %s; stopping the server\n", what, strerror(err));
+    } else {
+        LOG_ERROR("%s; stopping the server\n", what);
+    }
+    pthread_mutex_lock(&stopped_lock);
+    stopped = true;
+    pthread_cond_signal(&stopped_cond);
+    pthread_mutex_unlock(&stopped_lock);
+    return NULL;
+}
+
+static void *event_loop_thread(void *arg)
+{
+    struct event_loop *loop = arg;
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    while (true) {
+        int num_events = epoll_wait(loop->epoll_fd, events,
+                EVENT_LOOP_MAX_EVENTS, -1);
+        if (num_events == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return loop_failed("epoll_wait", errno);
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            struct netfs_conn *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_clients(loop);
+            } else if (events[i].data.ptr == &event_fd_tag) {
+                uint64_t count;
+                if (read(loop->event_fd, &count, sizeof(uint64_t)) == -1
+                        && errno != EAGAIN) {
+                    perror("read");
+                }
+                finish_work(loop);
+            } else if (conn->fd == -1) {
+                // Closed earlier in this round
+                continue;
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)
+                    && !(events[i].events & EPOLLIN)) {
+                conn_close(loop, conn);
+            } else if (events[i].events & EPOLLIN) {
+                conn_readable(loop, conn);
+            } else {
+                conn_process(loop, conn);
+            }
+        }
+        free_closed(loop);
+    }
+    return NULL;
+}
+
+/*
+ * io_uring engine. Instead of waiting for readiness and then making the
+ * system calls, the loop queues the accept, receives, sends and splices
+ * themselves and collects their results, so one io_uring_enter per round
+ * does the work of many read/write/epoll_ctl calls.
+ */
+
+static struct io_uring_sqe *uring_prep(struct event_loop *loop,
+        struct uring_op *op, uint8_t opcode, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (sqe != NULL) {
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = (uint64_t) (uintptr_t) op;
+    }
+    return sqe;
+}
+
+static int uring_accept(struct event_loop *loop)
+{
+    if (uring_prep(loop, &loop->accept_op, IORING_OP_ACCEPT, loop->listen_fd) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+static int uring_wakeup(struct event_loop *loop)
+{
+    struct io_uring_sqe *sqe = uring_prep(loop, &loop->wakeup_op,
+            IORING_OP_READ, loop->event_fd);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->addr = (uint64_t) (uintptr_t) &loop->wakeup_count;
+    sqe->len = sizeof(uint64_t);
+    sqe->off = -1;
+    return 0;
+}
+
+/*
+ * Queues the next step of sending the reply at the front of the queue: the
+ * buffered part, then the file part in pipe-sized pieces, each spliced into
+ * the connection's pipe and from there to the socket.
+ */
+static int uring_send(struct event_loop *loop, struct netfs_conn *conn)
+{
+    struct netfs_call *call = conn->replies_head;
+    struct netfs_reply *reply = &call->reply;
+    struct io_uring_sqe *sqe;
+
+    if (reply->sent < reply->len) {
+        sqe = uring_prep(loop, &conn->send_op, IORING_OP_SEND, conn->fd);
+        if (sqe == NULL) {
+            return -1;
+        }
+        conn->send_op.kind = OP_SEND;
+        sqe->addr = (uint64_t) (uintptr_t) (reply->buf + reply->sent);
+        sqe->len = reply->len - reply->sent;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        if (call->next != NULL || reply->file_len > 0) {
+            sqe->msg_flags |= MSG_MORE;
+        }
+    } else if (conn->piped > 0 || reply->file_data != NULL) {
+        // io_uring has no vmsplice, but handing pages to an empty pipe
+        // doesn't block
+        if (conn->piped == 0 && conn_vmsplice(conn, reply) == -1) {
+            return -1;
+        }
+        sqe = uring_prep(loop, &conn->send_op, IORING_OP_SPLICE, conn->fd);
+        if (sqe == NULL) {
+            return -1;
+        }
+        conn->send_op.kind = OP_SPLICE_OUT;
+        sqe->splice_fd_in = conn->pipe_fds[0];
+        sqe->splice_off_in = -1;
+        sqe->off = -1;
+        sqe->len = conn->piped;
+        sqe->splice_flags = SPLICE_F_MOVE;
+    } else {
+        if (conn_pipe(conn) == -1) {
+            return -1;
+        }
+        sqe = uring_prep(loop, &conn->send_op, IORING_OP_SPLICE, conn->pipe_fds[1]);
+        if (sqe == NULL) {
+            return -1;
+        }
+        conn->send_op.kind = OP_SPLICE_IN;
+        sqe->splice_fd_in = reply->file_fd;
+        sqe->splice_off_in = reply->file_offset;
+        sqe->off = -1;
+        sqe->len = reply->file_len < URING_SPLICE_CHUNK
+                ? reply->file_len : URING_SPLICE_CHUNK;
+        sqe->splice_flags = SPLICE_F_MOVE;
+    }
+
+    conn->sending = true;
+    return 0;
+}
+
+/*
+ * Queues a receive if there is room for more requests, and the next send step
+ * if a reply is waiting and none is in flight.
+ */
+static void uring_arm(struct event_loop *loop, struct netfs_conn *conn)
+{
+    if (!conn->receiving && conn->num_calls < CONN_MAX_CALLS
+            && conn->in_end < CONN_BUFFER_SIZE) {
+        struct io_uring_sqe *sqe = uring_prep(loop, &conn->recv_op,
+                IORING_OP_RECV, conn->fd);
+        if (sqe == NULL) {
+            conn_close(loop, conn);
+            return;
+        }
+        sqe->addr = (uint64_t) (uintptr_t) (conn->in + conn->in_end);
+        sqe->len = CONN_BUFFER_SIZE - conn->in_end;
+        conn->receiving = true;
+    }
+
+    if (!conn->sending && conn->replies_head != NULL
+            && uring_send(loop, conn) == -1) {
+        conn_close(loop, conn);
+    }
+}
+
+static void uring_conn_complete(struct event_loop *loop, struct uring_op *op, int res)
+{
+    struct netfs_conn *conn = op->conn;
+    if (op == &conn->recv_op) {
+        conn->receiving = false;
+    } else {
+        conn->sending = false;
+    }
+
+    if (conn->fd == -1) {
+        conn_release(loop, conn);
+        return;
+    }
+    if (res == -EAGAIN || res == -EINTR) {
+        // Nothing happened; the same step is queued again
+        uring_arm(loop, conn);
+        return;
+    }
+    if (res < 0) {
+        LOG_WARN("Operation %d failed: %s\n", op->kind, strerror(-res));
+        conn_close(loop, conn);
+        return;
+    }
+
+    struct netfs_reply *reply = NULL;
+    if (conn->replies_head != NULL) {
+        reply = &conn->replies_head->reply;
+    }
+    switch (op->kind) {
+        case OP_RECV:
+            if (res == 0) {
+                conn_close(loop, conn);
+                return;
+            }
+            conn->in_end += res;
+            break;
+
+        case OP_SEND:
+            reply->sent += res;
+            break;
+
+        case OP_SPLICE_IN:
+            if (res == 0) {
+                // The file shrank under us; the client can't resync the stream
+                LOG_WARN("%s\n", "File truncated during splice");
+                conn_close(loop, conn);
+                return;
+            }
+            conn->piped = res;
+            reply->file_offset += res;
+            reply->file_len -= res;
+            break;
+
+        case OP_SPLICE_OUT:
+            conn->piped -= res;
+            break;
+
+        default:
+            break;
+    }
+
+    if (op == &conn->send_op && reply->sent == reply->len
+            && reply->file_len == 0 && conn->piped == 0) {
+        conn_reply_sent(conn);
+    }
+    conn_process(loop, conn);
+}
+
+static void uring_complete(struct event_loop *loop, struct uring_op *op, int res)
+{
+    switch (op->kind) {
+        case OP_ACCEPT:
+            if (res >= 0) {
+                struct netfs_conn *conn = conn_new(loop, res);
+                if (conn != NULL) {
+                    LOG_INFO("Accepted connection: %d\n", res);
+                    uring_arm(loop, conn);
+                }
+            } else if (res != -EINTR && res != -EAGAIN) {
+                LOG_WARN("accept: %s\n", strerror(-res));
+            }
+            if (uring_accept(loop) == -1) {
+                LOG_ERROR("%s\n", "Can't accept any more connections");
+            }
+            break;
+
+        case OP_WAKEUP:
+            finish_work(loop);
+            if (uring_wakeup(loop) == -1) {
+                LOG_ERROR("%s\n", "Can't wait for workers any more");
+            }
+            break;
+
+        default:
+            uring_conn_complete(loop, op, res);
+            break;
+    }
+}
+
+static void *uring_loop_thread(void *arg)
+{
+    struct event_loop *loop = arg;
+
+    if (uring_accept(loop) == -1 || uring_wakeup(loop) == -1) {
+        return loop_failed("Can't queue the first accept and wakeup", 0);
+    }
+
+    while (true) {
+        if (uring_submit_and_wait(&loop->ring, 1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return loop_failed("io_uring_enter", errno);
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+            struct uring_op *op = (struct uring_op *) (uintptr_t) cqe->user_data;
+            int res = cqe->res;
+            uring_cqe_seen(&loop->ring);
+            uring_complete(loop, op, res);
+        }
+        free_closed(loop);
+    }
+    return NULL;
+}
+
+/*
+ * Gives every loop an io_uring, or none of them if the kernel can't do all
+ * that the engine needs.
+ */
+static bool uring_setup(struct event_loop *loops, int num_loops)
+{
+    static const uint8_t ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_READ, IORING_OP_RECV, IORING_OP_SEND,
+        IORING_OP_SPLICE
+    };
+
+    for (int i = 0; i < num_loops; i++) {
+        bool ok = uring_init(&loops[i].ring, EVENT_LOOP_URING_ENTRIES,
+                EVENT_LOOP_URING_CQ_ENTRIES) == 0;
+        if (ok && uring_probe(&loops[i].ring, ops, sizeof(ops)) == -1) {
+            uring_destroy(&loops[i].ring);
+            ok = false;
+        }
+        if (!ok) {
+            while (--i >= 0) {
+                uring_destroy(&loops[i].ring);
+            }
+            return false;
+        }
+        loops[i].use_uring = true;
+        loops[i].accept_op.kind = OP_ACCEPT;
+        loops[i].wakeup_op.kind = OP_WAKEUP;
+    }
+    return true;
+}
+
+static int listen_on(int port)
+{
+    int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (socket_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(int)) == -1) {
+        perror("setsockopt");
+        close(socket_fd);
+        return -1;
+    }
+
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(socket_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(socket_fd);
+        return -1;
+    }
+
+    if (listen(socket_fd, SOMAXCONN) == -1) {
+        perror("listen");
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+int event_loops_run(int port, int num_loops, struct work_pool *pool, bool use_uring)
+{
+    struct event_loop *loops = calloc(num_loops, sizeof(struct event_loop));
+    if (loops == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    if (use_uring && !uring_setup(loops, num_loops)) {
+        LOG_WARN("%s\n", "io_uring unavailable, falling back to epoll");
+        use_uring = false;
+    }
+
+    // Set up every listener before starting any thread so a bind failure is
+    // reported instead of leaving a partially running server
+    for (int i = 0; i < num_loops; i++) {
+        loops[i].listen_fd = listen_on(port);
+        if (loops[i].listen_fd == -1) {
+            return -1;
+        }
+
+        // io_uring does its own waiting, without tying up a thread, as long
+        // as the descriptors are left blocking
+        if (use_uring) {
+            fcntl(loops[i].listen_fd, F_SETFL, 0);
+            loops[i].pool = pool;
+            pthread_mutex_init(&loops[i].done_lock, NULL);
+            loops[i].event_fd = eventfd(0, 0);
+            if (loops[i].event_fd == -1) {
+                perror("eventfd");
+                return -1;
+            }
+            continue;
+        }
+
+        loops[i].epoll_fd = epoll_create1(0);
+        if (loops[i].epoll_fd == -1) {
+            perror("epoll_create1");
+            return -1;
+        }
+
+        struct epoll_event ev = { 0 };
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD,
+                    loops[i].listen_fd, &ev) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+
+        loops[i].pool = pool;
+        pthread_mutex_init(&loops[i].done_lock, NULL);
+        loops[i].event_fd = eventfd(0, EFD_NONBLOCK);
+        if (loops[i].event_fd == -1) {
+            perror("eventfd");
+            return -1;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &event_fd_tag;
+        if (epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD,
+                    loops[i].event_fd, &ev) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < num_loops; i++) {
+        if (pthread_create(&loops[i].thread, NULL,
+                    use_uring ? uring_loop_thread : event_loop_thread, &loops[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+
+    LOG_INFO("Listening on port %d with %d %s event loops\n", port, num_loops,
+            use_uring ? "io_uring" : "epoll");
+
+    // Loops only return when they fail
+    pthread_mutex_lock(&stopped_lock);
+    while (!stopped) {
+        pthread_cond_wait(&stopped_cond, &stopped_lock);
+    }
+    pthread_mutex_unlock(&stopped_lock);
+    return -1;
+}
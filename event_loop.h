@@ -0,0 +1,56 @@
+/**
+ * event_loop.h
+ *
+ * Non-blocking epoll server engine. Each loop thread owns a listening socket
+ * bound with SO_REUSEPORT, so the kernel spreads incoming connections across
+ * loops, and reads requests off every connection with a small state machine:
+ *
+ *   CONN_HEADER -> CONN_PATH -> CONN_PAYLOAD -> CONN_BODY -> CONN_HEADER ...
+ *
+ * Each complete request is handed to the worker pool straight away, so a
+ * client can have many requests out on one connection. Finished replies are
+ * passed back to the loop and written out in the order they finish, tagged
+ * with the ID of the request they answer.
+ *
+ * Optionally the loops drive the sockets through io_uring instead: accepts,
+ * receives, sends and file splices are queued on a ring per loop and
+ * submitted and reaped in one system call per round. The protocol handling is
+ * the same either way.
+ */
+
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include <stdbool.h>
+
+/* Read-side buffer per connection; large enough for the biggest request */
+#define CONN_BUFFER_SIZE 4096
+
+/* Requests a connection may have outstanding before the loop stops reading */
+#define CONN_MAX_CALLS 64
+
+#define EVENT_LOOP_MAX_EVENTS 256
+
+/* Submission queue size for each loop's io_uring */
+#define EVENT_LOOP_URING_ENTRIES 1024
+
+/* Completion queue size. Each connection has at most a receive and a send in
+ * flight, and the loop an accept and a wakeup, so this covers 8191
+ * connections a loop; completions past it wait in the kernel's overflow list
+ * until the ring has room. */
+#define EVENT_LOOP_URING_CQ_ENTRIES 16384
+
+/* Most file data spliced through a connection's pipe at once; the default
+ * pipe capacity */
+#define URING_SPLICE_CHUNK (64 * 1024)
+
+struct work_pool;
+
+/*
+ * Starts num_loops event loops listening on port and serves clients forever,
+ * using io_uring if asked to and the kernel supports it. Returns -1 if the
+ * listening sockets could not be set up, or once any loop fails.
+ */
+int event_loops_run(int port, int num_loops, struct work_pool *pool, bool use_uring);
+
+#endif
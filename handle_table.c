@@ -0,0 +1,310 @@
+#include "handle_table.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+void handle_table_init(struct handle_table *table, int max_open, handle_open_fn open_path)
+{
+    memset(table, 0, sizeof(struct handle_table));
+    pthread_mutex_init(&table->lock, NULL);
+    table->max_open = max_open;
+    table->open_path = open_path;
+
+    // Start numbering from the clock so handles given out by an earlier run
+    // of the server don't match any of ours
+    table->next_id = (uint64_t) time(NULL) << 24;
+}
+
+static struct open_handle **bucket_of(struct handle_table *table, uint64_t id)
+{
+    return &table->buckets[id % HANDLE_TABLE_BUCKETS];
+}
+
+static struct open_handle *find_handle(struct handle_table *table, uint64_t id)
+{
+    struct open_handle *handle = *bucket_of(table, id);
+    while (handle != NULL && handle->id != id) {
+        handle = handle->hash_next;
+    }
+    return handle;
+}
+
+static void list_unlink(struct handle_list *list, struct open_handle *handle)
+{
+    if (handle->lru_prev != NULL) {
+        handle->lru_prev->lru_next = handle->lru_next;
+    } else {
+        list->head = handle->lru_next;
+    }
+    if (handle->lru_next != NULL) {
+        handle->lru_next->lru_prev = handle->lru_prev;
+    } else {
+        list->tail = handle->lru_prev;
+    }
+    handle->lru_prev = NULL;
+    handle->lru_next = NULL;
+}
+
+static void list_push(struct handle_list *list, struct open_handle *handle)
+{
+    handle->lru_next = list->head;
+    if (list->head != NULL) {
+        list->head->lru_prev = handle;
+    }
+    list->head = handle;
+    if (list->tail == NULL) {
+        list->tail = handle;
+    }
+}
+
+static void free_handle(struct open_handle *handle)
+{
+    if (handle->fd != -1) {
+        close(handle->fd);
+    }
+    free(handle->path);
+    free(handle);
+}
+
+/*
+ * Unlinks a handle, open or dropped, and frees it. Called with the lock held.
+ */
+static void remove_handle(struct handle_table *table, struct open_handle *handle)
+{
+    struct open_handle **link = bucket_of(table, handle->id);
+    while (*link != handle) {
+        link = &(*link)->hash_next;
+    }
+    *link = handle->hash_next;
+    if (handle->fd != -1) {
+        list_unlink(&table->open, handle);
+        table->num_open--;
+    } else {
+        list_unlink(&table->dropped, handle);
+        table->num_dropped--;
+    }
+
+    LOG("Closing handle %llu (%s): %llu reads, %llu bytes\n",
+            (unsigned long long) handle->id, handle->path,
+            (unsigned long long) handle->reads,
+            (unsigned long long) handle->bytes_read);
+    free_handle(handle);
+}
+
+/*
+ * Closes the descriptor of an open handle to make room, keeping what it was
+ * so it can be reopened. The oldest dropped handle is forgotten if there are
+ * too many. Called with the lock held.
+ */
+static void drop_handle(struct handle_table *table, struct open_handle *handle)
+{
+    LOG("Dropping handle %llu (%s)\n", (unsigned long long) handle->id, handle->path);
+    list_unlink(&table->open, handle);
+    table->num_open--;
+    close(handle->fd);
+    handle->fd = -1;
+    list_push(&table->dropped, handle);
+    table->num_dropped++;
+
+    if (table->num_dropped > HANDLE_TABLE_MAX_DROPPED) {
+        remove_handle(table, table->dropped.tail);
+    }
+}
+
+/*
+ * Makes room for another open handle. Called with the lock held.
+ */
+static void make_room(struct handle_table *table)
+{
+    if (table->num_open >= table->max_open && table->open.tail != NULL) {
+        drop_handle(table, table->open.tail);
+    }
+}
+
+/*
+ * Opens the file at path, or takes fd if it isn't -1, and stats it. Does its
+ * I/O without the lock. Returns the descriptor, or -1 with errno set and fd
+ * closed.
+ */
+static int open_file(struct handle_table *table, const char *path, int fd,
+        struct handle_info *info)
+{
+    if (fd == -1 && (fd = table->open_path(path)) == -1) {
+        return -1;
+    }
+
+    struct stat stbuf;
+    if (fstat(fd, &stbuf) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    info->dev = stbuf.st_dev;
+    info->ino = stbuf.st_ino;
+    info->size = stbuf.st_size;
+    info->mtim = stbuf.st_mtim;
+    return fd;
+}
+
+/*
+ * Opens path for reading, or takes over fd if it isn't -1, and returns its
+ * handle in id. path is where the file is opened again from if the handle is
+ * dropped. Returns 0 or a negative errno; fd is closed either way.
+ */
+int handle_open(struct handle_table *table, const char *path, int fd, uint64_t *id)
+{
+    struct open_handle *handle = calloc(1, sizeof(struct open_handle));
+    if (handle == NULL || (handle->path = strdup(path)) == NULL) {
+        free(handle);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -ENOMEM;
+    }
+    handle->fd = open_file(table, path, fd, &handle->info);
+    if (handle->fd == -1) {
+        int err = errno;
+        free_handle(handle);
+        return -err;
+    }
+
+    pthread_mutex_lock(&table->lock);
+    handle->id = table->next_id++;
+    make_room(table);
+    struct open_handle **bucket = bucket_of(table, handle->id);
+    handle->hash_next = *bucket;
+    *bucket = handle;
+    list_push(&table->open, handle);
+    table->num_open++;
+    pthread_mutex_unlock(&table->lock);
+
+    *id = handle->id;
+    return 0;
+}
+
+/*
+ * Opens a dropped handle's file again from its path and checks it is still
+ * the file it was, without the lock. Returns the descriptor or a negative
+ * errno, ESTALE if the file was removed, replaced or changed since.
+ */
+static int reopen_file(struct handle_table *table, uint64_t id, const char *path,
+        const struct handle_info *was)
+{
+    LOG("Reopening handle %llu: %s\n", (unsigned long long) id, path);
+    struct handle_info info;
+    int fd = open_file(table, path, -1, &info);
+    if (fd == -1) {
+        return errno == ENOENT ? -ESTALE : -errno;
+    }
+    if (info.dev != was->dev || info.ino != was->ino
+            || info.mtim.tv_sec != was->mtim.tv_sec
+            || info.mtim.tv_nsec != was->mtim.tv_nsec) {
+        close(fd);
+        return -ESTALE;
+    }
+    return fd;
+}
+
+/*
+ * Looks up the handle for a read of *len bytes at offset. A handle dropped to
+ * make room for others is opened again from the path it was opened from.
+ * Clamps *len to the file size recorded at open time and returns a duplicate
+ * of the descriptor in *fd, which the caller must close, and what the file
+ * was when it was opened in *info. Either may be NULL; only reads that take
+ * the descriptor are counted. Returns 0 or a negative errno: EBADF for a
+ * handle that was never given out or is released, ESTALE for one whose file
+ * is no longer what it was.
+ */
+int handle_acquire(struct handle_table *table, uint64_t id, off_t offset, size_t *len,
+        int *fd, struct handle_info *info)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&table->lock);
+    struct open_handle *handle = find_handle(table, id);
+    while (handle != NULL && handle->fd == -1) {
+        // Opened without the lock, so a slow disk only holds up this read
+        char *path = strdup(handle->path);
+        struct handle_info was = handle->info;
+        pthread_mutex_unlock(&table->lock);
+        if (path == NULL) {
+            return -ENOMEM;
+        }
+        int reopened = reopen_file(table, id, path, &was);
+        free(path);
+        if (reopened < 0) {
+            return reopened;
+        }
+
+        // It may have been released, or got back by another read, meanwhile
+        pthread_mutex_lock(&table->lock);
+        handle = find_handle(table, id);
+        if (handle != NULL && handle->fd == -1) {
+            list_unlink(&table->dropped, handle);
+            table->num_dropped--;
+            make_room(table);
+            handle->fd = reopened;
+            list_push(&table->open, handle);
+            table->num_open++;
+        } else {
+            close(reopened);
+        }
+    }
+    if (handle == NULL) {
+        pthread_mutex_unlock(&table->lock);
+        return -EBADF;
+    }
+    list_unlink(&table->open, handle);
+    list_push(&table->open, handle);
+
+    if (offset < 0 || offset >= handle->info.size) {
+        *len = 0;
+    } else if (*len > (size_t) (handle->info.size - offset)) {
+        *len = handle->info.size - offset;
+    }
+
+    if (info != NULL) {
+        *info = handle->info;
+    }
+
+    // The reply sends from its own descriptor, so the handle can be closed
+    // or dropped while the data is still going out
+    if (fd != NULL) {
+        *fd = dup(handle->fd);
+        if (*fd == -1) {
+            res = -errno;
+        } else {
+            handle->reads++;
+            handle->bytes_read += *len;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    return res;
+}
+
+/*
+ * Closes a handle, or forgets a dropped one. Returns 0, or -EBADF if there is
+ * no such handle.
+ */
+int handle_release(struct handle_table *table, uint64_t id)
+{
+    int res = -EBADF;
+
+    pthread_mutex_lock(&table->lock);
+    struct open_handle *handle = find_handle(table, id);
+    if (handle != NULL) {
+        remove_handle(table, handle);
+        res = 0;
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    return res;
+}
@@ -0,0 +1,80 @@
+/**
+ * handle_table.h
+ *
+ * Server-side table of open files. MSG_OPEN registers a file and hands the
+ * client an opaque 64-bit handle; MSG_READ uses the handle to get at the
+ * already open descriptor and the size recorded at open time instead of
+ * resolving and stat'ing the path again. The number of open descriptors is
+ * capped: the least recently used handle's descriptor is closed when the
+ * table is full, and reopened from its path if the client uses it again. A
+ * dropped handle remembers what its file was, and reads of it fail with
+ * ESTALE once the path leads to a different file or the file has changed.
+ * Only the HANDLE_TABLE_MAX_DROPPED most recently dropped are kept; handles
+ * that are released, forgotten or were never given out fail with EBADF.
+ * Paths are opened
+ * for reading by a function the server gives, which knows how to resolve
+ * them. Files are opened and stat'ed without the table's lock held, so an
+ * open that waits on the disk only holds up the request making it.
+ */
+
+#ifndef _HANDLE_TABLE_H_
+#define _HANDLE_TABLE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define HANDLE_TABLE_BUCKETS 4096
+#define DEFAULT_MAX_OPEN_FILES 1024
+#define HANDLE_TABLE_MAX_DROPPED 65536
+
+/* Opens path for reading, returning the descriptor or -1 with errno set */
+typedef int (*handle_open_fn)(const char *path);
+
+/* A file as it was when it was opened */
+struct handle_info {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtim;
+};
+
+struct open_handle;
+
+struct handle_list {
+    struct open_handle *head;
+    struct open_handle *tail;
+};
+
+struct open_handle {
+    uint64_t id;
+    char *path;
+    int fd;                     /* -1 while dropped */
+    struct handle_info info;
+    uint64_t reads;             /* Access statistics */
+    uint64_t bytes_read;
+    struct open_handle *hash_next;
+    struct open_handle *lru_prev;
+    struct open_handle *lru_next;
+};
+
+struct handle_table {
+    pthread_mutex_t lock;
+    uint64_t next_id;
+    int max_open;
+    int num_open;
+    int num_dropped;
+    handle_open_fn open_path;
+    struct open_handle *buckets[HANDLE_TABLE_BUCKETS];
+    struct handle_list open;        /* Most recently used first */
+    struct handle_list dropped;     /* Most recently dropped first */
+};
+
+void handle_table_init(struct handle_table *table, int max_open, handle_open_fn open_path);
+int handle_open(struct handle_table *table, const char *path, int fd, uint64_t *id);
+int handle_acquire(struct handle_table *table, uint64_t id, off_t offset, size_t *len,
+        int *fd, struct handle_info *info);
+int handle_release(struct handle_table *table, uint64_t id);
+
+#endif
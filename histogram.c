@@ -0,0 +1,97 @@
+#include "histogram.h"
+
+#include <string.h>
+
+#define HALF_BUCKETS (1u << (HISTOGRAM_SUB_BITS - 1))
+
+void histogram_init(struct histogram *hist)
+{
+    memset(hist, 0, sizeof(struct histogram));
+}
+
+static unsigned bucket_of(uint64_t value)
+{
+    if (value < (1u << HISTOGRAM_SUB_BITS)) {
+        return value;
+    }
+
+    // Keep the top HISTOGRAM_SUB_BITS bits; the shift says which power of
+    // two they came from
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - HISTOGRAM_SUB_BITS + 1;
+    return shift * HALF_BUCKETS + (unsigned) (value >> shift);
+}
+
+/* Largest value that lands in a bucket */
+static uint64_t bucket_max(unsigned bucket)
+{
+    if (bucket < (1u << HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+
+    unsigned shift = bucket / HALF_BUCKETS - 1;
+    uint64_t top = bucket - shift * HALF_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+/* Only the writer changes a field, so it needs no read-modify-write */
+static void add_relaxed(uint64_t *field, uint64_t value)
+{
+    __atomic_store_n(field, *field + value, __ATOMIC_RELAXED);
+}
+
+void histogram_record(struct histogram *hist, uint64_t value)
+{
+    add_relaxed(&hist->counts[bucket_of(value)], 1);
+    add_relaxed(&hist->total, 1);
+    add_relaxed(&hist->sum, value);
+    if (value > hist->max) {
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Adds src into dst, which only the caller may be using. src may be written
+ * to at the same time.
+ */
+void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    }
+    dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max) {
+        dst->max = max;
+    }
+}
+
+/*
+ * Returns a value that at least percentile percent of the recorded values
+ * are no greater than (rounded up to the end of its bucket, but never past
+ * the largest value recorded), or 0 if nothing was recorded.
+ */
+uint64_t histogram_percentile(const struct histogram *hist, double percentile)
+{
+    if (hist->total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t) (percentile / 100.0 * hist->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    } else if (rank > hist->total) {
+        rank = hist->total;
+    }
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_max(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
@@ -0,0 +1,36 @@
+/**
+ * histogram.h
+ *
+ * Fixed-size log-linear histogram in the style of HdrHistogram. Values below
+ * 2^HISTOGRAM_SUB_BITS are counted exactly; above that every power of two is
+ * split into 2^(HISTOGRAM_SUB_BITS - 1) equal buckets, so any recorded value
+ * is known to within about 3% across the whole 64-bit range. Recording is a
+ * couple of shifts and an increment, and histograms of the same layout add
+ * up, so each thread can keep its own and they are merged for reporting.
+ *
+ * A histogram has a single writer, but others may merge it while it is being
+ * written to: every field is updated with a relaxed atomic store, so readers
+ * see each count whole, if not all counts from the same instant.
+ */
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_BUCKETS ((66 - HISTOGRAM_SUB_BITS) << (HISTOGRAM_SUB_BITS - 1))
+
+struct histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+};
+
+void histogram_init(struct histogram *hist);
+void histogram_record(struct histogram *hist, uint64_t value);
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+uint64_t histogram_percentile(const struct histogram *hist, double percentile);
+
+#endif
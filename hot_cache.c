@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+
+#include "hot_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "logging.h"
+
+static uint64_t hash_info(const struct handle_info *info)
+{
+    return ((uint64_t) info->dev * 1099511628211ULL) ^ (uint64_t) info->ino;
+}
+
+static bool same_file(const struct handle_info *a, const struct handle_info *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size
+            && a->mtim.tv_sec == b->mtim.tv_sec && a->mtim.tv_nsec == b->mtim.tv_nsec;
+}
+
+static struct hot_file **bucket_of(struct hot_cache *cache, uint64_t hash)
+{
+    return &cache->buckets[hash % HOT_CACHE_BUCKETS];
+}
+
+static struct hot_file *find_file(struct hot_cache *cache, const struct handle_info *info,
+        uint64_t hash)
+{
+    struct hot_file *file = *bucket_of(cache, hash);
+    while (file != NULL && (file->hash != hash || !same_file(&file->info, info))) {
+        file = file->hash_next;
+    }
+    return file;
+}
+
+static void list_unlink(struct hot_list *list, struct hot_file *file)
+{
+    if (file->list_prev != NULL) {
+        file->list_prev->list_next = file->list_next;
+    } else {
+        list->head = file->list_next;
+    }
+    if (file->list_next != NULL) {
+        file->list_next->list_prev = file->list_prev;
+    } else {
+        list->tail = file->list_prev;
+    }
+    file->list_prev = NULL;
+    file->list_next = NULL;
+}
+
+static void list_push(struct hot_list *list, struct hot_file *file)
+{
+    file->list_next = list->head;
+    if (list->head != NULL) {
+        list->head->list_prev = file;
+    }
+    list->head = file;
+    if (list->tail == NULL) {
+        list->tail = file;
+    }
+}
+
+static void free_file(struct hot_file *file)
+{
+    if (file->data != NULL) {
+        munmap(file->data, file->info.size);
+    }
+    free(file);
+}
+
+/*
+ * Takes file out of the hash table and unlinks it from list. Called with the
+ * lock held.
+ */
+static void unhash_file(struct hot_cache *cache, struct hot_list *list, struct hot_file *file)
+{
+    struct hot_file **link = bucket_of(cache, file->hash);
+    while (*link != file) {
+        link = &(*link)->hash_next;
+    }
+    *link = file->hash_next;
+    list_unlink(list, file);
+    file->listed = false;
+}
+
+/*
+ * Unmaps the first mapped file the clock finds unused since it last came
+ * round, or leaves it to its last reply if one is still sending from it.
+ * Returns false if nothing is mapped. Called with the lock held.
+ */
+static bool evict_one(struct hot_cache *cache)
+{
+    struct hot_file *file;
+    while ((file = cache->mapped.tail) != NULL) {
+        if (file->hits > 0) {
+            file->hits /= 2;
+            list_unlink(&cache->mapped, file);
+            list_push(&cache->mapped, file);
+            continue;
+        }
+
+        LOG("Unmapping hot file %llu (%lld bytes)\n",
+                (unsigned long long) file->info.ino, (long long) file->info.size);
+        unhash_file(cache, &cache->mapped, file);
+        cache->mapped_bytes -= file->info.size;
+        if (file->refs == 0) {
+            free_file(file);
+        }
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Sets up an empty cache that maps at most max_bytes of files, 0 to map
+ * none
+ */
+void hot_cache_init(struct hot_cache *cache, size_t max_bytes)
+{
+    memset(cache, 0, sizeof(struct hot_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->max_bytes = max_bytes;
+}
+
+bool hot_cache_enabled(struct hot_cache *cache)
+{
+    return cache->max_bytes > 0;
+}
+
+/*
+ * Counts a read of len bytes of the file info describes. Returns the file
+ * with a reference the caller gives back with hot_cache_put if it is mapped,
+ * and otherwise NULL, setting promote if the caller should now map it with
+ * hot_cache_map.
+ */
+struct hot_file *hot_cache_get(struct hot_cache *cache, const struct handle_info *info,
+        size_t len, bool *promote)
+{
+    *promote = false;
+
+    // No one file may take more than half of the budget
+    if (info->size <= 0 || (size_t) info->size > cache->max_bytes / 2) {
+        return NULL;
+    }
+
+    uint64_t hash = hash_info(info);
+    pthread_mutex_lock(&cache->lock);
+    struct hot_file *file = find_file(cache, info, hash);
+    if (file != NULL && file->data != NULL) {
+        file->hits++;
+        file->refs++;
+        pthread_mutex_unlock(&cache->lock);
+        return file;
+    }
+
+    if (file == NULL) {
+        // Forget the least recently read candidate that isn't being mapped
+        // right now to make room. If all of them are, this one isn't tracked.
+        if (cache->num_candidates >= HOT_CACHE_CANDIDATES) {
+            struct hot_file *oldest = cache->candidates.tail;
+            while (oldest != NULL && oldest->mapping) {
+                oldest = oldest->list_prev;
+            }
+            if (oldest == NULL) {
+                pthread_mutex_unlock(&cache->lock);
+                return NULL;
+            }
+            unhash_file(cache, &cache->candidates, oldest);
+            cache->num_candidates--;
+            free_file(oldest);
+        }
+
+        file = calloc(1, sizeof(struct hot_file));
+        if (file == NULL) {
+            pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+        file->info = *info;
+        file->hash = hash;
+        file->listed = true;
+        struct hot_file **bucket = bucket_of(cache, hash);
+        file->hash_next = *bucket;
+        *bucket = file;
+        cache->num_candidates++;
+    } else {
+        list_unlink(&cache->candidates, file);
+    }
+    list_push(&cache->candidates, file);
+
+    file->hits++;
+    file->bytes_read += len;
+    if (!file->mapping && file->bytes_read >= HOT_CACHE_PROMOTE_READS * (uint64_t) info->size) {
+        file->mapping = true;
+        *promote = true;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+/*
+ * Maps the file info describes from fd, which stays the caller's, after
+ * hot_cache_get said to. Mapped files that have gone cold are unmapped to
+ * make room. Returns the file with a reference like hot_cache_get, or NULL
+ * if it couldn't be mapped.
+ */
+struct hot_file *hot_cache_map(struct hot_cache *cache, const struct handle_info *info,
+        int fd)
+{
+    // Fault all of it in now, on the worker, rather than on the event loop
+    // when its pages are handed to the socket. It is our own view of files
+    // clients read, so it has no business in a core dump.
+    char *data = mmap(NULL, info->size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        data = NULL;
+    } else {
+        madvise(data, info->size, MADV_DONTDUMP);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    struct hot_file *file = find_file(cache, info, hash_info(info));
+    if (file == NULL || file->data != NULL) {
+        pthread_mutex_unlock(&cache->lock);
+        if (data != NULL) {
+            munmap(data, info->size);
+        }
+        return NULL;
+    }
+    file->mapping = false;
+
+    while (data != NULL && cache->mapped_bytes + info->size > cache->max_bytes) {
+        if (!evict_one(cache)) {
+            munmap(data, info->size);
+            data = NULL;
+        }
+    }
+    if (data == NULL) {
+        // Start counting again; it may get its turn later
+        file->bytes_read = 0;
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+
+    list_unlink(&cache->candidates, file);
+    cache->num_candidates--;
+    list_push(&cache->mapped, file);
+    file->data = data;
+    file->refs++;
+    cache->mapped_bytes += info->size;
+    pthread_mutex_unlock(&cache->lock);
+
+    LOG("Mapped hot file %llu (%lld bytes)\n", (unsigned long long) info->ino,
+            (long long) info->size);
+    return file;
+}
+
+/*
+ * Gives back a reference to a mapped file, once the reply sending from it is
+ * done
+ */
+void hot_cache_put(struct hot_cache *cache, struct hot_file *file)
+{
+    pthread_mutex_lock(&cache->lock);
+    file->refs--;
+    bool gone = file->refs == 0 && !file->listed;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (gone) {
+        free_file(file);
+    }
+}
@@ -0,0 +1,79 @@
+/**
+ * hot_cache.h
+ *
+ * Server-side cache of the files clients read most, kept mapped into memory
+ * under a byte budget. A read of a mapped file is answered from the mapping:
+ * the worker doesn't touch the handle's descriptor, and the engine hands the
+ * mapped pages to the socket with vmsplice() and splice(), without copying
+ * them.
+ *
+ * Files are known by what the handle table recorded when a client opened
+ * them (device, inode, size and modification time), so a file that changes
+ * becomes a different file here and its old mapping ages out.
+ *
+ * Every read counts a hit on its file. Files that aren't mapped are tracked
+ * as candidates, a bounded number of them, with the least recently read
+ * forgotten first. A candidate is mapped once reads of it add up to
+ * HOT_CACHE_PROMOTE_READS times its size, with MAP_POPULATE so all of it is
+ * in memory from the start. When a new mapping needs room, mapped files are
+ * passed over oldest first like a clock: one that was hit since it was last
+ * passed has its hits halved and goes round again, and the first without
+ * any is unmapped. Mappings that replies are still being sent from stay
+ * until those are done.
+ */
+
+#ifndef _HOT_CACHE_H_
+#define _HOT_CACHE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "handle_table.h"
+
+#define HOT_CACHE_BUCKETS 4096
+#define HOT_CACHE_CANDIDATES 4096
+#define DEFAULT_HOT_CACHE_MB 256
+
+/* Times over a file has to be read before it is mapped */
+#define HOT_CACHE_PROMOTE_READS 2
+
+struct hot_file {
+    struct handle_info info;
+    uint64_t hash;
+    uint64_t hits;              /* Reads; halved whenever eviction passes it */
+    uint64_t bytes_read;        /* While a candidate */
+    char *data;                 /* Whole file, or NULL while a candidate */
+    bool mapping;               /* A worker is mapping it */
+    bool listed;                /* Still in the cache; unmapped with its last ref otherwise */
+    unsigned refs;              /* Replies sending from data */
+    struct hot_file *hash_next;
+    struct hot_file *list_prev;
+    struct hot_file *list_next;
+};
+
+struct hot_list {
+    struct hot_file *head;
+    struct hot_file *tail;
+};
+
+struct hot_cache {
+    pthread_mutex_t lock;
+    size_t max_bytes;
+    size_t mapped_bytes;
+    size_t num_candidates;
+    struct hot_file *buckets[HOT_CACHE_BUCKETS];
+    struct hot_list candidates;     /* Most recently read first */
+    struct hot_list mapped;         /* Clock order, newest first */
+};
+
+void hot_cache_init(struct hot_cache *cache, size_t max_bytes);
+bool hot_cache_enabled(struct hot_cache *cache);
+struct hot_file *hot_cache_get(struct hot_cache *cache, const struct handle_info *info,
+        size_t len, bool *promote);
+struct hot_file *hot_cache_map(struct hot_cache *cache, const struct handle_info *info,
+        int fd);
+void hot_cache_put(struct hot_cache *cache, struct hot_file *file);
+
+#endif
@@ -0,0 +1,214 @@
+#include "lease_table.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "net.h"
+#include "server.h"
+
+/* FNV-1a */
+static uint64_t hash_path(const char *path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path != '\0'; path++) {
+        hash = (hash ^ (unsigned char) *path) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void lease_table_init(struct lease_table *table, size_t max)
+{
+    memset(table, 0, sizeof(struct lease_table));
+    pthread_mutex_init(&table->lock, NULL);
+    table->max = max;
+}
+
+/*
+ * Tells the session its lease on path is gone, or all of them if path is
+ * NULL. Called with the lock held, which keeps the session's connection open.
+ */
+static void push_invalidate(struct netfs_session *session, const char *path)
+{
+    char body[sizeof(struct netfs_push) + MAXIMUM_PATH];
+    struct netfs_push push = { 0 };
+    push.msg_type = MSG_INVALIDATE;
+    push.flags = path == NULL ? NETFS_INVALIDATE_ALL : 0;
+    if (path == NULL) {
+        path = "";
+    }
+
+    size_t path_len = strlen(path) + 1;
+    memcpy(body, &push, sizeof(struct netfs_push));
+    memcpy(body + sizeof(struct netfs_push), path, path_len);
+    session_push(session, body, sizeof(struct netfs_push) + path_len);
+}
+
+static void remove_lease(struct lease_table *table, struct lease *lease)
+{
+    struct lease **link = &table->buckets[lease->hash % LEASE_TABLE_BUCKETS];
+    while (*link != lease) {
+        link = &(*link)->hash_next;
+    }
+    *link = lease->hash_next;
+
+    if (lease->session_prev != NULL) {
+        lease->session_prev->session_next = lease->session_next;
+    } else {
+        lease->session->leases_held = lease->session_next;
+    }
+    if (lease->session_next != NULL) {
+        lease->session_next->session_prev = lease->session_prev;
+    }
+
+    if (lease->age_prev != NULL) {
+        lease->age_prev->age_next = lease->age_next;
+    } else {
+        table->oldest = lease->age_next;
+    }
+    if (lease->age_next != NULL) {
+        lease->age_next->age_prev = lease->age_prev;
+    } else {
+        table->newest = lease->age_prev;
+    }
+
+    table->count--;
+    free(lease->path);
+    free(lease);
+}
+
+static struct lease *find_lease(struct lease_table *table,
+        struct netfs_session *session, const char *path, uint64_t hash)
+{
+    struct lease *lease = table->buckets[hash % LEASE_TABLE_BUCKETS];
+    while (lease != NULL && (lease->hash != hash || lease->session != session
+                || strcmp(lease->path, path) != 0)) {
+        lease = lease->hash_next;
+    }
+    return lease;
+}
+
+/*
+ * Records that the session holds the attributes of path. Grant before looking
+ * the attributes up, so a change that comes in meanwhile recalls the lease
+ * rather than going unnoticed. If there is no room, the session is told
+ * straight away that it holds no lease.
+ */
+void lease_grant(struct lease_table *table, struct netfs_session *session, const char *path)
+{
+    uint64_t hash = hash_path(path);
+
+    pthread_mutex_lock(&table->lock);
+    if (find_lease(table, session, path, hash) != NULL) {
+        pthread_mutex_unlock(&table->lock);
+        return;
+    }
+
+    if (table->count >= table->max && table->oldest != NULL) {
+        struct lease *oldest = table->oldest;
+        push_invalidate(oldest->session, oldest->path);
+        remove_lease(table, oldest);
+    }
+
+    struct lease *lease = calloc(1, sizeof(struct lease));
+    if (lease == NULL || (lease->path = strdup(path)) == NULL) {
+        perror("calloc");
+        free(lease);
+        push_invalidate(session, path);
+        pthread_mutex_unlock(&table->lock);
+        return;
+    }
+    lease->hash = hash;
+    lease->session = session;
+
+    lease->hash_next = table->buckets[hash % LEASE_TABLE_BUCKETS];
+    table->buckets[hash % LEASE_TABLE_BUCKETS] = lease;
+
+    lease->session_next = session->leases_held;
+    if (session->leases_held != NULL) {
+        session->leases_held->session_prev = lease;
+    }
+    session->leases_held = lease;
+
+    lease->age_prev = table->newest;
+    if (table->newest != NULL) {
+        table->newest->age_next = lease;
+    } else {
+        table->oldest = lease;
+    }
+    table->newest = lease;
+
+    table->count++;
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Takes back a lease just granted on a path whose changes turned out not to
+ * be watched
+ */
+void lease_recall(struct lease_table *table, struct netfs_session *session, const char *path)
+{
+    uint64_t hash = hash_path(path);
+
+    pthread_mutex_lock(&table->lock);
+    struct lease *lease = find_lease(table, session, path, hash);
+    if (lease != NULL) {
+        remove_lease(table, lease);
+    }
+    push_invalidate(session, path);
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Recalls every lease on path. Called whenever it may have changed.
+ */
+void lease_break(struct lease_table *table, const char *path)
+{
+    uint64_t hash = hash_path(path);
+
+    pthread_mutex_lock(&table->lock);
+    struct lease **link = &table->buckets[hash % LEASE_TABLE_BUCKETS];
+    while (*link != NULL) {
+        struct lease *lease = *link;
+        if (lease->hash == hash && strcmp(lease->path, path) == 0) {
+            LOG("Recalling lease on %s\n", path);
+            push_invalidate(lease->session, path);
+            remove_lease(table, lease);
+        } else {
+            link = &lease->hash_next;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Recalls every lease there is, with one message to each session holding
+ * any
+ */
+void lease_break_all(struct lease_table *table)
+{
+    pthread_mutex_lock(&table->lock);
+    while (table->oldest != NULL) {
+        struct netfs_session *session = table->oldest->session;
+        push_invalidate(session, NULL);
+        while (session->leases_held != NULL) {
+            remove_lease(table, session->leases_held);
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Drops the leases of a session whose connection is closing, without telling
+ * it. Nothing is pushed to the session once this returns.
+ */
+void lease_forget(struct lease_table *table, struct netfs_session *session)
+{
+    pthread_mutex_lock(&table->lock);
+    while (session->leases_held != NULL) {
+        remove_lease(table, session->leases_held);
+    }
+    pthread_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,54 @@
+/**
+ * lease_table.h
+ *
+ * Leases the server has handed out: which connections hold the attributes of
+ * which paths. When the metadata cache sees a path change, every lease on it
+ * is recalled by pushing a MSG_INVALIDATE to the connection that holds it,
+ * and the lease is gone; the client gets a new one by asking again. Leases
+ * end with their connection and are never pushed to a closed one.
+ *
+ * The table is bounded. Once it is full, granting a lease recalls the oldest
+ * one, so a client that keeps the attributes of many paths simply hears about
+ * the ones it hasn't asked for in a while.
+ */
+
+#ifndef _LEASE_TABLE_H_
+#define _LEASE_TABLE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LEASE_TABLE_BUCKETS 65536
+#define DEFAULT_MAX_LEASES (1024 * 1024)
+
+struct netfs_session;
+
+struct lease {
+    char *path;
+    uint64_t hash;
+    struct netfs_session *session;
+    struct lease *hash_next;
+    struct lease *session_prev;     /* The session's other leases */
+    struct lease *session_next;
+    struct lease *age_prev;         /* Every lease, in the order granted */
+    struct lease *age_next;
+};
+
+struct lease_table {
+    pthread_mutex_t lock;
+    size_t count;
+    size_t max;
+    struct lease *buckets[LEASE_TABLE_BUCKETS];
+    struct lease *oldest;
+    struct lease *newest;
+};
+
+void lease_table_init(struct lease_table *table, size_t max);
+void lease_grant(struct lease_table *table, struct netfs_session *session, const char *path);
+void lease_recall(struct lease_table *table, struct netfs_session *session, const char *path);
+void lease_break(struct lease_table *table, const char *path);
+void lease_break_all(struct lease_table *table);
+void lease_forget(struct lease_table *table, struct netfs_session *session);
+
+#endif
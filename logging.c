@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+
+#include "logging.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * One thread's pending messages, each a uint32_t length and the text. head
+ * and tail count bytes ever written and drained; only the owning thread moves
+ * head and only the drainer moves tail, so neither needs a lock.
+ */
+struct log_ring {
+    char buf[LOG_RING_SIZE];
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;           /* Messages that didn't fit */
+    uint64_t reported;          /* How many of those were mentioned; drainer only */
+    int in_use;                 /* Owned by a live thread */
+    struct log_ring *next;
+};
+
+static const char *level_names[] = {
+    [LOG_LEVEL_ERROR] = "ERROR",
+    [LOG_LEVEL_WARN] = "WARN",
+    [LOG_LEVEL_INFO] = "INFO",
+    [LOG_LEVEL_DEBUG] = "DEBUG",
+};
+
+/* Every ring, newest first. Rings of threads that exit are handed to new
+ * threads rather than freed, so the list only grows with the peak number of
+ * threads. */
+static struct log_ring *all_rings;
+
+static __thread struct log_ring *my_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/* Held while draining, by the background thread or log_flush() */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static char drain_buf[64 * 1024];
+
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool drainer_started;
+static bool drain_inline;       /* No background thread; write straight away */
+static bool hooks_registered;
+
+static void release_ring(void *arg)
+{
+    struct log_ring *ring = arg;
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_ring_key(void)
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+/*
+ * Returns the calling thread's ring, taking over one a finished thread left
+ * behind or making a new one. Returns NULL if there is no memory for one.
+ */
+static struct log_ring *thread_ring(void)
+{
+    if (my_ring != NULL) {
+        return my_ring;
+    }
+    pthread_once(&ring_key_once, make_ring_key);
+
+    struct log_ring *ring = __atomic_load_n(&all_rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        int free_ring = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &free_ring, 1, false,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct log_ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->in_use = 1;
+        ring->next = __atomic_load_n(&all_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&all_rings, &ring->next, ring, true,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            ;
+        }
+    }
+
+    my_ring = ring;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+static void ring_copy_in(struct log_ring *ring, uint64_t pos, const void *data, size_t len)
+{
+    size_t start = pos % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - start ? len : LOG_RING_SIZE - start;
+    memcpy(ring->buf + start, data, first);
+    memcpy(ring->buf, (const char *) data + first, len - first);
+}
+
+static void ring_copy_out(const struct log_ring *ring, uint64_t pos, void *data, size_t len)
+{
+    size_t start = pos % LOG_RING_SIZE;
+    size_t first = len < LOG_RING_SIZE - start ? len : LOG_RING_SIZE - start;
+    memcpy(data, ring->buf + start, first);
+    memcpy((char *) data + first, ring->buf, len - first);
+}
+
+static void write_all(const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(STDERR_FILENO, buf, len);
+        if (written <= 0) {
+            return;
+        }
+        buf += written;
+        len -= written;
+    }
+}
+
+/*
+ * Writes out what every ring holds, batching it into as few writes as it
+ * can. Returns the number of messages written. Caller holds drain_lock.
+ */
+static size_t drain(void)
+{
+    size_t messages = 0;
+    size_t out = 0;
+
+    struct log_ring *ring = __atomic_load_n(&all_rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        while (tail < head) {
+            uint32_t len;
+            ring_copy_out(ring, tail, &len, sizeof(uint32_t));
+            if (out + len > sizeof(drain_buf)) {
+                write_all(drain_buf, out);
+                out = 0;
+            }
+            ring_copy_out(ring, tail + sizeof(uint32_t), drain_buf + out, len);
+            out += len;
+            tail += sizeof(uint32_t) + len;
+            messages++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            if (out + LOG_MESSAGE_MAX > sizeof(drain_buf)) {
+                write_all(drain_buf, out);
+                out = 0;
+            }
+            out += snprintf(drain_buf + out, LOG_MESSAGE_MAX,
+                    "[%llu log messages dropped]\n",
+                    (unsigned long long) (dropped - ring->reported));
+            ring->reported = dropped;
+        }
+    }
+
+    write_all(drain_buf, out);
+    return messages;
+}
+
+static void *drain_thread(void *arg)
+{
+    (void) arg;
+    struct timespec interval = { 0, LOG_DRAIN_INTERVAL_MS * 1000000L };
+    while (true) {
+        pthread_mutex_lock(&drain_lock);
+        size_t messages = drain();
+        pthread_mutex_unlock(&drain_lock);
+        if (messages == 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Writes out everything logged so far. Runs at exit, so nothing is lost
+ * when the process ends normally.
+ */
+void log_flush(void)
+{
+    pthread_mutex_lock(&drain_lock);
+    drain();
+    pthread_mutex_unlock(&drain_lock);
+}
+
+/*
+ * A forked child has no drainer and may have inherited the locks held. It
+ * starts its own drainer when it first logs, and leaves what the parent had
+ * pending to the parent.
+ */
+static void after_fork_child(void)
+{
+    pthread_mutex_init(&drain_lock, NULL);
+    pthread_mutex_init(&start_lock, NULL);
+    drainer_started = false;
+
+    struct log_ring *ring = all_rings;
+    for (; ring != NULL; ring = ring->next) {
+        ring->tail = ring->head;
+        ring->reported = ring->dropped;
+    }
+}
+
+static void start_drainer(void)
+{
+    pthread_mutex_lock(&start_lock);
+    if (!hooks_registered) {
+        atexit(log_flush);
+        pthread_atfork(NULL, NULL, after_fork_child);
+        hooks_registered = true;
+    }
+    if (!drainer_started) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, drain_thread, NULL) != 0) {
+            perror("pthread_create");
+            drain_inline = true;
+        }
+        pthread_attr_destroy(&attr);
+        __atomic_store_n(&drainer_started, true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&start_lock);
+}
+
+void log_message(int level, const char *file, int line, const char *func,
+        const char *fmt, ...)
+{
+    if (!__atomic_load_n(&drainer_started, __ATOMIC_ACQUIRE)) {
+        start_drainer();
+    }
+
+    char msg[LOG_MESSAGE_MAX];
+    int len = snprintf(msg, sizeof(msg), "%s %s:%d:%s(): ", level_names[level],
+            file, line, func);
+    if (len < 0) {
+        return;
+    }
+    if ((size_t) len < sizeof(msg)) {
+        va_list args;
+        va_start(args, fmt);
+        int body = vsnprintf(msg + len, sizeof(msg) - len, fmt, args);
+        va_end(args);
+        if (body > 0) {
+            len += body;
+        }
+    }
+    if ((size_t) len >= sizeof(msg)) {
+        len = sizeof(msg) - 1;
+        msg[len - 1] = '\n';
+    }
+
+    struct log_ring *ring = thread_ring();
+    if (ring == NULL || drain_inline) {
+        write_all(msg, len);
+        return;
+    }
+
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t record_len = len;
+    if (head - tail + sizeof(uint32_t) + record_len > LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    ring_copy_in(ring, head, &record_len, sizeof(uint32_t));
+    ring_copy_in(ring, head + sizeof(uint32_t), msg, record_len);
+    __atomic_store_n(&ring->head, head + sizeof(uint32_t) + record_len, __ATOMIC_RELEASE);
+}
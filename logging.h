@@ -1,16 +1,53 @@
 /**
  * logging.h
  *
- * Logging functionality
+ * Logging functionality. Messages have a level, and those above LOG_LEVEL
+ * are compiled out entirely: their arguments aren't even evaluated. The rest
+ * are formatted by the calling thread into a ring buffer of its own and
+ * written to stderr by a background thread, so logging never waits on the
+ * terminal or takes a lock. When a thread's ring is full its messages are
+ * dropped and counted rather than blocking it.
+ *
+ * Build with LOG_LEVEL=LOG_LEVEL_DEBUG to see every request; the Makefile
+ * takes it as a number (make LOG_LEVEL=4).
  */
 
 #ifndef _LOGGING_H_
 #define _LOGGING_H_
 
-#define LOG_ON 1
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+/* Bytes of pending messages each thread may have */
+#define LOG_RING_SIZE (64 * 1024)
+
+/* Longest message; longer ones are cut short */
+#define LOG_MESSAGE_MAX 512
+
+/* How long the background thread sleeps when there is nothing to write */
+#define LOG_DRAIN_INTERVAL_MS 10
+
+void log_message(int level, const char *file, int line, const char *func,
+        const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+void log_flush(void);
+
+#define LOG_AT(level, fmt, ...) \
+        do { if ((level) <= LOG_LEVEL) log_message((level), __FILE__, \
+                                __LINE__, __func__, fmt, __VA_ARGS__); } while (0)
+
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, __VA_ARGS__)
+#define LOG_WARN(fmt, ...) LOG_AT(LOG_LEVEL_WARN, fmt, __VA_ARGS__)
+#define LOG_INFO(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, __VA_ARGS__)
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, __VA_ARGS__)
 
-#define LOG(fmt, ...) \
-        do { if (LOG_ON) fprintf(stderr, "%s:%d:%s(): " fmt, __FILE__, \
-                                __LINE__, __func__, __VA_ARGS__); } while (0)
+/* Per-request tracing */
+#define LOG(fmt, ...) LOG_DEBUG(fmt, __VA_ARGS__)
 
 #endif
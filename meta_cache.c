@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+
+#include "meta_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "logging.h"
+
+/* Changes that can alter the attributes of an entry or of its directory */
+#define META_WATCH_EVENTS (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE \
+        | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Export root, resolved, to tell real directories from symlinked ones */
+static char export_root[PATH_MAX];
+
+static uint64_t hash_path(const char *path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *path != '\0'; path++) {
+        hash = (hash ^ (unsigned char) *path) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static struct meta_shard *shard_of(struct meta_cache *cache, uint64_t hash)
+{
+    return &cache->shards[hash % META_CACHE_SHARDS];
+}
+
+static struct meta_entry **bucket_of(struct meta_shard *shard, uint64_t hash)
+{
+    return &shard->buckets[(hash / META_CACHE_SHARDS) % META_SHARD_BUCKETS];
+}
+
+static struct meta_entry *find_entry(struct meta_shard *shard, const char *path,
+        uint64_t hash)
+{
+    struct meta_entry *entry = *bucket_of(shard, hash);
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path) != 0)) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+static void lru_unlink(struct meta_shard *shard, struct meta_entry *entry)
+{
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push(struct meta_shard *shard, struct meta_entry *entry)
+{
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = entry;
+    }
+    shard->lru_head = entry;
+    if (shard->lru_tail == NULL) {
+        shard->lru_tail = entry;
+    }
+}
+
+/* Called with the shard lock held */
+static void remove_entry(struct meta_shard *shard, struct meta_entry *entry)
+{
+    struct meta_entry **link = bucket_of(shard, entry->hash);
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    lru_unlink(shard, entry);
+    shard->count--;
+    free(entry->path);
+    free(entry);
+}
+
+static void invalidate(struct meta_cache *cache, const char *path)
+{
+    uint64_t hash = hash_path(path);
+    struct meta_shard *shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    struct meta_entry *entry = find_entry(shard, path, hash);
+    if (entry != NULL) {
+        remove_entry(shard, entry);
+    }
+    shard->generation++;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (cache->listener != NULL) {
+        cache->listener(path, cache->listener_arg);
+    }
+}
+
+static void invalidate_all(struct meta_cache *cache)
+{
+    for (int i = 0; i < META_CACHE_SHARDS; i++) {
+        struct meta_shard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->lru_head != NULL) {
+            remove_entry(shard, shard->lru_head);
+        }
+        shard->generation++;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    if (cache->listener != NULL) {
+        cache->listener(NULL, cache->listener_arg);
+    }
+}
+
+static struct meta_watch *find_watch_wd(struct meta_cache *cache, int wd)
+{
+    struct meta_watch *watch = cache->watch_by_wd[wd % META_WATCH_BUCKETS];
+    while (watch != NULL && watch->wd != wd) {
+        watch = watch->wd_next;
+    }
+    return watch;
+}
+
+/* Called with the watch lock held */
+static void remove_watch(struct meta_cache *cache, struct meta_watch *watch)
+{
+    struct meta_watch **link = &cache->watch_by_wd[watch->wd % META_WATCH_BUCKETS];
+    while (*link != watch) {
+        link = &(*link)->wd_next;
+    }
+    *link = watch->wd_next;
+
+    link = &cache->watch_by_path[hash_path(watch->dir) % META_WATCH_BUCKETS];
+    while (*link != watch) {
+        link = &(*link)->path_next;
+    }
+    *link = watch->path_next;
+
+    free(watch->dir);
+    free(watch);
+}
+
+/*
+ * Makes sure the directory at client path dir is watched. Returns 0 if it
+ * already was, 1 if the watch is new, or -1 if it can't be watched: out of
+ * watches, or reached through a symlink, whose target could change without
+ * any event for this path.
+ */
+static int watch_dir(struct meta_cache *cache, const char *dir)
+{
+    uint64_t hash = hash_path(dir);
+    int res = -1;
+
+    pthread_mutex_lock(&cache->watch_lock);
+    struct meta_watch *watch = cache->watch_by_path[hash % META_WATCH_BUCKETS];
+    while (watch != NULL && strcmp(watch->dir, dir) != 0) {
+        watch = watch->path_next;
+    }
+    if (watch != NULL) {
+        pthread_mutex_unlock(&cache->watch_lock);
+        return 0;
+    }
+
+    char local[MAXIMUM_PATH + 1];
+    char resolved[PATH_MAX];
+    char expected[PATH_MAX + MAXIMUM_PATH];
+    snprintf(local, sizeof(local), ".%s", dir);
+    snprintf(expected, sizeof(expected), "%s%s", export_root,
+            strcmp(dir, "/") == 0 ? "" : dir);
+    if (realpath(local, resolved) == NULL || strcmp(resolved, expected) != 0) {
+        pthread_mutex_unlock(&cache->watch_lock);
+        return -1;
+    }
+
+    int wd = inotify_add_watch(cache->inotify_fd, local, META_WATCH_EVENTS | IN_ONLYDIR);
+    if (wd == -1) {
+        if (errno == ENOSPC) {
+            LOG_WARN("Out of inotify watches, not caching under %s\n", dir);
+        }
+    } else if (find_watch_wd(cache, wd) != NULL) {
+        // The same directory under another name; events would only say one
+        res = -1;
+    } else if ((watch = calloc(1, sizeof(struct meta_watch))) == NULL
+            || (watch->dir = strdup(dir)) == NULL) {
+        free(watch);
+    } else {
+        watch->wd = wd;
+        watch->path_next = cache->watch_by_path[hash % META_WATCH_BUCKETS];
+        cache->watch_by_path[hash % META_WATCH_BUCKETS] = watch;
+        watch->wd_next = cache->watch_by_wd[wd % META_WATCH_BUCKETS];
+        cache->watch_by_wd[wd % META_WATCH_BUCKETS] = watch;
+        res = 1;
+    }
+    pthread_mutex_unlock(&cache->watch_lock);
+    return res;
+}
+
+/*
+ * Applies one inotify event. dir is the watched directory's client path.
+ */
+static void handle_event(struct meta_cache *cache, const struct inotify_event *event,
+        const char *dir)
+{
+    if (event->len == 0 || event->name[0] == '\0') {
+        // The directory itself. Once it is gone or renamed, nothing cached
+        // under its old name can be trusted.
+        invalidate(cache, dir);
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            invalidate_all(cache);
+        }
+        return;
+    }
+
+    char path[MAXIMUM_PATH];
+    int len = snprintf(path, sizeof(path), "%s/%s",
+            strcmp(dir, "/") == 0 ? "" : dir, event->name);
+    if (len > 0 && (size_t) len < sizeof(path)) {
+        invalidate(cache, path);
+    }
+
+    // Entries coming and going change the directory's times and link count,
+    // and a directory moving renames everything below it
+    if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+        invalidate(cache, dir);
+        if ((event->mask & IN_ISDIR) && (event->mask & (IN_MOVED_FROM | IN_MOVED_TO))) {
+            invalidate_all(cache);
+        }
+    }
+}
+
+static void *watch_thread(void *arg)
+{
+    struct meta_cache *cache = arg;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        ssize_t len = read(cache->inotify_fd, buf, sizeof(buf));
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            // Without events nothing cached stays correct
+            LOG_ERROR("%s\n", "Lost inotify, disabling the attribute cache");
+            __atomic_store_n(&cache->enabled, false, __ATOMIC_RELAXED);
+            invalidate_all(cache);
+            return NULL;
+        }
+
+        for (ssize_t pos = 0; pos < len; ) {
+            const struct inotify_event *event = (const struct inotify_event *) (buf + pos);
+            pos += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                LOG_WARN("%s\n", "inotify queue overflowed");
+                invalidate_all(cache);
+                continue;
+            }
+
+            pthread_mutex_lock(&cache->watch_lock);
+            struct meta_watch *watch = find_watch_wd(cache, event->wd);
+            if (watch == NULL) {
+                pthread_mutex_unlock(&cache->watch_lock);
+                continue;
+            }
+            handle_event(cache, event, watch->dir);
+
+            // A renamed directory keeps its watch under the old name; drop
+            // it so the new name gets its own
+            if (event->mask & IN_MOVE_SELF) {
+                inotify_rm_watch(cache->inotify_fd, watch->wd);
+                remove_watch(cache, watch);
+            } else if (event->mask & IN_IGNORED) {
+                remove_watch(cache, watch);
+                invalidate_all(cache);
+            }
+            pthread_mutex_unlock(&cache->watch_lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Sets up a cache of at most max_entries attributes, converted from stat
+ * results with convert. A cache of 0 entries, or one without inotify, passes
+ * every lookup straight through. Relative paths are taken from the current
+ * directory, which must be the export root. Returns -1 if the cache can't be
+ * set up.
+ */
+int meta_cache_init(struct meta_cache *cache, size_t max_entries, meta_convert_fn convert)
+{
+    memset(cache, 0, sizeof(struct meta_cache));
+    cache->convert = convert;
+    cache->inotify_fd = -1;
+    pthread_mutex_init(&cache->watch_lock, NULL);
+    for (int i = 0; i < META_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+    }
+
+    if (max_entries == 0) {
+        return 0;
+    }
+    cache->max_per_shard = (max_entries + META_CACHE_SHARDS - 1) / META_CACHE_SHARDS;
+
+    if (realpath(".", export_root) == NULL) {
+        perror("realpath");
+        return -1;
+    }
+    if (strcmp(export_root, "/") == 0) {
+        export_root[0] = '\0';
+    }
+
+    cache->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (cache->inotify_fd == -1) {
+        perror("inotify_init1");
+        return -1;
+    }
+    if (pthread_create(&cache->thread, NULL, watch_thread, cache) != 0) {
+        perror("pthread_create");
+        close(cache->inotify_fd);
+        cache->inotify_fd = -1;
+        return -1;
+    }
+    cache->enabled = true;
+    return 0;
+}
+
+/*
+ * Has listener called for every invalidation from now on. Set it up before
+ * the cache is used.
+ */
+void meta_cache_listen(struct meta_cache *cache, meta_invalidate_fn listener, void *arg)
+{
+    cache->listener_arg = arg;
+    cache->listener = listener;
+}
+
+/*
+ * Whether changes are being watched for. Once inotify is lost, they never
+ * are again.
+ */
+bool meta_cache_enabled(struct meta_cache *cache)
+{
+    return __atomic_load_n(&cache->enabled, __ATOMIC_RELAXED);
+}
+
+/*
+ * Makes sure changes to the entries of directory dir, a client path, are
+ * watched for, and says whether they are. Directories reached through a
+ * symlink never are.
+ */
+bool meta_cache_watch(struct meta_cache *cache, const char *dir)
+{
+    return meta_cache_enabled(cache) && watch_dir(cache, dir) != -1;
+}
+
+/*
+ * Stats path, as name in dir_fd or relative to the export root if dir_fd is
+ * -1. Returns 0 or a negative errno.
+ */
+static int stat_path(const char *path, int dir_fd, const char *name, bool nofollow,
+        struct stat *stbuf)
+{
+    int flags = nofollow ? AT_SYMLINK_NOFOLLOW : 0;
+    int res;
+    if (dir_fd != -1) {
+        res = fstatat(dir_fd, name, stbuf, flags);
+    } else {
+        char local[MAXIMUM_PATH + 1];
+        snprintf(local, sizeof(local), ".%s", path);
+        res = fstatat(AT_FDCWD, local, stbuf, flags);
+    }
+    return res == -1 ? -errno : 0;
+}
+
+/*
+ * Watches the export root and every directory between it and client path.
+ * Returns false if any of them can't be watched.
+ */
+static bool watched_above(struct meta_cache *cache, const char *path)
+{
+    if (strcmp(path, "/") == 0) {
+        return true;
+    }
+    if (path[0] != '/' || watch_dir(cache, "/") == -1) {
+        return false;
+    }
+
+    char above[MAXIMUM_PATH];
+    for (const char *slash = strchr(path + 1, '/'); slash != NULL;
+            slash = strchr(slash + 1, '/')) {
+        snprintf(above, sizeof(above), "%.*s", (int) (slash - path), path);
+        if (watch_dir(cache, above) == -1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Stores a result unless an invalidation came in since generation was read
+ */
+static void insert_entry(struct meta_cache *cache, const char *path, uint64_t hash,
+        uint64_t generation, int err, const struct attr_stat *atst)
+{
+    struct meta_shard *shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->generation != generation) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    struct meta_entry *entry = find_entry(shard, path, hash);
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(struct meta_entry));
+        if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+            free(entry);
+            pthread_mutex_unlock(&shard->lock);
+            return;
+        }
+        entry->hash = hash;
+        struct meta_entry **bucket = bucket_of(shard, hash);
+        entry->hash_next = *bucket;
+        *bucket = entry;
+        shard->count++;
+        if (shard->count > cache->max_per_shard) {
+            remove_entry(shard, shard->lru_tail);
+        }
+    } else {
+        lru_unlink(shard, entry);
+    }
+    lru_push(shard, entry);
+    entry->err = err;
+    if (atst != NULL) {
+        entry->attr = *atst;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Gets the attributes of the entry at client path, from the cache if they
+ * are there. On a miss the entry is stat'ed as name in dir_fd if dir_fd isn't
+ * -1 (the directory listing it must be path's parent), and relative to the
+ * export root otherwise. Symlinks are followed. If watched isn't NULL, it is
+ * set to whether any later change to the result will be invalidated. Returns
+ * 0 or a negative errno.
+ */
+int meta_cache_stat(struct meta_cache *cache, const char *path, int dir_fd,
+        const char *name, struct attr_stat *atst, bool *watched)
+{
+    struct stat stbuf;
+    int res;
+
+    if (watched != NULL) {
+        *watched = false;
+    }
+
+    if (!meta_cache_enabled(cache)) {
+        res = stat_path(path, dir_fd, name, false, &stbuf);
+        if (res == 0) {
+            cache->convert(&stbuf, atst);
+        }
+        return res;
+    }
+
+    uint64_t hash = hash_path(path);
+    struct meta_shard *shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    struct meta_entry *entry = find_entry(shard, path, hash);
+    if (entry != NULL) {
+        lru_unlink(shard, entry);
+        lru_push(shard, entry);
+        res = -entry->err;
+        if (res == 0) {
+            *atst = entry->attr;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        if (watched != NULL) {
+            *watched = true;
+        }
+        return res;
+    }
+    uint64_t generation = shard->generation;
+    pthread_mutex_unlock(&shard->lock);
+
+    // Watch every directory above first, so any change after the stat is
+    // seen, renames of ancestors included
+    bool cacheable = watched_above(cache, path);
+
+    // Changes made through another name only notify that name's directory,
+    // so symlinks and files with several links aren't cached
+    res = stat_path(path, dir_fd, name, true, &stbuf);
+    if (res == 0 && S_ISLNK(stbuf.st_mode)) {
+        cacheable = false;
+        res = stat_path(path, dir_fd, name, false, &stbuf);
+    }
+    if (res == 0 && !S_ISDIR(stbuf.st_mode) && stbuf.st_nlink > 1) {
+        cacheable = false;
+    }
+    if (res == 0) {
+        cache->convert(&stbuf, atst);
+    }
+
+    // A directory's attributes change with its contents, which only its own
+    // watch sees. One watched just now may have changed before, so it is
+    // cached next time.
+    if (res == 0 && S_ISDIR(stbuf.st_mode) && cacheable) {
+        cacheable = watch_dir(cache, path) == 0;
+    }
+
+    if (cacheable && (res == 0 || res == -ENOENT)) {
+        insert_entry(cache, path, hash, generation, -res, res == 0 ? atst : NULL);
+    }
+    if (watched != NULL) {
+        *watched = cacheable && (res == 0 || res == -ENOENT);
+    }
+    return res;
+}
@@ -0,0 +1,96 @@
+/**
+ * meta_cache.h
+ *
+ * Server-side cache of file attributes, keyed by the path clients use and
+ * holding the struct attr_stat exactly as it is sent (ownership and mode
+ * already reduced), or ENOENT for paths that don't exist. Hot metadata is
+ * answered from memory without a system call.
+ *
+ * Entries are kept coherent with inotify. Before anything is cached, every
+ * directory from the export root down to the one holding it is watched, so a
+ * rename of any of them is seen, and a directory's own entry is only cached
+ * once it is watched too. A background thread drops an entry on any change
+ * to it, and drops a directory's entry when its contents change. Renamed
+ * directories, lost watches and queue overflows drop everything. Each shard
+ * carries a generation that every invalidation bumps, so a result that was
+ * stat'ed before a change but arrives after its event is never stored. A
+ * listener can be told of every invalidation as well, and of whether each
+ * lookup was of a path the watches cover, to keep state of its own.
+ *
+ * Symlinks and files with several hard links aren't cached, since a change
+ * through another name only notifies that name's directory. Like inotify
+ * itself this only sees changes made through this machine's view of the file
+ * system; an export on a network file system shouldn't be cached.
+ */
+
+#ifndef _META_CACHE_H_
+#define _META_CACHE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "net.h"
+
+#define META_CACHE_SHARDS 64
+#define META_SHARD_BUCKETS 1024
+#define META_WATCH_BUCKETS 4096
+#define DEFAULT_META_CACHE_ENTRIES 65536
+
+typedef void (*meta_convert_fn)(const struct stat *stbuf, struct attr_stat *atst);
+
+/* Called from the watch thread for every path invalidated, or with NULL when
+ * everything is */
+typedef void (*meta_invalidate_fn)(const char *path, void *arg);
+
+struct meta_entry {
+    char *path;
+    uint64_t hash;
+    int err;                    /* 0, or ENOENT for a path known not to exist */
+    struct attr_stat attr;
+    struct meta_entry *hash_next;
+    struct meta_entry *lru_prev;
+    struct meta_entry *lru_next;
+};
+
+struct meta_shard {
+    pthread_mutex_t lock;
+    uint64_t generation;        /* Bumped by every invalidation */
+    size_t count;
+    struct meta_entry *buckets[META_SHARD_BUCKETS];
+    struct meta_entry *lru_head;    /* Most recently used */
+    struct meta_entry *lru_tail;    /* Next to be evicted */
+};
+
+/* A watched directory, found by path when caching and by wd for events */
+struct meta_watch {
+    int wd;
+    char *dir;
+    struct meta_watch *path_next;
+    struct meta_watch *wd_next;
+};
+
+struct meta_cache {
+    bool enabled;
+    size_t max_per_shard;
+    meta_convert_fn convert;
+    meta_invalidate_fn listener;
+    void *listener_arg;
+    int inotify_fd;
+    pthread_t thread;
+    pthread_mutex_t watch_lock;
+    struct meta_watch *watch_by_path[META_WATCH_BUCKETS];
+    struct meta_watch *watch_by_wd[META_WATCH_BUCKETS];
+    struct meta_shard shards[META_CACHE_SHARDS];
+};
+
+int meta_cache_init(struct meta_cache *cache, size_t max_entries, meta_convert_fn convert);
+void meta_cache_listen(struct meta_cache *cache, meta_invalidate_fn listener, void *arg);
+bool meta_cache_enabled(struct meta_cache *cache);
+bool meta_cache_watch(struct meta_cache *cache, const char *dir);
+int meta_cache_stat(struct meta_cache *cache, const char *path, int dir_fd,
+        const char *name, struct attr_stat *atst, bool *watched);
+
+#endif
@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <netdb.h> 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -13,10 +14,12 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdint.h>
 
 
+#include "common.h"
 #include "logging.h"
 
 ssize_t read_len(int fd, void *buf, size_t length) {
@@ -24,7 +27,6 @@ ssize_t read_len(int fd, void *buf, size_t length) {
     size_t bytes_read = 0;
 
     while(bytes_read < length) {
-        // printf("read_len size_t length: %d\n", length);
         bytes = read(fd, buf + bytes_read, length - bytes_read);
         if(bytes == -1) {
             perror("read");
@@ -33,7 +35,6 @@ ssize_t read_len(int fd, void *buf, size_t length) {
             LOG("%s\n", "Stream reached EOF");
             return 0;
         }
-        // printf("*******BYTES: %d\n", bytes); 
         bytes_read += bytes;
     }
     LOG("Read %zu bytes\n", bytes_read);
@@ -55,9 +56,31 @@ ssize_t write_len(int fd, void *buf, size_t length) {
     return bytes_written; 
 }
 
-int connect_to(char *hostname, int port) 
+/*
+ * Looks up the server once so callers that open several connections don't pay
+ * for a name lookup every time.
+ */
+int resolve_host(char *hostname, int port, struct sockaddr_in *addr)
 {
+    struct hostent *server = gethostbyname(hostname);
+    if (server == NULL) {
+        fprintf(stderr, "Could not resolve host: %s\n", hostname);
+        return -1;
+    }
 
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    addr->sin_addr = *((struct in_addr *) server->h_addr);
+    return 0;
+}
+
+/*
+ * Opens a TCP connection to an already resolved address. Nagle is disabled
+ * since requests are small and the connection is reused for many of them.
+ */
+int connect_addr(struct sockaddr_in *addr)
+{
     int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
 
     if (socket_fd == -1) {
@@ -65,24 +88,134 @@ int connect_to(char *hostname, int port)
         return -1;
     }
 
-    struct hostent *server = gethostbyname(hostname);
-    if (server == NULL) {
-        fprintf(stderr, "Could not resolve host: %s\n", hostname);
-        return -1;
-    }
-
-    struct sockaddr_in serv_addr = { 0 };
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    serv_addr.sin_addr = *((struct in_addr *) server->h_addr);
-
     if (connect(
                 socket_fd,
-                (struct sockaddr *) &serv_addr,
+                (struct sockaddr *) addr,
                 sizeof(struct sockaddr_in)) == -1) {
 
         perror("connect");
+        close(socket_fd);
         return -1;
     }
+
+    int one = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
     return socket_fd;
 }
+
+int connect_to(char *hostname, int port) 
+{
+    struct sockaddr_in serv_addr;
+    if (resolve_host(hostname, port, &serv_addr) == -1) {
+        return -1;
+    }
+
+    return connect_addr(&serv_addr);
+}
+
+/*
+ * Sends a request header followed by its path and any fixed-size arguments in
+ * a single write.
+ */
+int write_request(int fd, uint16_t type, uint64_t request_id, uint64_t node,
+        const char *path, const void *payload, size_t payload_len)
+{
+    return write_request_body(fd, type, request_id, node, path, payload,
+            payload_len, NULL, 0);
+}
+
+/*
+ * Like write_request, for messages whose fixed-size arguments are followed by
+ * a variable-length body (see request_body_len). Everything still goes out in
+ * a single writev.
+ */
+int write_request_body(int fd, uint16_t type, uint64_t request_id, uint64_t node,
+        const char *path, const void *payload, size_t payload_len,
+        const void *body, size_t body_len)
+{
+    char buf[sizeof(struct netfs_msg_header) + MAXIMUM_PATH + NETFS_MAX_PAYLOAD];
+    struct netfs_msg_header req_header = { 0 };
+    req_header.version = NETFS_PROTOCOL_VERSION;
+    req_header.msg_type = type;
+    req_header.request_id = request_id;
+    req_header.node = node;
+    req_header.msg_len = strlen(path) + 1;
+
+    if (req_header.msg_len > MAXIMUM_PATH || payload_len > NETFS_MAX_PAYLOAD) {
+        return -1;
+    }
+
+    size_t total = sizeof(struct netfs_msg_header);
+    memcpy(buf, &req_header, total);
+    memcpy(buf + total, path, req_header.msg_len);
+    total += req_header.msg_len;
+    if (payload_len > 0) {
+        memcpy(buf + total, payload, payload_len);
+        total += payload_len;
+    }
+
+    struct iovec iov[2] = {
+        { .iov_base = buf, .iov_len = total },
+        { .iov_base = (void *) body, .iov_len = body_len },
+    };
+    int iovcnt = body_len > 0 ? 2 : 1;
+    struct iovec *next = iov;
+    while (iovcnt > 0) {
+        ssize_t bytes = writev(fd, next, iovcnt);
+        if (bytes == -1) {
+            perror("writev");
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t) bytes >= next->iov_len) {
+            bytes -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            next->iov_base = (char *) next->iov_base + bytes;
+            next->iov_len -= bytes;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Number of argument bytes that follow the path for each message type.
+ */
+size_t request_payload_len(uint16_t type)
+{
+    switch (type) {
+        case MSG_OPEN:
+            return sizeof(struct netfs_open_args);
+        case MSG_READ:
+            return sizeof(struct netfs_read_args);
+        case MSG_READDIR:
+        case MSG_READDIRPLUS:
+            return sizeof(struct netfs_readdir_args);
+        case MSG_RELEASE:
+            return sizeof(struct netfs_release_args);
+        case MSG_COMPOUND:
+            return sizeof(struct netfs_compound_args);
+        case MSG_HELLO:
+            return sizeof(struct netfs_hello_args);
+        case MSG_FORGET:
+            return sizeof(struct netfs_forget_args);
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Number of variable-length body bytes that follow the fixed-size arguments,
+ * which only compound requests have.
+ */
+size_t request_body_len(uint16_t type, const void *payload)
+{
+    if (type != MSG_COMPOUND) {
+        return 0;
+    }
+
+    struct netfs_compound_args args;
+    memcpy(&args, payload, sizeof(struct netfs_compound_args));
+    return args.body_len;
+}
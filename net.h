@@ -5,17 +5,21 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <netinet/in.h>
 
 enum msg_types {
     MSG_READDIR = 1, 
     MSG_GETATTR = 2,
     MSG_OPEN = 3,
-    MSG_READ = 4
-};
-
-struct __attribute__((__packed__)) netfs_msg_header {
-    uint64_t msg_len;
-    uint16_t msg_type;
+    MSG_READ = 4,
+    MSG_READDIRPLUS = 5,
+    MSG_RELEASE = 6,
+    MSG_COMPOUND = 7,
+    MSG_HELLO = 8,
+    MSG_STATS = 9,
+    MSG_INVALIDATE = 10,
+    MSG_LOOKUP = 11,
+    MSG_FORGET = 12
 };
 
 struct attr_stat
@@ -30,7 +34,247 @@ struct attr_stat
     struct timespec mtim;   /* Time of last modification */
 };
 
+/*
+ * Every request starts with a netfs_msg_header and is answered with a
+ * netfs_reply_header carrying the same request_id. A client may have any
+ * number of requests outstanding on one connection, and the server sends the
+ * replies in whatever order they finish.
+ */
+#define NETFS_PROTOCOL_VERSION 4
+
+struct __attribute__((__packed__)) netfs_msg_header {
+    uint8_t version;        /* NETFS_PROTOCOL_VERSION */
+    uint16_t msg_type;
+    uint64_t request_id;    /* Chosen by the client, echoed in the reply */
+    uint64_t node;          /* Node the request is about, or 0; see below */
+    uint64_t msg_len;       /* Length of the path following, NUL included */
+};
+
+/*
+ * A request names the file it is about either by path, absolute from the
+ * export root, with node 0, or by a node ID the server gave out, with an
+ * empty path. Node IDs stand for a file itself rather than its name: the
+ * server resolves them without walking any path, and a directory keeps its
+ * ID when it is renamed. A file whose node ID no longer names it, because it
+ * was removed or replaced, fails with ESTALE.
+ *
+ * NETFS_ROOT_NODE is always the export root. Every other ID comes from a
+ * MSG_LOOKUP, with node the directory and path the name of an entry in it,
+ * answered with a netfs_lookup_reply. The same file gets the same ID for as
+ * long as any client holds a reference to it. Each successful lookup is one
+ * reference of the client's, and MSG_FORGET, with node the ID and a
+ * netfs_forget_args, drops nlookup of them again; once no client has any
+ * left, the ID stops working. A client's references also go when the last
+ * of its connections closes. MSG_LOOKUP and MSG_FORGET can only be used on a
+ * connection that agreed NETFS_FEATURE_NODES. MSG_GETATTR, MSG_OPEN and
+ * MSG_READDIR(PLUS) take either form.
+ */
+#define NETFS_ROOT_NODE 1
+
+struct __attribute__((__packed__)) netfs_lookup_reply {
+    uint64_t node;
+    struct attr_stat attr;
+};
+
+struct __attribute__((__packed__)) netfs_forget_args {
+    uint64_t nlookup;
+};
+
+struct __attribute__((__packed__)) netfs_reply_header {
+    uint64_t request_id;
+    int32_t status;         /* 0, or the errno the request failed with */
+    uint64_t len;           /* Bytes of reply body following */
+};
+
+/* Fixed-size arguments that follow the path of a MSG_READ request */
+struct __attribute__((__packed__)) netfs_read_args {
+    uint64_t handle;    /* From the MSG_OPEN reply */
+    uint64_t size;
+    int64_t offset;
+};
+
+/*
+ * Reply bodies on success: MSG_GETATTR sends a struct attr_stat, MSG_OPEN a
+ * struct netfs_open_reply (see below), MSG_READ the file data (possibly less than asked
+ * for at the end of the file), MSG_READDIR(PLUS) a directory frame, MSG_LOOKUP
+ * a struct netfs_lookup_reply and MSG_RELEASE and MSG_FORGET nothing. Failed
+ * requests have an empty body.
+ */
+/*
+ * Fixed-size arguments that follow the path of a MSG_OPEN request. Files no
+ * bigger than inline_max (and the server's own threshold) are sent whole
+ * right after the netfs_open_reply. The server then has nothing left open:
+ * the handle is 0 and the file needs no MSG_READ or MSG_RELEASE.
+ */
+struct __attribute__((__packed__)) netfs_open_args {
+    uint32_t inline_max;
+};
+
+#define NETFS_INLINE_MAX (256 * 1024)
+
+struct __attribute__((__packed__)) netfs_open_reply {
+    uint64_t handle;    /* Opaque handle for MSG_READ and MSG_RELEASE */
+    uint8_t inlined;    /* Set if the file's content follows */
+};
+
+/* Fixed-size arguments that follow the path of a MSG_RELEASE request */
+struct __attribute__((__packed__)) netfs_release_args {
+    uint64_t handle;
+};
+
+/*
+ * A compound request carries an ordered list of sub-requests and is answered
+ * with all of their results in one reply. The fixed arguments below are
+ * followed by body_len bytes of operations, each a netfs_compound_op, its
+ * path (left out when path_len is 0, meaning the node and path of the
+ * compound request itself) and the fixed arguments of its message type.
+ * MSG_GETATTR, MSG_OPEN, MSG_READ, MSG_READDIR(PLUS), MSG_RELEASE, MSG_LOOKUP
+ * and MSG_FORGET may be used. A MSG_READ or MSG_RELEASE with handle 0 uses
+ * the handle from the last MSG_OPEN before it in the same compound, and fails
+ * with EBADF if that OPEN left no handle.
+ *
+ * The reply body holds a netfs_compound_result for every operation in order,
+ * each followed by the len bytes of that operation's reply body. Operations
+ * don't depend on each other succeeding beyond the handle passing above.
+ * Once the reply holds NETFS_COMPOUND_MAX_REPLY bytes, the operations left
+ * other than MSG_RELEASE and MSG_FORGET aren't run and fail with E2BIG.
+ */
+struct __attribute__((__packed__)) netfs_compound_args {
+    uint16_t count;     /* Number of operations */
+    uint32_t body_len;
+};
+
+struct __attribute__((__packed__)) netfs_compound_op {
+    uint16_t msg_type;
+    uint16_t path_len;  /* NUL included; 0 to reuse the compound's path */
+    uint64_t node;      /* Ignored when path_len is 0 */
+};
+
+struct __attribute__((__packed__)) netfs_compound_result {
+    uint16_t msg_type;
+    int32_t status;     /* 0, or the errno this operation failed with */
+    uint32_t len;
+};
+
+#define NETFS_COMPOUND_MAX_OPS 256
+#define NETFS_COMPOUND_MAX_BODY (64 * 1024)
+
+/* Reads inside a compound are copied into the reply, so they are capped */
+#define NETFS_COMPOUND_MAX_READ (1024 * 1024)
+#define NETFS_COMPOUND_MAX_REPLY (4 * 1024 * 1024)
+
+/*
+ * MSG_HELLO may be sent first on a connection to negotiate compression,
+ * leases and node IDs. The client sets bit (1 << type) in compress_types for
+ * every message type it wants compressed replies to, a bit in codecs for every
+ * codec it can decode, and a bit in features for everything else it wants.
+ * The reply is a netfs_hello_args holding what the server agreed to; a client
+ * that sends no MSG_HELLO gets nothing compressed, no leases and no lookups.
+ */
+struct __attribute__((__packed__)) netfs_hello_args {
+    uint32_t compress_types;
+    uint8_t codecs;
+    uint8_t features;
+    uint64_t client_id;     /* Same on all of a client's connections */
+};
+
+#define NETFS_CODEC_LZ4 1
+
+/*
+ * With NETFS_FEATURE_LEASES agreed, every successful MSG_GETATTR on the
+ * connection, inside a compound or not, also leaves the client a lease on the
+ * path: until the server sends a MSG_INVALIDATE for it, the attributes it got
+ * are still current, however long it keeps them. The server may also recall
+ * a lease without any change, for instance when it can't keep track of the
+ * path or holds too many leases. A lease ends with its connection.
+ */
+#define NETFS_FEATURE_LEASES 1
+
+/*
+ * NETFS_FEATURE_NODES lets the connection look up node IDs, which the node
+ * references it takes are counted against client_id, and is only agreed if
+ * that isn't 0. A client's connections must all send the same, and no other
+ * client's.
+ */
+#define NETFS_FEATURE_NODES 2
+
+/*
+ * Messages the server sends without being asked look like replies with
+ * request ID NETFS_PUSH_ID, status 0, and a body starting with a netfs_push.
+ * MSG_INVALIDATE follows that with the path whose lease is recalled,
+ * NUL-terminated, unless flags has NETFS_INVALIDATE_ALL, in which case every
+ * lease the connection held is recalled and the path is empty. An
+ * invalidation may arrive before the reply that granted the lease.
+ */
+#define NETFS_PUSH_ID UINT64_MAX
+
+struct __attribute__((__packed__)) netfs_push {
+    uint16_t msg_type;
+    uint16_t flags;
+};
+
+#define NETFS_INVALIDATE_ALL 1
+
+/*
+ * MSG_STATS asks for the server's metrics: request counts, reply bytes and
+ * latency summaries per message type, and connection counts. It has no
+ * arguments and the path is ignored. The reply body is plain text in the
+ * Prometheus exposition format, not NUL-terminated.
+ */
+
+/*
+ * Once compression is agreed for a message type, the body of every successful
+ * reply of that type on the connection is sent as a sequence of blocks
+ * instead, each a netfs_block followed by len bytes. A block stands for up to
+ * NETFS_BLOCK_SIZE bytes of the original body, LZ4-compressed if flags has
+ * NETFS_BLOCK_COMPRESSED and as they are otherwise.
+ */
+struct __attribute__((__packed__)) netfs_block {
+    uint32_t raw_len;
+    uint32_t len;
+    uint8_t flags;
+};
+
+#define NETFS_BLOCK_COMPRESSED 1
+#define NETFS_BLOCK_SIZE (64 * 1024)
+
+/* Largest fixed-size argument block any request carries */
+#define NETFS_MAX_PAYLOAD 64
+
+/* Fixed-size arguments that follow the path of MSG_READDIR(PLUS) requests */
+struct __attribute__((__packed__)) netfs_readdir_args {
+    uint64_t cookie;    /* Where to resume listing; 0 starts from the top */
+};
+
+/*
+ * Directory listings are paged. Each MSG_READDIR(PLUS) reply is a single frame
+ * holding at most DIR_FRAME_SIZE bytes of entries. Every entry is the
+ * directory position just past it (a cookie the next request can resume
+ * from), a uint16_t name length including the terminating NUL, the name, and
+ * for MSG_READDIRPLUS a struct attr_stat. A MSG_READDIRPLUS of a directory
+ * named by node, on a connection that agreed NETFS_FEATURE_NODES, also has the
+ * node ID of each entry after its attributes, each one a reference as if it
+ * had been looked up. "." and "..", and entries that couldn't be stat'ed, get
+ * node 0 and no reference.
+ */
+struct __attribute__((__packed__)) netfs_dir_frame {
+    uint32_t len;       /* Bytes of entries following this header */
+    uint32_t count;     /* Number of entries */
+    uint8_t eof;        /* Set when the listing has no entries past these */
+};
+
+#define DIR_FRAME_SIZE (64 * 1024)
+
+int resolve_host(char *hostname, int port, struct sockaddr_in *addr);
+int connect_addr(struct sockaddr_in *addr);
 int connect_to(char *hostname, int port);
+int write_request(int fd, uint16_t type, uint64_t request_id, uint64_t node,
+        const char *path, const void *payload, size_t payload_len);
+int write_request_body(int fd, uint16_t type, uint64_t request_id, uint64_t node,
+        const char *path, const void *payload, size_t payload_len,
+        const void *body, size_t body_len);
+size_t request_payload_len(uint16_t type);
+size_t request_body_len(uint16_t type, const void *payload);
 ssize_t read_len(int fd, void *buf, size_t length);
 ssize_t write_len(int fd, void *buf, size_t length);
 
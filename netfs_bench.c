@@ -0,0 +1,723 @@
+/**
+ * netfs_bench.c
+ *
+ * Load generator for netfs_server. Talks the wire protocol directly, with
+ * the same pooled, pipelined connections the client uses, so it needs no
+ * FUSE mount. A number of threads each issue a weighted random mix of
+ * GETATTR, READDIR, OPEN and READ requests against a generated tree of
+ * directories and files for a set time. How many files a directory holds
+ * and how large each file is are drawn from weighted distributions. Throughput and latency percentiles,
+ * overall and per operation, are printed as JSON on stdout.
+ *
+ * With -q it instead prints the server's own metrics (MSG_STATS) and exits.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "conn_pool.h"
+#include "histogram.h"
+#include "logging.h"
+#include "net.h"
+
+#define BENCH_ROOT "/netfs_bench"
+#define MAX_SIZE_CLASSES 16
+
+#define DEFAULT_THREADS 16
+#define DEFAULT_SECONDS 5
+#define DEFAULT_DIRS 16
+#define DEFAULT_DIR_SIZES "8=50,64=35,512=15"
+#define DEFAULT_READ_SIZE (128 * 1024)
+#define DEFAULT_MIX "getattr=50,readdir=5,open=20,read=25"
+#define DEFAULT_SIZES "4k=60,64k=30,1m=10"
+
+/* Room for the server's metrics text */
+#define STATS_REPLY_MAX (256 * 1024)
+
+enum bench_op {
+    OP_GETATTR,
+    OP_READDIR,
+    OP_OPEN,
+    OP_READ,
+    NUM_OPS
+};
+
+static const char *op_names[NUM_OPS] = { "getattr", "readdir", "open", "read" };
+
+/* Command line options */
+static struct {
+    char *server;
+    int port;
+    int threads;
+    int seconds;
+    int dirs;
+    int num_files;
+    int *dir_first;             /* Number of each directory's first file, and
+                                 * num_files after the last */
+    size_t read_size;
+    char *populate;             /* Export directory to create the tree in */
+    bool query_stats;
+    unsigned weights[NUM_OPS];
+    unsigned weight_total;
+    size_t sizes[MAX_SIZE_CLASSES];
+    unsigned size_weights[MAX_SIZE_CLASSES];
+    unsigned size_weight_total;
+    int num_sizes;
+    size_t dir_sizes[MAX_SIZE_CLASSES];
+    unsigned dir_size_weights[MAX_SIZE_CLASSES];
+    unsigned dir_size_weight_total;
+    int num_dir_sizes;
+} options;
+
+/* What each thread measured */
+struct bench_thread {
+    pthread_t thread;
+    uint64_t seed;
+    uint64_t *handles;          /* Per file, opened on first READ */
+    uint64_t errors[NUM_OPS];
+    struct histogram latency[NUM_OPS];  /* Nanoseconds */
+};
+
+static struct conn_pool pool;
+static volatile bool stopping;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, so threads don't share rand()'s state */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+static unsigned pick_weighted(uint64_t *seed, const unsigned *weights, int count,
+        unsigned total)
+{
+    unsigned roll = next_random(seed) % total;
+    for(int i = 0; i < count; i++)
+    {
+        if(roll < weights[i])
+            return i;
+        roll -= weights[i];
+    }
+    return count - 1;
+}
+
+static void dir_path(int dir, char *out)
+{
+    snprintf(out, MAXIMUM_PATH, BENCH_ROOT "/d%04d", dir);
+}
+
+/* The directory file is in */
+static int file_dir(int file)
+{
+    int low = 0;
+    int high = options.dirs - 1;
+    while(low < high)
+    {
+        int mid = (low + high + 1) / 2;
+        if(options.dir_first[mid] <= file)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+static void file_path(int file, char *out)
+{
+    int dir = file_dir(file);
+    snprintf(out, MAXIMUM_PATH, BENCH_ROOT "/d%04d/f%05d", dir,
+            file - options.dir_first[dir]);
+}
+
+/*
+ * Numbers the files of the tree directory by directory. How many each
+ * directory holds follows from its number, like the size of each file, so
+ * the tree is the same every time it is generated with the same options.
+ */
+static int number_files(void)
+{
+    options.dir_first = malloc((options.dirs + 1) * sizeof(int));
+    if(options.dir_first == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    size_t num_files = 0;
+    for(int dir = 0; dir < options.dirs; dir++)
+    {
+        options.dir_first[dir] = num_files;
+        uint64_t seed = 0x6a09e667f3bcc909ULL * (dir + 1);
+        num_files += options.dir_sizes[pick_weighted(&seed, options.dir_size_weights,
+                options.num_dir_sizes, options.dir_size_weight_total)];
+        if(num_files > 100000000)
+        {
+            fprintf(stderr, "Too many files\n");
+            return -1;
+        }
+    }
+    options.dir_first[options.dirs] = num_files;
+    options.num_files = num_files;
+    return num_files > 0 ? 0 : -1;
+}
+
+/*
+ * The size of every file follows from its number, so the tree is the same
+ * every time it is generated with the same options
+ */
+static size_t file_size(int file)
+{
+    uint64_t seed = 0x9e3779b97f4a7c15ULL * (file + 1);
+    return options.sizes[pick_weighted(&seed, options.size_weights,
+            options.num_sizes, options.size_weight_total)];
+}
+
+/*
+ * Writes the benchmark tree into the server's export directory
+ */
+static int populate(const char *export_dir)
+{
+    char path[MAXIMUM_PATH * 2];
+    snprintf(path, sizeof(path), "%s" BENCH_ROOT, export_dir);
+    if(mkdir(path, 0755) == -1 && errno != EEXIST)
+    {
+        perror("mkdir");
+        return -1;
+    }
+
+    // Text-like contents, so compression has something to do
+    char *data = malloc(1024 * 1024);
+    if(data == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    for(size_t i = 0; i < 1024 * 1024; i++)
+        data[i] = "netfs benchmark data\n"[i % 21];
+
+    // Directories first; some may hold no files
+    char rel[MAXIMUM_PATH];
+    for(int dir = 0; dir < options.dirs; dir++)
+    {
+        dir_path(dir, rel);
+        snprintf(path, sizeof(path), "%s%s", export_dir, rel);
+        if(mkdir(path, 0755) == -1 && errno != EEXIST)
+        {
+            perror("mkdir");
+            free(data);
+            return -1;
+        }
+    }
+
+    for(int file = 0; file < options.num_files; file++)
+    {
+        file_path(file, rel);
+        snprintf(path, sizeof(path), "%s%s", export_dir, rel);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1)
+        {
+            perror("open");
+            free(data);
+            return -1;
+        }
+        size_t left = file_size(file);
+        while(left > 0)
+        {
+            size_t chunk = left < 1024 * 1024 ? left : 1024 * 1024;
+            if(write_len(fd, data, chunk) <= 0)
+            {
+                close(fd);
+                free(data);
+                return -1;
+            }
+            left -= chunk;
+        }
+        close(fd);
+    }
+
+    free(data);
+    LOG_INFO("Created %d files in %d directories\n", options.num_files, options.dirs);
+    return 0;
+}
+
+static int do_getattr(struct bench_thread *bt, int file)
+{
+    char path[MAXIMUM_PATH];
+    file_path(file, path);
+    struct attr_stat attr;
+    return conn_call(&pool, MSG_GETATTR, 0, path, NULL, 0, &attr, sizeof(attr), NULL);
+}
+
+/*
+ * Lists a whole directory, a page at a time
+ */
+static int do_readdir(struct bench_thread *bt, int dir, char *buf, size_t cap)
+{
+    char path[MAXIMUM_PATH];
+    dir_path(dir, path);
+
+    struct netfs_readdir_args args = { 0 };
+    while(true)
+    {
+        size_t len = 0;
+        int res = conn_call(&pool, MSG_READDIR, 0, path, &args, sizeof(args),
+                buf, cap, &len);
+        if(res != 0)
+            return res;
+
+        struct netfs_dir_frame frame;
+        if(len < sizeof(struct netfs_dir_frame))
+            return -EIO;
+        memcpy(&frame, buf, sizeof(struct netfs_dir_frame));
+        if(frame.eof || frame.count == 0)
+            return 0;
+
+        // Resume after the last entry: walk to it to find its cookie
+        if(frame.len > len - sizeof(struct netfs_dir_frame))
+            return -EIO;
+        char *entries = buf + sizeof(struct netfs_dir_frame);
+        size_t pos = 0;
+        for(uint32_t i = 0; i < frame.count; i++)
+        {
+            uint16_t name_len;
+            if(pos + sizeof(uint64_t) + sizeof(uint16_t) > frame.len)
+                return -EIO;
+            memcpy(&args.cookie, entries + pos, sizeof(uint64_t));
+            memcpy(&name_len, entries + pos + sizeof(uint64_t), sizeof(uint16_t));
+            pos += sizeof(uint64_t) + sizeof(uint16_t) + name_len;
+        }
+    }
+}
+
+/*
+ * Opens a file the way the client does, taking small files inline, and
+ * closes it again if the server kept a handle
+ */
+static int do_open(struct bench_thread *bt, int file, char *buf, size_t cap)
+{
+    char path[MAXIMUM_PATH];
+    file_path(file, path);
+
+    struct netfs_open_args args = { 0 };
+    args.inline_max = NETFS_INLINE_MAX;
+    size_t len = 0;
+    int res = conn_call(&pool, MSG_OPEN, 0, path, &args, sizeof(args), buf, cap, &len);
+    if(res != 0)
+        return res;
+
+    struct netfs_open_reply reply;
+    if(len < sizeof(reply))
+        return -EIO;
+    memcpy(&reply, buf, sizeof(reply));
+    if(reply.handle != 0)
+    {
+        struct netfs_release_args release = { 0 };
+        release.handle = reply.handle;
+        conn_call(&pool, MSG_RELEASE, 0, path, &release, sizeof(release), NULL, 0, NULL);
+    }
+    return 0;
+}
+
+/*
+ * Reads read_size bytes at a random offset of a file, keeping the file open
+ * for later reads like a mounted client would
+ */
+static int do_read(struct bench_thread *bt, int file, char *buf)
+{
+    char path[MAXIMUM_PATH];
+    file_path(file, path);
+
+    if(bt->handles[file] == 0)
+    {
+        struct netfs_open_args args = { 0 };
+        struct netfs_open_reply reply;
+        size_t len = 0;
+        int res = conn_call(&pool, MSG_OPEN, 0, path, &args, sizeof(args),
+                &reply, sizeof(reply), &len);
+        if(res != 0)
+            return res;
+        if(len < sizeof(reply) || reply.handle == 0)
+            return -EIO;
+        bt->handles[file] = reply.handle;
+    }
+
+    size_t size = file_size(file);
+    struct netfs_read_args args = { 0 };
+    args.handle = bt->handles[file];
+    args.size = options.read_size;
+    args.offset = size > options.read_size
+        ? next_random(&bt->seed) % (size - options.read_size + 1) : 0;
+    return conn_call(&pool, MSG_READ, 0, path, &args, sizeof(args),
+            buf, options.read_size, NULL);
+}
+
+static void *bench_thread(void *arg)
+{
+    struct bench_thread *bt = arg;
+    int num_files = options.num_files;
+
+    size_t cap = DIR_FRAME_SIZE + sizeof(struct netfs_dir_frame);
+    if(cap < sizeof(struct netfs_open_reply) + NETFS_INLINE_MAX)
+        cap = sizeof(struct netfs_open_reply) + NETFS_INLINE_MAX;
+    if(cap < options.read_size)
+        cap = options.read_size;
+    char *buf = malloc(cap);
+    if(buf == NULL)
+    {
+        perror("malloc");
+        return NULL;
+    }
+
+    while(!stopping)
+    {
+        enum bench_op op = pick_weighted(&bt->seed, options.weights, NUM_OPS,
+                options.weight_total);
+        uint64_t start = now_ns();
+        int res = 0;
+        switch(op)
+        {
+            case OP_GETATTR:
+                res = do_getattr(bt, next_random(&bt->seed) % num_files);
+                break;
+            case OP_READDIR:
+                res = do_readdir(bt, next_random(&bt->seed) % options.dirs, buf, cap);
+                break;
+            case OP_OPEN:
+                res = do_open(bt, next_random(&bt->seed) % num_files, buf, cap);
+                break;
+            case OP_READ:
+                res = do_read(bt, next_random(&bt->seed) % num_files, buf);
+                break;
+            default:
+                break;
+        }
+
+        if(res != 0)
+            bt->errors[op]++;
+        else
+            histogram_record(&bt->latency[op], now_ns() - start);
+    }
+
+    for(int file = 0; file < num_files; file++)
+    {
+        if(bt->handles[file] == 0)
+            continue;
+        char path[MAXIMUM_PATH];
+        file_path(file, path);
+        struct netfs_release_args release = { 0 };
+        release.handle = bt->handles[file];
+        conn_call(&pool, MSG_RELEASE, 0, path, &release, sizeof(release), NULL, 0, NULL);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Prints the server's metrics
+ */
+static int query_stats(void)
+{
+    char *text = malloc(STATS_REPLY_MAX);
+    if(text == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    size_t len = 0;
+    int res = conn_call(&pool, MSG_STATS, 0, "/", NULL, 0, text, STATS_REPLY_MAX, &len);
+    if(res != 0)
+        fprintf(stderr, "MSG_STATS failed: %s\n", strerror(-res));
+    else
+        fwrite(text, 1, len, stdout);
+    free(text);
+    return res != 0 ? -1 : 0;
+}
+
+static void print_stats(const char *name, const struct histogram *hist,
+        uint64_t errors, double seconds, bool last)
+{
+    printf("    \"%s\": {\"ops\": %llu, \"errors\": %llu, \"ops_per_sec\": %.1f, "
+            "\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, "
+            "\"p999\": %.1f, \"max\": %.1f}}%s\n",
+            name, (unsigned long long) hist->total, (unsigned long long) errors,
+            hist->total / seconds,
+            hist->total > 0 ? (double) hist->sum / hist->total / 1000.0 : 0.0,
+            histogram_percentile(hist, 50.0) / 1000.0,
+            histogram_percentile(hist, 99.0) / 1000.0,
+            histogram_percentile(hist, 99.9) / 1000.0,
+            hist->max / 1000.0, last ? "" : ",");
+}
+
+/*
+ * Parses "name=weight,..." for the operation mix
+ */
+static int parse_mix(char *spec)
+{
+    memset(options.weights, 0, sizeof(options.weights));
+    options.weight_total = 0;
+
+    for(char *item = strtok(spec, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        char *eq = strchr(item, '=');
+        if(eq == NULL)
+            return -1;
+        *eq = '\0';
+        int op;
+        for(op = 0; op < NUM_OPS && strcmp(op_names[op], item) != 0; op++)
+            ;
+        if(op == NUM_OPS)
+            return -1;
+        options.weights[op] = atoi(eq + 1);
+        options.weight_total += options.weights[op];
+    }
+    return options.weight_total > 0 ? 0 : -1;
+}
+
+/*
+ * Parses "value=weight,..." into a distribution of up to MAX_SIZE_CLASSES
+ * values, for file sizes and directory sizes. Values take a k, m or g
+ * suffix. A lone value without a weight is the only one.
+ */
+static int parse_weighted(char *spec, size_t *values, unsigned *weights,
+        unsigned *weight_total, int *count)
+{
+    *count = 0;
+    *weight_total = 0;
+
+    for(char *item = strtok(spec, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        if(*count == MAX_SIZE_CLASSES)
+            return -1;
+        char *end;
+        size_t value = strtoull(item, &end, 10);
+        if(*end == 'k' || *end == 'K')
+            value *= 1024;
+        else if(*end == 'm' || *end == 'M')
+            value *= 1024 * 1024;
+        else if(*end == 'g' || *end == 'G')
+            value *= 1024 * 1024 * 1024;
+
+        char *eq = strchr(item, '=');
+        values[*count] = value;
+        weights[*count] = eq != NULL ? atoi(eq + 1) : 1;
+        *weight_total += weights[*count];
+        (*count)++;
+    }
+    return *weight_total > 0 ? 0 : -1;
+}
+
+static int parse_sizes(char *spec)
+{
+    return parse_weighted(spec, options.sizes, options.size_weights,
+            &options.size_weight_total, &options.num_sizes);
+}
+
+static int parse_dir_sizes(char *spec)
+{
+    return parse_weighted(spec, options.dir_sizes, options.dir_size_weights,
+            &options.dir_size_weight_total, &options.num_dir_sizes);
+}
+
+static void usage(char *argv[])
+{
+    fprintf(stderr, "usage: %s [options]\n\n", argv[0]);
+    fprintf(stderr, "    -s <host>   Server to benchmark (default: 127.0.0.1)\n"
+                    "    -p <n>      Port (default: %d)\n"
+                    "    -c <n>      Concurrent requests (default: %d)\n"
+                    "    -t <s>      Seconds to run for (default: %d)\n"
+                    "    -m <mix>    Weighted operation mix, from getattr, readdir,\n"
+                    "                open and read (default: %s)\n"
+                    "    -D <n>      Directories in the tree (default: %d)\n"
+                    "    -F <counts> Weighted numbers of files per directory\n"
+                    "                (default: %s)\n"
+                    "    -S <sizes>  Weighted file sizes (default: %s)\n"
+                    "    -r <n>      Bytes per READ (default: %d)\n"
+                    "    -g <dir>    Generate the tree in the server's export\n"
+                    "                directory <dir> first\n"
+                    "    -q          Print the server's metrics instead\n",
+                    DEFAULT_PORT, DEFAULT_THREADS, DEFAULT_SECONDS, DEFAULT_MIX,
+                    DEFAULT_DIRS, DEFAULT_DIR_SIZES, DEFAULT_SIZES,
+                    DEFAULT_READ_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+    char mix[] = DEFAULT_MIX;
+    char sizes[] = DEFAULT_SIZES;
+    char dir_sizes[] = DEFAULT_DIR_SIZES;
+    options.server = "127.0.0.1";
+    options.port = DEFAULT_PORT;
+    options.threads = DEFAULT_THREADS;
+    options.seconds = DEFAULT_SECONDS;
+    options.dirs = DEFAULT_DIRS;
+    options.read_size = DEFAULT_READ_SIZE;
+    parse_mix(mix);
+    parse_sizes(sizes);
+    parse_dir_sizes(dir_sizes);
+
+    int opt;
+    while((opt = getopt(argc, argv, "s:p:c:t:m:D:F:S:r:g:q")) != -1)
+    {
+        switch(opt)
+        {
+            case 's':
+                options.server = optarg;
+                break;
+            case 'p':
+                options.port = atoi(optarg);
+                break;
+            case 'c':
+                options.threads = atoi(optarg);
+                break;
+            case 't':
+                options.seconds = atoi(optarg);
+                break;
+            case 'm':
+                if(parse_mix(optarg) == -1)
+                {
+                    usage(argv);
+                    return 1;
+                }
+                break;
+            case 'D':
+                options.dirs = atoi(optarg);
+                break;
+            case 'F':
+                if(parse_dir_sizes(optarg) == -1)
+                {
+                    usage(argv);
+                    return 1;
+                }
+                break;
+            case 'S':
+                if(parse_sizes(optarg) == -1)
+                {
+                    usage(argv);
+                    return 1;
+                }
+                break;
+            case 'r':
+                options.read_size = atoi(optarg);
+                break;
+            case 'g':
+                options.populate = optarg;
+                break;
+            case 'q':
+                options.query_stats = true;
+                break;
+            default:
+                usage(argv);
+                return 1;
+        }
+    }
+    if(options.threads < 1 || options.seconds < 1 || options.dirs < 1
+            || options.read_size < 1 || options.read_size > NETFS_COMPOUND_MAX_READ
+            || number_files() == -1)
+    {
+        usage(argv);
+        return 1;
+    }
+
+    if(options.populate != NULL && populate(options.populate) == -1)
+        return 1;
+
+    if(conn_pool_init(&pool, options.server, options.port) == -1)
+        return 1;
+
+    if(options.query_stats)
+    {
+        int res = query_stats();
+        conn_pool_destroy(&pool);
+        return res == -1 ? 1 : 0;
+    }
+
+    int num_files = options.num_files;
+    struct bench_thread *threads = calloc(options.threads, sizeof(struct bench_thread));
+    if(threads == NULL)
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    for(int i = 0; i < options.threads; i++)
+    {
+        threads[i].seed = 0x2545f4914f6cdd1dULL * (i + 1);
+        threads[i].handles = calloc(num_files, sizeof(uint64_t));
+        for(int op = 0; op < NUM_OPS; op++)
+            histogram_init(&threads[i].latency[op]);
+        if(threads[i].handles == NULL
+                || pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]) != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    sleep(options.seconds);
+    stopping = true;
+    double seconds = (now_ns() - start) / 1e9;
+
+    struct histogram total;
+    struct histogram per_op[NUM_OPS];
+    uint64_t errors[NUM_OPS] = { 0 };
+    uint64_t total_errors = 0;
+    histogram_init(&total);
+    for(int op = 0; op < NUM_OPS; op++)
+        histogram_init(&per_op[op]);
+
+    for(int i = 0; i < options.threads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        for(int op = 0; op < NUM_OPS; op++)
+        {
+            histogram_merge(&per_op[op], &threads[i].latency[op]);
+            histogram_merge(&total, &threads[i].latency[op]);
+            errors[op] += threads[i].errors[op];
+            total_errors += threads[i].errors[op];
+        }
+        free(threads[i].handles);
+    }
+    free(threads);
+
+    printf("{\n");
+    printf("  \"concurrency\": %d,\n", options.threads);
+    printf("  \"seconds\": %.3f,\n", seconds);
+    printf("  \"directories\": %d,\n", options.dirs);
+    printf("  \"files\": %d,\n", num_files);
+    printf("  \"read_size\": %zu,\n", options.read_size);
+    printf("  \"ops\": {\n");
+    print_stats("all", &total, total_errors, seconds, false);
+    for(int op = 0; op < NUM_OPS; op++)
+        print_stats(op_names[op], &per_op[op], errors[op], seconds, op == NUM_OPS - 1);
+    printf("  }\n");
+    printf("}\n");
+
+    conn_pool_destroy(&pool);
+    return 0;
+}
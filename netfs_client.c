@@ -1,17 +1,21 @@
 /**
  * netfs_client.h
  *
- * Implementation of the netfs client file system. Based on the fuse 'hello'
- * example here: https://github.com/libfuse/libfuse/blob/master/example/hello.c
+ * Implementation of the netfs client file system, on FUSE's low-level API.
+ * The kernel's inode numbers are the node IDs the server hands out, so every
+ * operation names its file to the server by node, and neither end walks a
+ * path to find it. Based on the fuse 'hello_ll' example here:
+ * https://github.com/libfuse/libfuse/blob/master/example/hello_ll.c
  */
 
-#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 34
 
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse3/fuse.h>
+#include <fuse3/fuse_lowlevel.h>
 #include <netdb.h> 
 #include <netinet/in.h>
 #include <stdbool.h>
@@ -19,6 +23,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
 #include <sys/types.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
@@ -26,17 +32,49 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <pwd.h>
+#include <pthread.h>
+#include "attr_cache.h"
+#include "block_cache.h"
+#include "compound.h"
 #include "common.h"
+#include "conn_pool.h"
 #include "logging.h"
 #include "net.h"
+#include "node_cache.h"
 
-#define TEST_DATA "hello world!\n"
+#define DEFAULT_ATTR_TIMEOUT 1.0
+#define DEFAULT_NEGATIVE_TIMEOUT 1.0
+#define DEFAULT_LEASE_TIMEOUT 3600.0
+#define DEFAULT_CACHE_SIZE 64       /* MiB */
+#define DEFAULT_READAHEAD 16        /* Blocks */
+#define DEFAULT_STRIPE_WIDTH 1      /* Connections per read; 1 to not stripe */
+#define MAX_STRIPE_WIDTH 16
+
+/* Only reads of files at least this big are striped, in pieces no smaller
+ * than the chunk size */
+#define STRIPE_MIN_FILE_SIZE (1024 * 1024)
+#define STRIPE_MIN_CHUNK (32 * 1024)
+
+/* Spliced segments take a pipe slot each however short they are, so splice
+ * pipes get this many times the room the data itself needs */
+#define SPLICE_PIPE_FACTOR 4
+
+/* Inode number of entries listed without attributes */
+#define UNKNOWN_INO 0xffffffff
 
 /* Command line options */
 static struct options {
     int show_help;
     int port;
     char *server;
+    double attr_timeout;
+    double negative_timeout;
+    int cache_size;
+    int readahead;
+    int stripe_width;
+    int compress;
+    int leases;
+    double lease_timeout;
 } options;
 
 #define OPTION(t, p) { t, offsetof(struct options, p), 1 }
@@ -48,337 +86,1320 @@ static const struct fuse_opt option_spec[] = {
     OPTION("--help", show_help),
     OPTION("--port=%d", port),
     OPTION("--server=%s", server),
+    OPTION("--attr-timeout=%lf", attr_timeout),
+    OPTION("--negative-timeout=%lf", negative_timeout),
+    OPTION("--cache-size=%d", cache_size),
+    OPTION("--readahead=%d", readahead),
+    OPTION("--stripe-width=%d", stripe_width),
+    OPTION("--compress", compress),
+    OPTION("--leases", leases),
+    OPTION("--lease-timeout=%lf", lease_timeout),
     FUSE_OPT_END
 };
 
+/* Connections to the server, shared by all FUSE worker threads */
+static struct conn_pool pool;
+
+/* Attributes already fetched from the server */
+static struct attr_cache attr_cache;
+
+/* File contents already fetched from the server */
+static struct block_cache block_cache;
+
+/* Nodes the kernel knows about */
+static struct node_cache nodes;
+
+/* Uid of the user running the client, given to files the server user owns */
+static uid_t client_uid;
+
+/* Paths whose leases the server recalled, still to be dropped from the
+ * kernel's caches and the block cache. Both can block on requests the reader
+ * threads have yet to answer, so they are left to a thread of their own. */
+struct recalled_path {
+    char *path;
+    struct recalled_path *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct recalled_path *head;
+    struct recalled_path *tail;
+    struct fuse_session *session;
+} recalls = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
 /*
- * NFS Get Attributes
+ * Copies attributes received from the server into a stat buffer
  */
-static int netfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+static void fill_stat(struct stat *stbuf, const struct attr_stat *atst)
 {
-    LOG("GETATTR: %s\n", path);
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = atst->ino;
+    stbuf->st_uid = atst->uid;
+    stbuf->st_gid = atst->gid;
+    stbuf->st_mode = atst->mode;
+    stbuf->st_nlink = atst->nlink;
+    stbuf->st_size = atst->size;
+    stbuf->st_blocks = atst->blocks;
+    stbuf->st_mtim = atst->mtim;
+}
 
-    struct passwd *pw_client;
-    uid_t uid;
+/*
+ * The server marks files owned by the exporting user with uid 1; those show
+ * up as owned by whoever runs the client.
+ */
+static void attr_from_server(struct attr_stat *atst)
+{
+    // Check if client id mathces file id
+    if(atst->uid == 1)
+        atst->uid = client_uid;
+}
 
-    uid = geteuid();
-    pw_client = getpwuid(uid);
+/*
+ * Builds "<dir>/<name>" into out. Returns -1 if it doesn't fit.
+ */
+static int join_path(const char *dir, const char *name, char *out)
+{
+    const char *sep = strcmp(dir, "/") == 0 ? "" : "/";
+    int len = snprintf(out, MAXIMUM_PATH, "%s%s%s", dir, sep, name);
+    return (len < 0 || len >= MAXIMUM_PATH) ? -1 : 0;
+}
 
-    struct netfs_msg_header req_header = { 0 };
-    req_header.msg_type = MSG_GETATTR;
-    req_header.msg_len =  strlen(path) + 1;
+/*
+ * Whether attributes fetched with MSG_GETATTR come with a lease
+ */
+static bool have_leases(void)
+{
+    return __atomic_load_n(&pool.leases, __ATOMIC_RELAXED);
+}
 
-    int server_fd = connect_to(options.server, options.port);
-    
-    // We should check if server is less than 0 here...
-    if(server_fd < 0)
+/*
+ * Copies the directory part of path into parent ("/a/b" -> "/a", "/a" -> "/")
+ */
+static void parent_path(const char *path, char *parent)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len = slash - path;
+    if(len == 0)
+        len = 1;
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+}
+
+/*
+ * Called by a connection's reader when the server recalls a lease. The
+ * attributes go at once, before the reader hands out any later reply; the
+ * rest is queued. With every lease recalled, directories may have been
+ * renamed, so no node's path is trusted until it is looked up again. There
+ * is nothing to tell the kernel, whose entries run out within the attribute
+ * timeout anyway, and cached blocks are checked against the file's version
+ * when it is opened.
+ */
+static void lease_recalled(const char *path, void *arg)
+{
+    attr_cache_recall(&attr_cache, path);
+    if(path == NULL)
     {
-        perror("Socket failed");
-        return 1;
+        node_cache_paths_moved(&nodes);
+        return;
     }
 
-    LOG("server_fd: %d\n", server_fd);
+    struct recalled_path *recalled = malloc(sizeof(struct recalled_path));
+    if(recalled == NULL || (recalled->path = strdup(path)) == NULL)
+    {
+        perror("malloc");
+        free(recalled);
+        return;
+    }
+    recalled->next = NULL;
 
-    /* Clear the stat buffer */
-    memset(stbuf, 0, sizeof(struct stat));
+    pthread_mutex_lock(&recalls.lock);
+    if(recalls.tail != NULL)
+        recalls.tail->next = recalled;
+    else
+        recalls.head = recalled;
+    recalls.tail = recalled;
+    pthread_cond_signal(&recalls.ready);
+    pthread_mutex_unlock(&recalls.lock);
+}
 
-    /* By default, we will return 0 from this function (success) */
-    int res = 0;
+/*
+ * Drops path from the kernel's caches: the attributes and pages of the node
+ * last found there, and the directory entry, which may now be missing or a
+ * different file
+ */
+static void invalidate_kernel(const char *path)
+{
+    char parent[MAXIMUM_PATH];
+    uint64_t node;
 
-    struct attr_stat atst = { 0 };
+    if(node_cache_find(&nodes, path, &node))
+        fuse_lowlevel_notify_inval_inode(recalls.session, node, 0, 0);
+
+    parent_path(path, parent);
+    if(strcmp(path, "/") != 0 && node_cache_find(&nodes, parent, &node))
+    {
+        const char *name = strrchr(path, '/') + 1;
+        fuse_lowlevel_notify_inval_entry(recalls.session, node, name, strlen(name));
+    }
+}
+
+/*
+ * Drops recalled paths from the block cache and from the kernel's attribute,
+ * entry and page caches
+ */
+static void *recall_thread(void *arg)
+{
+    while(true)
+    {
+        pthread_mutex_lock(&recalls.lock);
+        while(recalls.head == NULL)
+            pthread_cond_wait(&recalls.ready, &recalls.lock);
+        struct recalled_path *recalled = recalls.head;
+        recalls.head = recalled->next;
+        if(recalls.head == NULL)
+            recalls.tail = NULL;
+        pthread_mutex_unlock(&recalls.lock);
+
+        block_cache_invalidate(&block_cache, recalled->path);
+        invalidate_kernel(recalled->path);
+        free(recalled->path);
+        free(recalled);
+    }
+    return NULL;
+}
+
+/*
+ * Asks the server for the attributes of node. Returns 0 or a negative errno.
+ * Many of these can be waiting on the same connection at once.
+ */
+static int fetch_attr(uint64_t node, struct attr_stat *atst)
+{
+    /* The root directory is stat'ed on the server like everything else, so
+     * it carries the permissions of the exported directory. */
+    size_t len = 0;
+    int res = conn_call(&pool, MSG_GETATTR, node, "", NULL, 0,
+            atst, sizeof(struct attr_stat), &len);
+    if(res != 0)
+    {
+        LOG("Stat function couldn't read file: %d\n", res);
+        return res;
+    }
+    if(len != sizeof(struct attr_stat))
+        return -EIO;
+
+    attr_from_server(atst);
+    return 0;
+}
+
+/*
+ * Gets the attributes of node from the cache, or from the server if they
+ * aren't cached. Only nodes with a current path are looked up in the cache
+ * and kept there; the others always come from the server.
+ */
+static int get_attr(uint64_t node, struct attr_stat *atst)
+{
+    char path[MAXIMUM_PATH];
+    bool current;
+    int res = node_cache_path(&nodes, node, path, &current);
+    if(res != 0)
+        return res;
+    if(current && attr_cache_lookup(&attr_cache, path, atst))
+        return 0;
+
+    uint64_t generation = attr_cache_generation(&attr_cache);
+    res = fetch_attr(node, atst);
+    if(res == 0 && current
+            && attr_cache_store(&attr_cache, path, atst, generation, have_leases()))
+        block_cache_invalidate(&block_cache, path);
+    return res;
+}
+
+/*
+ * Gives the references in forgets back to the server, in as few compound
+ * requests as will hold them
+ */
+static void send_forgets(const struct fuse_forget_data *forgets, size_t count)
+{
+    struct compound compound;
+    struct netfs_forget_args args;
+    size_t done = 0;
+
+    while(done < count)
+    {
+        compound_init(&compound);
+        size_t batch = 0;
+        while(done + batch < count)
+        {
+            args.nlookup = forgets[done + batch].nlookup;
+            if(compound_add(&compound, MSG_FORGET, forgets[done + batch].ino, "",
+                        &args, sizeof(args), 0) == -1)
+                break;
+            batch++;
+        }
 
-    // Root Directory
-    if(strcmp(path, "/") == 0) 
-    {
-        LOG("%s\n", "DIRECTORY");
-        /* This is the root directory. We have hard-coded the permissions to 755
-         * here, but you should apply the permissions from the remote directory
-         * instead. The mode means:
-         *   - S_IFDIR: this is a directory
-         *   - 0755: user can read, write, execute. All others can read+execute.
-         * The number of links refers to how many hard links point to the file.
-         * If the link count reaches 0, the file is effectively deleted (this is
-         * why deleting a file is actually 'unlinking' it).
-         */ 
-
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-
-        write_len(server_fd, &req_header, sizeof(struct netfs_msg_header));
-        write_len(server_fd, path, req_header.msg_len);
-    } 
-    else if((path + 1) != NULL)
-    {
-        LOG("%s\n", "FILE");
-        /* Incrementing the path pointer by 1 will remove the '/' from the start
-         * of the path. We're comparing it with a hard-coded file name.
-         *   - S_IFREG: indicates a regular file
-         * We also hard-code the size of this file based on its contents: 'hello
-         * world!' */
-
-        write_len(server_fd, &req_header, sizeof(struct netfs_msg_header));
-        write_len(server_fd, path, req_header.msg_len);
-
-        int stat_success = 0;
-        read_len(server_fd, &stat_success, sizeof(int));
-        if(stat_success == 0)
+        // The server keeps what a failed forget was giving back until the
+        // client disconnects, which does no harm beyond memory
+        int res = batch > 0 ? compound_call(&pool, &compound, 0, "") : -ENOMEM;
+        if(res != 0)
         {
-            LOG("%s\n", "Stat function couldn't read file");
-            return -ENOENT;
+            LOG_WARN("Forget failed: %d\n", res);
+            compound_free(&compound);
+            return;
         }
+        compound_free(&compound);
+        done += batch;
+    }
+}
+
+/*
+ * Drops nlookup of the kernel's lookups of node, and once it has none left,
+ * gives the node's references back to the server
+ */
+static void forget_node(uint64_t node, uint64_t nlookup)
+{
+    struct netfs_forget_args args = { 0 };
+    args.nlookup = node_cache_forget(&nodes, node, nlookup);
+    if(args.nlookup == 0)
+        return;
+
+    int res = conn_call(&pool, MSG_FORGET, node, "", &args, sizeof(args), NULL, 0, NULL);
+    if(res != 0)
+        LOG_WARN("Forget failed: %d\n", res);
+}
+
+static void fill_entry(struct fuse_entry_param *e, uint64_t node,
+        const struct attr_stat *atst)
+{
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = node;
+    e->attr_timeout = options.attr_timeout;
+    e->entry_timeout = options.attr_timeout;
+    fill_stat(&e->attr, atst);
+}
 
-        read_len(server_fd, &atst, sizeof(struct attr_stat));
+/*
+ * Hands the kernel an entry, which it counts as a lookup. If it never gets
+ * it, the lookup is taken back.
+ */
+static void reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
+{
+    if(fuse_reply_entry(req, e) == -ENOENT)
+        forget_node(e->ino, 1);
+}
 
-        // Check if client id mathces file id
-        if(atst.uid == 1)
-            atst.uid = pw_client->pw_uid;
+/*
+ * Tells the kernel the name it looked up is missing, which it remembers for
+ * the negative timeout
+ */
+static void reply_missing(fuse_req_t req)
+{
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(struct fuse_entry_param));
+    e.entry_timeout = options.negative_timeout;
+    fuse_reply_entry(req, &e);
+}
 
-        // Add appropriate attributes
-        stbuf->st_ino = atst.ino;
-        stbuf->st_uid = atst.uid;
-        stbuf->st_gid = atst.gid;
-        stbuf->st_mode = atst.mode;
-        stbuf->st_nlink = atst.nlink;
-        stbuf->st_size = atst.size;
-        stbuf->st_blocks = atst.blocks;
-        stbuf->st_mtim = atst.mtim;
+/*
+ * NFS Lookup. A name whose node and attributes are both cached is answered
+ * without asking the server, and so is a name known to be missing from a
+ * directory whose mtime hasn't moved since. Everything else is looked up on
+ * the server, which takes a reference to the node that is held until the
+ * kernel forgets it.
+ */
+static void netfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    LOG("LOOKUP: %llu, %s\n", (unsigned long long) parent, name);
+
+    char dir_path[MAXIMUM_PATH];
+    char path[MAXIMUM_PATH];
+    bool dir_current;
+    uint64_t path_generation = node_cache_generation(&nodes);
+    int res = node_cache_path(&nodes, parent, dir_path, &dir_current);
+    if(res == 0 && join_path(dir_path, name, path) == -1)
+        res = -ENAMETOOLONG;
+    if(res != 0)
+    {
+        fuse_reply_err(req, -res);
+        return;
     }
-    else
+
+    struct fuse_entry_param e;
+    struct attr_stat atst;
+    struct attr_stat parent_atst;
+    struct timespec parent_mtim;
+    uint64_t node;
+
+    if(dir_current && attr_cache_lookup(&attr_cache, path, &atst)
+            && node_cache_ref_path(&nodes, path, &node))
     {
-        /* -ENOENT = 'no such file or directory'  */
-        res = -ENOENT;
+        fill_entry(&e, node, &atst);
+        reply_entry(req, &e);
+        return;
     }
 
-    close(server_fd);
-    
-    return res;
+    if(dir_current && attr_cache_lookup_negative(&attr_cache, path, &parent_mtim))
+    {
+        if(get_attr(parent, &parent_atst) == 0
+                && parent_atst.mtim.tv_sec == parent_mtim.tv_sec
+                && parent_atst.mtim.tv_nsec == parent_mtim.tv_nsec)
+        {
+            LOG("Negative cache hit: %s\n", path);
+            reply_missing(req);
+            return;
+        }
+        attr_cache_invalidate(&attr_cache, path);
+    }
+
+    struct netfs_lookup_reply lookup_reply;
+    size_t len = 0;
+    uint64_t generation = attr_cache_generation(&attr_cache);
+    res = conn_call(&pool, MSG_LOOKUP, parent, name, NULL, 0,
+            &lookup_reply, sizeof(struct netfs_lookup_reply), &len);
+    if(res == 0 && len != sizeof(struct netfs_lookup_reply))
+        res = -EIO;
+    if(res == -ENOENT)
+    {
+        if(dir_current && get_attr(parent, &parent_atst) == 0
+                && S_ISDIR(parent_atst.mode))
+            attr_cache_store_negative(&attr_cache, path, &parent_atst.mtim);
+        reply_missing(req);
+        return;
+    }
+    if(res != 0)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    node = lookup_reply.node;
+    memcpy(&atst, &lookup_reply.attr, sizeof(struct attr_stat));
+    attr_from_server(&atst);
+    if(dir_current
+            && attr_cache_store(&attr_cache, path, &atst, generation, have_leases()))
+        block_cache_invalidate(&block_cache, path);
+
+    if(node_cache_add(&nodes, node, path, dir_current, path_generation) != 0)
+    {
+        struct fuse_forget_data forget = { node, 1 };
+        send_forgets(&forget, 1);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fill_entry(&e, node, &atst);
+    reply_entry(req, &e);
+}
+
+static void netfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    LOG("FORGET: %llu\n", (unsigned long long) ino);
+    forget_node(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+/*
+ * Forgets many nodes at once, as the kernel does when it shrinks its caches.
+ * Their references go back to the server in compounds rather than a request
+ * each.
+ */
+static void netfs_forget_multi(fuse_req_t req, size_t count,
+        struct fuse_forget_data *forgets)
+{
+    LOG("FORGET_MULTI: %zu\n", count);
 
+    size_t dropped = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        uint64_t refs = node_cache_forget(&nodes, forgets[i].ino, forgets[i].nlookup);
+        if(refs == 0)
+            continue;
+        forgets[dropped].ino = forgets[i].ino;
+        forgets[dropped].nlookup = refs;
+        dropped++;
+    }
+    send_forgets(forgets, dropped);
+    fuse_reply_none(req);
 }
 
 /*
- * Read contents of directory given by server
- */ 
-static int netfs_readdir(
-        const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-        struct fuse_file_info *fi, enum fuse_readdir_flags flags) 
+ * NFS Get Attributes
+ */
+static void netfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+    LOG("GETATTR: %llu\n", (unsigned long long) ino);
 
-    LOG("READDIR: %s\n", path);
+    struct attr_stat atst = { 0 };
+
+    int res = get_attr(ino, &atst);
+    if(res != 0)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
 
-    /* By default, we will return 0 from this function (success) */
-    int res = 0;
+    // Add appropriate attributes
+    struct stat stbuf;
+    fill_stat(&stbuf, &atst);
+    fuse_reply_attr(req, &stbuf, options.attr_timeout);
+}
 
-    struct netfs_msg_header req_header = { 0 };
-    req_header.msg_type = MSG_READDIR;
-    req_header.msg_len =  strlen(path) + 1;
+/* Per-open state of a directory, kept in fuse_file_info's fh: the page of the
+ * listing the kernel is reading through */
+struct open_dir {
+    char *page;                 /* Frame header, then entries */
+    bool fetched;               /* page holds a page */
+    bool plus;                  /* Entries have attributes and nodes */
+    bool eof;                   /* Nothing in the listing after this page */
+    size_t len;                 /* Bytes of entries */
+    size_t pos;                 /* Where the next entry to hand out starts */
+    uint32_t left;              /* Entries not handed out yet */
+    off_t offset;               /* Cookie of the last entry handed out */
+    char path[MAXIMUM_PATH];    /* The directory's path when page was fetched, */
+    bool path_current;          /* whether it was current, and the attribute */
+    uint64_t generation;        /* and node caches' generations from before */
+    uint64_t path_generation;
+};
 
-    LOG("msg_readdir: %d\n", MSG_READDIR);
-    LOG("path: %s\n", path);
+/* One entry of a listing page */
+struct dir_entry {
+    uint64_t cookie;
+    const char *name;
+    struct attr_stat atst;      /* With MSG_READDIRPLUS */
+    uint64_t node;              /* With MSG_READDIRPLUS; 0 for none */
+    size_t len;                 /* Bytes it takes up in the page */
+};
 
-    int server_fd = connect_to(options.server, options.port);
-    
-    // We should check if server is less than 0 here...
-    if(server_fd < 0)
+/*
+ * Reads the next entry of dir's page without handing it out. Returns -1 if
+ * there are no more, or the page is cut short.
+ */
+static int peek_entry(struct open_dir *dir, struct dir_entry *entry)
+{
+    char *entries = dir->page + sizeof(struct netfs_dir_frame);
+    size_t pos = dir->pos;
+    size_t extra = dir->plus ? sizeof(struct attr_stat) + sizeof(uint64_t) : 0;
+    uint16_t name_len;
+
+    if(dir->left == 0 || pos + sizeof(uint64_t) + sizeof(uint16_t) > dir->len)
+        return -1;
+    memcpy(&entry->cookie, entries + pos, sizeof(uint64_t));
+    pos += sizeof(uint64_t);
+    memcpy(&name_len, entries + pos, sizeof(uint16_t));
+    pos += sizeof(uint16_t);
+
+    if(name_len == 0 || pos + name_len + extra > dir->len)
+        return -1;
+    entries[pos + name_len - 1] = '\0';
+    entry->name = entries + pos;
+    pos += name_len;
+
+    entry->node = 0;
+    if(dir->plus)
     {
-        perror("Socket failed");
-        return 1;
+        memcpy(&entry->atst, entries + pos, sizeof(struct attr_stat));
+        pos += sizeof(struct attr_stat);
+        memcpy(&entry->node, entries + pos, sizeof(uint64_t));
+        pos += sizeof(uint64_t);
     }
+    entry->len = pos - dir->pos;
+    return 0;
+}
 
-    LOG("server_fd: %d\n", server_fd);
+/*
+ * Throws away what is left of dir's page. Every node in a MSG_READDIRPLUS
+ * page came with a reference on the server, which the entries the kernel
+ * never got give back.
+ */
+static void drop_page(struct open_dir *dir)
+{
+    struct dir_entry entry;
 
-    write_len(server_fd, &req_header, sizeof(struct netfs_msg_header));
-    write_len(server_fd, path, req_header.msg_len);
+    if(dir->plus && dir->left > 0)
+    {
+        struct fuse_forget_data *forgets =
+            malloc(dir->left * sizeof(struct fuse_forget_data));
+        size_t count = 0;
+        while(forgets != NULL && peek_entry(dir, &entry) == 0)
+        {
+            if(entry.node != 0)
+            {
+                forgets[count].ino = entry.node;
+                forgets[count].nlookup = 1;
+                count++;
+            }
+            dir->pos += entry.len;
+            dir->left--;
+        }
+        if(forgets == NULL)
+            perror("malloc");
+        send_forgets(forgets, count);
+        free(forgets);
+    }
+
+    dir->fetched = false;
+    dir->len = 0;
+    dir->pos = 0;
+    dir->left = 0;
+}
 
-    uint16_t reply_len = 1;
-    char reply_path[MAXIMUM_PATH] = { 0 };
+/*
+ * Fetches the page of the listing of directory ino that follows dir->offset
+ */
+static int fetch_page(fuse_ino_t ino, struct open_dir *dir, bool plus)
+{
+    struct netfs_readdir_args args = { 0 };
+    args.cookie = dir->offset;
+
+    dir->path_generation = node_cache_generation(&nodes);
+    int res = node_cache_path(&nodes, ino, dir->path, &dir->path_current);
+    if(res != 0)
+        return res;
+
+    size_t reply_len = 0;
+    dir->generation = attr_cache_generation(&attr_cache);
+    res = conn_call(&pool, plus ? MSG_READDIRPLUS : MSG_READDIR, ino, "",
+            &args, sizeof(args), dir->page,
+            sizeof(struct netfs_dir_frame) + DIR_FRAME_SIZE, &reply_len);
+    if(res == 0 && reply_len < sizeof(struct netfs_dir_frame))
+        res = -EIO;
+    if(res != 0)
+        return res;
+
+    struct netfs_dir_frame frame;
+    memcpy(&frame, dir->page, sizeof(struct netfs_dir_frame));
+    dir->len = reply_len - sizeof(struct netfs_dir_frame);
+    if(frame.len < dir->len)
+        dir->len = frame.len;
+    dir->fetched = true;
+    dir->plus = plus;
+    dir->eof = frame.eof;
+    dir->pos = 0;
+    dir->left = frame.count;
+    return 0;
+}
 
-    // Keep taking in files that server sends
-    while(reply_len > 0)
+/*
+ * Read contents of directory given by server. Listings are fetched a page at
+ * a time starting from the kernel's offset, and every entry is passed to the
+ * kernel with the server's cookie for it as its offset. Once the kernel's
+ * buffer is full we stop, and keep the rest of the page for when the kernel
+ * calls back with the offset of the last entry it took. When the kernel asks
+ * for READDIRPLUS, the server sends every entry's attributes and node along
+ * with its name; they are handed to the kernel, which counts each as a
+ * lookup, and the attributes are kept in the attribute cache, so listing a
+ * directory with `ls -l` costs a round-trip per page instead of one per file.
+ */
+static void list_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi, bool plus)
+{
+    LOG("READDIR: %llu\n", (unsigned long long) ino);
+
+    struct open_dir *dir = (struct open_dir *) (uintptr_t) fi->fh;
+
+    // What is left of the page follows on from where the kernel is only if
+    // it hasn't seek'ed, or switched between plain and plus listings
+    if(dir->fetched && (dir->offset != offset || dir->plus != plus))
+        drop_page(dir);
+    if(!dir->fetched)
+        dir->offset = offset;
+
+    char *buf = malloc(size > 0 ? size : 1);
+    if(buf == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    char entry_path[MAXIMUM_PATH];
+    struct dir_entry entry;
+    struct fuse_entry_param e;
+    struct stat stbuf;
+    size_t used = 0;
+
+    // Keep taking in pages until the listing ends or the kernel has enough
+    while(true)
     {
-        read_len(server_fd, &reply_len, sizeof(uint16_t));
-        read_len(server_fd, reply_path, reply_len);
+        if(!dir->fetched || (dir->left == 0 && !dir->eof))
+        {
+            drop_page(dir);
+            int res = fetch_page(ino, dir, plus);
+            if(res != 0 && used == 0)
+            {
+                free(buf);
+                fuse_reply_err(req, -res);
+                return;
+            }
+            if(res != 0)
+                break;
+        }
+        if(peek_entry(dir, &entry) == -1)
+            break;
 
-        // Break to end loop and no duplicate file/folder appears
-        if(reply_len == 0)
+        size_t entry_size = plus
+            ? fuse_add_direntry_plus(req, NULL, 0, entry.name, NULL, 0)
+            : fuse_add_direntry(req, NULL, 0, entry.name, NULL, 0);
+        if(entry_size > size - used)
             break;
+        dir->pos += entry.len;
+        dir->left--;
+        dir->offset = entry.cookie;
 
-        printf("-> %s\n", reply_path);
-        printf("reply_len: %d\n", reply_len);
+        if(!plus)
+        {
+            // Plain listings only have names, so the kernel gets the same
+            // unknown inode number the high-level API gives out
+            memset(&stbuf, 0, sizeof(struct stat));
+            stbuf.st_ino = UNKNOWN_INO;
+            used += fuse_add_direntry(req, buf + used, size - used, entry.name,
+                    &stbuf, entry.cookie);
+            continue;
+        }
 
-        filler(buf, reply_path, NULL, 0, 0); 
+        // Entries the server couldn't stat have no mode and no node, and
+        // neither have "." and ".."; the kernel only lists those
+        attr_from_server(&entry.atst);
+        bool path_ok = join_path(dir->path, entry.name, entry_path) == 0;
+        if(entry.node != 0 && entry.atst.mode != 0)
+        {
+            if(path_ok && dir->path_current
+                    && attr_cache_store(&attr_cache, entry_path, &entry.atst,
+                        dir->generation, false))
+                block_cache_invalidate(&block_cache, entry_path);
+            if(!path_ok || node_cache_add(&nodes, entry.node, entry_path,
+                        dir->path_current, dir->path_generation) != 0)
+            {
+                struct fuse_forget_data forget = { entry.node, 1 };
+                send_forgets(&forget, 1);
+                entry.node = 0;
+            }
+        }
+        else if(entry.node != 0)
+        {
+            struct fuse_forget_data forget = { entry.node, 1 };
+            send_forgets(&forget, 1);
+            entry.node = 0;
+        }
+
+        fill_entry(&e, entry.node, &entry.atst);
+        used += fuse_add_direntry_plus(req, buf + used, size - used, entry.name, &e,
+                entry.cookie);
     }
 
-    close(server_fd);
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
 
-    return res;
+static void netfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    list_dir(req, ino, size, offset, fi, false);
+}
+
+static void netfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    list_dir(req, ino, size, offset, fi, true);
+}
+
+static void free_open_dir(struct open_dir *dir)
+{
+    drop_page(dir);
+    free(dir->page);
+    free(dir);
+}
+
+static void netfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    LOG("OPENDIR: %llu\n", (unsigned long long) ino);
+
+    struct open_dir *dir = calloc(1, sizeof(struct open_dir));
+    if(dir == NULL
+            || (dir->page = malloc(sizeof(struct netfs_dir_frame) + DIR_FRAME_SIZE)) == NULL)
+    {
+        free(dir);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    fi->fh = (uintptr_t) dir;
+    if(fuse_reply_open(req, fi) == -ENOENT)
+        free_open_dir(dir);
+}
+
+static void netfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    free_open_dir((struct open_dir *) (uintptr_t) fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void free_open_file(struct open_file *file)
+{
+    free(file->inline_data);
+    free(file->path);
+    free(file);
+}
+
+/*
+ * Lets the server close a file opened by netfs_open, once no readahead is
+ * using it any more
+ */
+static int close_file(fuse_ino_t ino, struct open_file *file)
+{
+    block_cache_close(&block_cache, file);
+
+    // Inlined files were closed on the server right after they were sent
+    bool inlined = file->inline_data != NULL;
+    struct netfs_release_args args = { 0 };
+    args.handle = file->handle;
+    free_open_file(file);
+    if(inlined)
+        return 0;
+
+    return conn_call(&pool, MSG_RELEASE, ino, "", &args, sizeof(args), NULL, 0, NULL);
 }
 
 /*
- * Takes in integer from open to check if file opened correctly. If so then,
- * save file descriptor in to fuse_file_info file handler (fh) for read
+ * Asks the server to open the file. The server keeps it open and gives back
+ * a handle, which is saved along with the file's current mtime and size in
+ * an open_file kept in fuse_file_info file handler (fh) for read. Cached
+ * blocks of the file are only used while that mtime and size still match.
+ *
+ * Fresh attributes and the handle are fetched in one compound request. Small
+ * files come back whole with the handle; they are kept in the open_file and
+ * read from there, and the server has nothing left open for them.
  */
-static int netfs_open(const char *path, struct fuse_file_info *fi) 
+static void netfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
 
-    LOG("OPEN: %s\n", path);
+    LOG("OPEN: %llu\n", (unsigned long long) ino);
 
     /* We only support opening the file in read-only mode */
-    if((fi->flags & O_ACCMODE) != O_RDONLY) 
+    if((fi->flags & O_ACCMODE) != O_RDONLY)
     {
-        return -EACCES;
+        fuse_reply_err(req, EACCES);
+        return;
     }
 
-    /* By default, we will return 0 from this function (success) */
-    int res = 0;
+    // Cached blocks are kept under the file's path, current or not; they
+    // are only used while they match the mtime and size fetched here
+    char path[MAXIMUM_PATH];
+    bool current;
+    int res = node_cache_path(&nodes, ino, path, &current);
+    if(res != 0)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
 
-    struct netfs_msg_header req_header = { 0 };
-    req_header.msg_type = MSG_OPEN;
-    req_header.msg_len =  strlen(path) + 1;
+    struct netfs_open_args open_args = { 0 };
+    open_args.inline_max = NETFS_INLINE_MAX;
 
-    int server_fd = connect_to(options.server, options.port);
-    
-    // We should check if server is less than 0 here...
-    if(server_fd < 0)
+    struct compound compound;
+    compound_init(&compound);
+    if(compound_add(&compound, MSG_GETATTR, 0, NULL, NULL, 0, sizeof(struct attr_stat)) == -1
+            || compound_add(&compound, MSG_OPEN, 0, NULL, &open_args, sizeof(open_args),
+                sizeof(struct netfs_open_reply) + NETFS_INLINE_MAX) == -1)
     {
-        perror("Socket failed");
-        return 1;
+        compound_free(&compound);
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
 
-    LOG("server_fd: %d\n", server_fd);
+    uint64_t generation = attr_cache_generation(&attr_cache);
+    res = compound_call(&pool, &compound, ino, "");
+    if(res != 0)
+    {
+        compound_free(&compound);
+        fuse_reply_err(req, -res);
+        return;
+    }
 
-    write_len(server_fd, &req_header, sizeof(struct netfs_msg_header));
-    write_len(server_fd, path, req_header.msg_len);
+    struct compound_result getattr_result, open_result;
+    if(compound_next_result(&compound, &getattr_result) == -1
+            || compound_next_result(&compound, &open_result) == -1)
+    {
+        compound_free(&compound);
+        fuse_reply_err(req, EIO);
+        return;
+    }
 
-    uint16_t success;
+    // Find out whether open was successful, and get the handle if it was
+    res = getattr_result.status != 0 ? getattr_result.status : open_result.status;
+    if(res == 0 && (getattr_result.len != sizeof(struct attr_stat)
+                || open_result.len < sizeof(struct netfs_open_reply)))
+        res = -EIO;
+    if(res != 0)
+    {
+        LOG("%s\n", "Open Failure");
+        compound_free(&compound);
+        fuse_reply_err(req, -res);
+        return;
+    }
 
-    // Read in value whether open was successful or not
-    read_len(server_fd, &success, sizeof(uint16_t));
+    struct attr_stat atst;
+    struct netfs_open_reply open_reply;
+    memcpy(&atst, getattr_result.data, sizeof(struct attr_stat));
+    memcpy(&open_reply, open_result.data, sizeof(struct netfs_open_reply));
+    attr_from_server(&atst);
+    if(current && attr_cache_store(&attr_cache, path, &atst, generation, have_leases()))
+        block_cache_invalidate(&block_cache, path);
 
-    if(success == -1)
+    struct open_file *file = calloc(1, sizeof(struct open_file));
+    if(file != NULL && (file->path = strdup(path)) != NULL && open_reply.inlined)
     {
-        res = 1;
-        LOG("%s\n", "Open Failure");
+        file->inline_len = open_result.len - sizeof(struct netfs_open_reply);
+        file->inline_data = malloc(file->inline_len > 0 ? file->inline_len : 1);
+        if(file->inline_data != NULL)
+            memcpy(file->inline_data,
+                    open_result.data + sizeof(struct netfs_open_reply),
+                    file->inline_len);
     }
-    else
+    compound_free(&compound);
+
+    if(file == NULL || file->path == NULL
+            || (open_reply.inlined && file->inline_data == NULL))
     {
-        LOG("%s\n", "Open Successful");
+        if(!open_reply.inlined)
+        {
+            struct netfs_release_args release_args = { 0 };
+            release_args.handle = open_reply.handle;
+            conn_call(&pool, MSG_RELEASE, ino, "", &release_args, sizeof(release_args),
+                    NULL, 0, NULL);
+        }
+        if(file != NULL)
+            free_open_file(file);
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
+    file->mtim = atst.mtim;
+    file->size = atst.size;
+    file->handle = open_reply.handle;
+
+    LOG("Open Successful%s\n", open_reply.inlined ? ", inlined" : "");
+    fi->fh = (uintptr_t) file;
+    if(fuse_reply_open(req, fi) == -ENOENT)
+        close_file(ino, file);
+}
 
-    close(server_fd);
-    
-    return res;
+static void netfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    LOG("RELEASE: %llu\n", (unsigned long long) ino);
+
+    struct open_file *file = (struct open_file *) (uintptr_t) fi->fh;
+    fuse_reply_err(req, -close_file(ino, file));
+}
+
+/*
+ * Reads a range of a large file as several smaller reads sent over different
+ * connections at once, each landing in its own part of buf, so the transfer
+ * isn't limited to what one stream and one server worker can do.
+ */
+static ssize_t fetch_striped(
+        const struct open_file *file, off_t offset, size_t size, char *buf)
+{
+    // Pieces are page-aligned so the server's reads stay aligned too
+    size_t chunk = (size + options.stripe_width - 1) / options.stripe_width;
+    chunk = (chunk + 4095) & ~(size_t) 4095;
+    if(chunk < STRIPE_MIN_CHUNK)
+        chunk = STRIPE_MIN_CHUNK;
+    int count = (size + chunk - 1) / chunk;
+
+    struct netfs_read_args args[MAX_STRIPE_WIDTH];
+    struct conn_request requests[MAX_STRIPE_WIDTH];
+    memset(requests, 0, sizeof(requests));
+    for(int i = 0; i < count; i++)
+    {
+        size_t start = i * chunk;
+        memset(&args[i], 0, sizeof(struct netfs_read_args));
+        args[i].handle = file->handle;
+        args[i].offset = offset + start;
+        args[i].size = size - start < chunk ? size - start : chunk;
+
+        requests[i].type = MSG_READ;
+        requests[i].path = file->path;
+        requests[i].args = &args[i];
+        requests[i].args_len = sizeof(struct netfs_read_args);
+        requests[i].reply = buf + start;
+        requests[i].reply_cap = args[i].size;
+    }
+    conn_call_all(&pool, requests, count);
+
+    // A short piece is the end of the file; anything after it is empty
+    ssize_t total = 0;
+    for(int i = 0; i < count; i++)
+    {
+        if(requests[i].res != 0)
+        {
+            LOG_WARN("Striped read failed: %d\n", requests[i].res);
+            return requests[i].res;
+        }
+        total += requests[i].reply_len;
+        if(requests[i].reply_len < args[i].size)
+            break;
+    }
+    return total;
 }
 
 /* 
- * Sends file information to server and takes in bytes from server to store to buffer
+ * Sends file information to server and takes in bytes from server to store
+ * to buffer. Used by the block cache to fill its blocks.
  */
-static int netfs_read(
-        const char *path, char *buf, size_t size, off_t offset,
-        struct fuse_file_info *fi) 
+static ssize_t fetch_range(
+        const struct open_file *file, off_t offset, size_t size, char *buf)
 {
+    if(options.stripe_width > 1 && file->size >= STRIPE_MIN_FILE_SIZE
+            && size >= 2 * STRIPE_MIN_CHUNK)
+        return fetch_striped(file, offset, size, buf);
+
+    // Size and offset travel with the request so the server can answer it
+    // in one go
+    struct netfs_read_args args = { 0 };
+    args.handle = file->handle;
+    args.size = size;
+    args.offset = offset;
+
+    // The server never sends more than we asked for, so the whole reply
+    // fits in buf
+    size_t bytes_read = 0;
+    int res = conn_call(&pool, MSG_READ, 0, file->path, &args, sizeof(args),
+            buf, size, &bytes_read);
+    if(res != 0)
+    {
+        LOG("Read failed: %d\n", res);
+        return res;
+    }
+
+    return bytes_read;
+}
+
+/* A pipe per FUSE worker thread that read replies are spliced through */
+struct splice_pipe {
+    int fds[2];
+    size_t size;
+};
 
-    LOG("READ: %s\n", path);
+static bool splice_reads;
+static pthread_key_t splice_pipe_key;
 
-    struct netfs_msg_header req_header = { 0 };
-    req_header.msg_type = MSG_READ;
-    req_header.msg_len =  strlen(path) + 1;
+static void free_splice_pipe(void *arg)
+{
+    struct splice_pipe *splice_pipe = arg;
+    close(splice_pipe->fds[0]);
+    close(splice_pipe->fds[1]);
+    free(splice_pipe);
+}
 
-    int server_fd = connect_to(options.server, options.port);
-    
-    // We should check if server is less than 0 here...
-    if(server_fd < 0)
+/*
+ * Gets this thread's splice pipe, empty and with room for size bytes, or NULL
+ * if it can't be made that large
+ */
+static struct splice_pipe *get_splice_pipe(size_t size)
+{
+    struct splice_pipe *splice_pipe = pthread_getspecific(splice_pipe_key);
+
+    // Anything left in it is from a reply that broke off halfway
+    int queued = 0;
+    if(splice_pipe != NULL
+            && (ioctl(splice_pipe->fds[0], FIONREAD, &queued) == -1 || queued > 0))
     {
-        perror("Socket failed");
-        return 1;
+        free_splice_pipe(splice_pipe);
+        pthread_setspecific(splice_pipe_key, NULL);
+        splice_pipe = NULL;
     }
 
-    LOG("server_fd: %d\n", server_fd);
+    if(splice_pipe == NULL)
+    {
+        splice_pipe = malloc(sizeof(struct splice_pipe));
+        if(splice_pipe == NULL)
+            return NULL;
+        if(pipe2(splice_pipe->fds, O_CLOEXEC) == -1)
+        {
+            perror("pipe2");
+            free(splice_pipe);
+            return NULL;
+        }
+        splice_pipe->size = 0;
+        pthread_setspecific(splice_pipe_key, splice_pipe);
+    }
 
-    write_len(server_fd, &req_header, sizeof(struct netfs_msg_header));
-    write_len(server_fd, path, req_header.msg_len);
+    size_t needed = size * SPLICE_PIPE_FACTOR;
+    if(splice_pipe->size < needed)
+    {
+        int res = fcntl(splice_pipe->fds[0], F_SETPIPE_SZ, needed);
+        if(res == -1)
+            return NULL;
+        splice_pipe->size = res;
+    }
+    return splice_pipe;
+}
 
-    int stat_success = 0;
-    read_len(server_fd, &stat_success, sizeof(int));
-    if(stat_success == 0)
+/*
+ * Reads small files from the copy that came with the open. Uncached reads
+ * are spliced from the server connection into a pipe that FUSE splices on
+ * into the kernel, so the file contents are never copied through our memory.
+ * Everything else goes through the block cache, which fetches whatever isn't
+ * cached yet and reads ahead when the file is being read front to back.
+ */
+static void netfs_read(
+        fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+
+    LOG("READ: %llu\n", (unsigned long long) ino);
+
+    struct open_file *file = (struct open_file *) (uintptr_t) fi->fh;
+    if(file->inline_data != NULL)
     {
-        LOG("%s\n", "Stat function couldn't read file");
-        return -ENOENT;
+        if(offset < 0 || (size_t) offset >= file->inline_len)
+            size = 0;
+        else if(size > file->inline_len - offset)
+            size = file->inline_len - offset;
+        fuse_reply_buf(req, file->inline_data + (size > 0 ? offset : 0), size);
+        return;
     }
 
-    // File Size
-    write_len(server_fd, &size, sizeof(size_t));
-    // Offset
-    write_len(server_fd, &offset, sizeof(off_t));
+    struct splice_pipe *splice_pipe = NULL;
+    if(splice_reads)
+        splice_pipe = get_splice_pipe(size);
 
-    // Get number of bytes to read
-    int bytes_read;
-    read_len(server_fd, &bytes_read, sizeof(int));
-    // If read was successful in server side
-    if(bytes_read > 0)
+    if(splice_pipe != NULL)
     {
-        int size_to_rec = 0;
-        while(size_to_rec < bytes_read)
+        struct netfs_read_args args = { 0 };
+        args.handle = file->handle;
+        args.size = size;
+        args.offset = offset;
+
+        size_t bytes_read = 0;
+        int res = conn_call_splice(&pool, MSG_READ, 0, file->path, &args, sizeof(args),
+                splice_pipe->fds[1], size, &bytes_read);
+        if(res != 0)
         {
-            int rec = recv(server_fd, buf + size_to_rec, bytes_read - size_to_rec, 0);
-            printf("Rec: %d\n", rec);
+            LOG("Read failed: %d\n", res);
+            fuse_reply_err(req, -res);
+            return;
+        }
 
-            if(rec <= 0)
-            {
-                if(rec != 0)
-                    perror("Read failed");
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(bytes_read);
+        bufv.buf[0].flags = FUSE_BUF_IS_FD;
+        bufv.buf[0].fd = splice_pipe->fds[0];
+        fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+        return;
+    }
 
-                break;
-            }
+    char *buf = malloc(size > 0 ? size : 1);
+    if(buf == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    ssize_t res = block_cache_read(&block_cache, file, buf, size, offset);
+    if(res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_buf(req, buf, res);
+    free(buf);
+}
 
-            size_to_rec += rec;
-        }
+/*
+ * Always asks for READDIRPLUS, sets up the block cache for file contents, and
+ * turns on splicing when reads bypass the cache. The kernel is told how long
+ * to keep attributes, directory entries and missing names with every reply.
+ * Leased attributes stay in our cache far longer than in the kernel's: the
+ * kernel's entries can't all be dropped when a connection breaks, but once
+ * they run out they are answered from ours.
+ */
+static void netfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+    // Always list directories with attributes; fetching them costs us one
+    // round-trip per directory instead of one per entry
+    if(conn->capable & FUSE_CAP_READDIRPLUS)
+    {
+        conn->want |= FUSE_CAP_READDIRPLUS;
+        conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+    }
 
+    // Uncached read replies can go from the socket to /dev/fuse through a
+    // pipe; cached ones are in our memory already, and compressed ones have
+    // to come through it to be decompressed
+    if(options.cache_size == 0 && !options.compress
+            && (conn->capable & FUSE_CAP_SPLICE_WRITE))
+    {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+        if(conn->capable & FUSE_CAP_SPLICE_MOVE)
+            conn->want |= FUSE_CAP_SPLICE_MOVE;
+        splice_reads = pthread_key_create(&splice_pipe_key, free_splice_pipe) == 0;
     }
 
-    close(server_fd);
+    // Started here rather than in main since main forks into the background
+    // first, and the readahead threads wouldn't survive that
+    if(block_cache_init(&block_cache, (size_t) options.cache_size * 1024 * 1024,
+                options.readahead, fetch_range) == -1)
+        fuse_session_exit(recalls.session);
 
-    return size;
+    if(options.leases)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, recall_thread, NULL) != 0)
+        {
+            perror("pthread_create");
+            fuse_session_exit(recalls.session);
+        }
+        else
+            pthread_detach(thread);
+    }
 }
 
 /* This struct maps file system operations to our custom functions defined
  * above. */
-static struct fuse_operations netfs_client_ops = {
+static const struct fuse_lowlevel_ops netfs_client_ops = {
+    .init = netfs_init,
+    .lookup = netfs_lookup,
+    .forget = netfs_forget,
+    .forget_multi = netfs_forget_multi,
     .getattr = netfs_getattr,
+    .opendir = netfs_opendir,
     .readdir = netfs_readdir,
+    .readdirplus = netfs_readdirplus,
+    .releasedir = netfs_releasedir,
     .open = netfs_open,
     .read = netfs_read,
+    .release = netfs_release,
 };
 
 static void show_help(char *argv[]) {
     printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
     printf("File-system specific options:\n"
             "    --port=<n>          Port number to connect to\n"
-            "                        (default: %d)"
-            "\n", DEFAULT_PORT);
+            "                        (default: %d)\n"
+            "    --attr-timeout=<s>  Seconds to cache file attributes\n"
+            "                        (default: %.1f)\n"
+            "    --negative-timeout=<s>\n"
+            "                        Seconds to cache missing paths\n"
+            "                        (default: %.1f)\n"
+            "    --cache-size=<MiB>  Memory for cached file contents, 0 to\n"
+            "                        turn the cache off (default: %d)\n"
+            "    --readahead=<n>     Most blocks of %d KiB to read ahead of\n"
+            "                        sequential reads (default: %d)\n"
+            "    --stripe-width=<n>  Connections to split each read of a file\n"
+            "                        of %d MiB or more across, 1 to not split\n"
+            "                        them (default: %d, at most %d)\n"
+            "    --compress          Ask the server to compress file contents\n"
+            "                        and directory listings\n"
+            "    --leases            Have the server say when cached attributes\n"
+            "                        change, and keep them until it does\n"
+            "    --lease-timeout=<s> Most seconds to keep leased attributes\n"
+            "                        (default: %.0f)"
+            "\n\n", DEFAULT_PORT, DEFAULT_ATTR_TIMEOUT, DEFAULT_NEGATIVE_TIMEOUT,
+            DEFAULT_CACHE_SIZE, BLOCK_CACHE_BLOCK_SIZE / 1024, DEFAULT_READAHEAD,
+            STRIPE_MIN_FILE_SIZE / (1024 * 1024), DEFAULT_STRIPE_WIDTH,
+            MAX_STRIPE_WIDTH, DEFAULT_LEASE_TIMEOUT);
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
 }
 
 int main(int argc, char *argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
     /* Set up default options: */
     options.port = DEFAULT_PORT;
     options.server = NULL;
+    options.attr_timeout = DEFAULT_ATTR_TIMEOUT;
+    options.negative_timeout = DEFAULT_NEGATIVE_TIMEOUT;
+    options.cache_size = DEFAULT_CACHE_SIZE;
+    options.readahead = DEFAULT_READAHEAD;
+    options.stripe_width = DEFAULT_STRIPE_WIDTH;
+    options.lease_timeout = DEFAULT_LEASE_TIMEOUT;
 
     /* Parse options */
-    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1) {
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1
+            || fuse_parse_cmdline(&args, &opts) != 0) {
         return 1;
     }
 
+    if (options.show_help || opts.show_help) {
+        show_help(argv);
+        return 0;
+    }
+    if (opts.show_version) {
+        fuse_lowlevel_version();
+        return 0;
+    }
+
     if(options.server == NULL)
     {
-        LOG("%s\n", "Server is NULL");
+        LOG_ERROR("%s\n", "Server is NULL");
+        return 1;
+    }
+    if(opts.mountpoint == NULL)
+    {
+        fprintf(stderr, "usage: %s [options] <mountpoint>\n", argv[0]);
         return 1;
     }
 
-    if (options.show_help) {
-        show_help(argv);
-        assert(fuse_opt_add_arg(&args, "--help") == 0);
-        args.argv[0] = (char*) "";
+    if (options.cache_size < 0 || options.readahead < 0) {
+        fprintf(stderr, "--cache-size and --readahead can't be negative\n");
+        return 1;
+    }
+    if (options.stripe_width < 1 || options.stripe_width > MAX_STRIPE_WIDTH) {
+        fprintf(stderr, "--stripe-width must be between 1 and %d\n",
+                MAX_STRIPE_WIDTH);
+        return 1;
+    }
+
+    if (conn_pool_init(&pool, options.server, options.port) == -1) {
+        return 1;
+    }
+    if (options.compress) {
+        pool.compress_types = (1u << MSG_READ) | (1u << MSG_READDIR)
+                | (1u << MSG_READDIRPLUS);
+    }
+    if (options.leases) {
+        pool.leases = true;
+        pool.recall = lease_recalled;
+    }
+
+    // The server counts node references per client, and every mount is a
+    // client of its own
+    if (getrandom(&pool.client_id, sizeof(pool.client_id), 0) != sizeof(pool.client_id)
+            || pool.client_id == 0) {
+        pool.client_id = ((uint64_t) getpid() << 32) | (uint32_t) time(NULL);
+    }
+    attr_cache_init(&attr_cache, options.attr_timeout, options.negative_timeout,
+            options.leases ? options.lease_timeout : 0);
+    node_cache_init(&nodes);
+    client_uid = geteuid();
+
+    int res = 1;
+    struct fuse_session *session = fuse_session_new(&args, &netfs_client_ops,
+            sizeof(netfs_client_ops), NULL);
+    if (session == NULL) {
+        goto out;
+    }
+    recalls.session = session;
+    if (fuse_set_signal_handlers(session) != 0) {
+        goto out_destroy;
+    }
+    if (fuse_session_mount(session, opts.mountpoint) != 0) {
+        goto out_signals;
+    }
+
+    fuse_daemonize(opts.foreground);
+    if (opts.singlethread) {
+        res = fuse_session_loop(session);
+    } else {
+        struct fuse_loop_config config;
+        config.clone_fd = opts.clone_fd;
+        config.max_idle_threads = opts.max_idle_threads;
+        res = fuse_session_loop_mt(session, &config);
     }
 
-    return fuse_main(args.argc, args.argv, &netfs_client_ops, NULL);
+    fuse_session_unmount(session);
+out_signals:
+    fuse_remove_signal_handlers(session);
+out_destroy:
+    fuse_session_destroy(session);
+out:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return res != 0 ? 1 : 0;
 }
@@ -4,6 +4,8 @@
  * NetFS file server implementation.
  */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
@@ -21,412 +23,1268 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <limits.h>
 #include <stdio.h>
 #include <pwd.h>
-#include <semaphore.h>
+#include <signal.h>
+#include <sys/resource.h>
 
 #include "common.h"
+#include "dirfd_cache.h"
+#include "event_loop.h"
+#include "handle_table.h"
+#include "hot_cache.h"
+#include "lease_table.h"
 #include "logging.h"
+#include "meta_cache.h"
 #include "net.h"
+#include "node_table.h"
+#include "server.h"
+#include "stats.h"
+#include "work_pool.h"
+
+#define WORKERS_PER_CORE 4
+#define DEFAULT_INLINE_THRESHOLD (64 * 1024)
+
+/* Effective uid of the server, used to tell clients which files they own */
+static uid_t server_uid;
+
+/* Files clients currently have open */
+static struct handle_table handles;
+
+/* Attributes of recently stat'ed paths, as sent */
+static struct meta_cache meta_cache;
+
+/* Paths clients were promised to hear about when they change */
+static struct lease_table leases;
+
+/* Files clients know by node ID */
+static struct node_table nodes;
+
+/* Directories that requests naming files by path are resolved in */
+static struct dirfd_cache dirfds;
+
+/* Files read most, kept mapped */
+static struct hot_cache hot_cache;
+
+/* Files up to this size are sent whole with the reply to MSG_OPEN */
+static size_t inline_threshold = DEFAULT_INLINE_THRESHOLD;
 
-sem_t thread_semaphore;
+/* Replies clients may have compressed, and how fast compression has to be to
+ * be worth it (MiB/s, 0 for any speed) */
+#define COMPRESSIBLE_TYPES ((1u << MSG_READ) | (1u << MSG_READDIR) | (1u << MSG_READDIRPLUS))
+static unsigned compress_min_rate;
 
 /*
- * Handles each request from client 
+ * Each handler turns one parsed request into a reply. They return 0 when the
+ * reply is ready to send, or -1 if the connection should be closed. Requests
+ * that fail are answered with an errno in reply->status and no body.
  */
-void handle_request(int client_fd) 
+int readdir_handler(struct netfs_request *req, struct netfs_reply *reply);
+int readdirplus_handler(struct netfs_request *req, struct netfs_reply *reply);
+int getattr_handler(struct netfs_request *req, struct netfs_reply *reply);
+int open_handler(struct netfs_request *req, struct netfs_reply *reply);
+int read_handler(struct netfs_request *req, struct netfs_reply *reply);
+int release_handler(struct netfs_request *req, struct netfs_reply *reply);
+int compound_handler(struct netfs_request *req, struct netfs_reply *reply);
+int hello_handler(struct netfs_request *req, struct netfs_reply *reply);
+int stats_handler(struct netfs_request *req, struct netfs_reply *reply);
+int lookup_handler(struct netfs_request *req, struct netfs_reply *reply);
+int forget_handler(struct netfs_request *req, struct netfs_reply *reply);
+
+/*
+ * Passes a request to the handler for its type
+ */
+static int dispatch_request(struct netfs_request *req, struct netfs_reply *reply) 
 {
-    struct netfs_msg_header req_header = { 0 };
-    read_len(client_fd, &req_header, sizeof(struct netfs_msg_header));
-    LOG("Handling request: [type %d; length %lld]\n",
-        req_header.msg_type,
-        req_header.msg_len);
+    LOG("Handling request: [type %d; length %zu]\n",
+        req->header.msg_type,
+        (size_t) req->header.msg_len);
 
-    uint16_t type = req_header.msg_type;
-    LOG("req_header type: %d\n", type);
+    uint16_t type = req->header.msg_type;
 
     if(type == MSG_READDIR) 
     {
         LOG("%s\n", "MSG_READDIR");
-        readdir_handler(client_fd, req_header);
-        return;
+        return readdir_handler(req, reply);
     }
     else if(type == MSG_GETATTR)
     {
         LOG("%s\n", "MSG_GETATTR");
-        getattr_handler(client_fd, req_header);
-        return;
+        return getattr_handler(req, reply);
     }
     else if(type == MSG_OPEN)
     {
         LOG("%s\n", "MSG_OPEN");
-        open_handler(client_fd, req_header);
-        return;
+        return open_handler(req, reply);
     }
     else if(type == MSG_READ)
     {
         LOG("%s\n", "MSG_READ");
-        read_handler(client_fd, req_header);
-        return;
+        return read_handler(req, reply);
+    }
+    else if(type == MSG_READDIRPLUS)
+    {
+        LOG("%s\n", "MSG_READDIRPLUS");
+        return readdirplus_handler(req, reply);
+    }
+    else if(type == MSG_RELEASE)
+    {
+        LOG("%s\n", "MSG_RELEASE");
+        return release_handler(req, reply);
+    }
+    else if(type == MSG_COMPOUND)
+    {
+        LOG("%s\n", "MSG_COMPOUND");
+        return compound_handler(req, reply);
+    }
+    else if(type == MSG_HELLO)
+    {
+        LOG("%s\n", "MSG_HELLO");
+        return hello_handler(req, reply);
+    }
+    else if(type == MSG_STATS)
+    {
+        LOG("%s\n", "MSG_STATS");
+        return stats_handler(req, reply);
+    }
+    else if(type == MSG_LOOKUP)
+    {
+        LOG("%s\n", "MSG_LOOKUP");
+        return lookup_handler(req, reply);
+    }
+    else if(type == MSG_FORGET)
+    {
+        LOG("%s\n", "MSG_FORGET");
+        return forget_handler(req, reply);
     }
     else 
     {
         LOG("%s\n", "error: Unknown request type\n"); 
-        return; 
+        return -1;
     }
-
-    return;
-
 }
 
 /*
- * Scan through a directory and transmit them across the network to the client
+ * Re-encodes a finished reply body as a stream of blocks, compressed where
+ * that pays. File data that was going to be sent with sendfile() has to be
+ * read in for that.
  */
-void readdir_handler(int client_fd, struct netfs_msg_header req_header) 
+static int compress_reply(struct netfs_session *session, struct netfs_reply *reply)
 {
-    char path[MAXIMUM_PATH] = { 0 };
-    read_len(client_fd, path, req_header.msg_len);
-    LOG("READDIR: %s\n", path);
-
-    char full_path[MAXIMUM_PATH] = { 0 };
-    strcpy(full_path, ".");
-    strcat(full_path, path);
-    //req: /
-    //actual: ./
+    size_t start = sizeof(struct netfs_reply_header);
+    size_t body_len = reply->len - start;
+    size_t raw_len = body_len + reply->file_len;
 
-    DIR *directory;
-    if ((directory = opendir(full_path)) == NULL) 
+    char *raw = malloc(raw_len > 0 ? raw_len : 1);
+    char *stream = malloc(compress_bound(raw_len) > 0 ? compress_bound(raw_len) : 1);
+    if(raw == NULL || stream == NULL)
     {
-        perror("opendir");
-        close(client_fd);
-        return;
+        perror("malloc");
+        free(raw);
+        free(stream);
+        return -1;
     }
+    memcpy(raw, reply->buf + start, body_len);
 
-    // Write each directory entry
-    uint16_t len;
-    struct dirent *entry;
-    while ((entry = readdir(directory)) != NULL) 
+    // The reply header isn't written yet, so a file that shrank just means a
+    // shorter reply
+    size_t file_read = 0;
+    while(file_read < reply->file_len)
     {
-        len = strlen(entry->d_name) + 1;
-        write_len(client_fd, &len, sizeof(uint16_t));
-        write_len(client_fd, entry->d_name, len);
+        ssize_t res = pread(reply->file_fd, raw + body_len + file_read,
+                reply->file_len - file_read, reply->file_offset + file_read);
+        if(res == -1 && errno == EINTR)
+            continue;
+        if(res <= 0)
+            break;
+        file_read += res;
     }
+    if(reply->file_fd != -1)
+        close(reply->file_fd);
+    reply->file_fd = -1;
+    reply->file_len = 0;
+    raw_len = body_len + file_read;
+
+    size_t stream_len = compress_stream(&session->adapt, raw, raw_len, stream);
+    reply->len = start;
+    int res = reply_append(reply, stream, stream_len);
+    free(raw);
+    free(stream);
+    return res;
+}
 
-    // Last directory entry
-    len = 0;
-    write_len(client_fd, &len, sizeof(uint16_t));
+/*
+ * Handles a request from a client, compressing the reply if the connection
+ * asked for that
+ */
+int handle_request(struct netfs_request *req, struct netfs_reply *reply)
+{
+    if(dispatch_request(req, reply) == -1)
+        return -1;
 
-    closedir(directory);
-    close(client_fd); // Close socket connection
-    return;
+    uint16_t type = req->header.msg_type;
+    if(!req->nested && reply->status == 0 && type < 32
+            && (req->session->compress_types & (1u << type)))
+        return compress_reply(req->session, reply);
+    return 0;
 }
 
 /*
- * Transmit the resulting struct directly over the network
+ * Converts a stat result into the struct sent to clients: ownership is
+ * reduced to whether the server user owns the file, and the mode is made
+ * read-only.
  */
-void getattr_handler(int client_fd, struct netfs_msg_header req_header) 
+static void stat_to_attr(const struct stat *stbuf, struct attr_stat *atst)
 {
-    struct passwd *pw_server;
-    uid_t uid;
+    // Add attributes to custom struct
+    atst->ino = stbuf->st_ino;
+    atst->uid = stbuf->st_uid; 
+    atst->gid = stbuf->st_gid;
+    atst->mode = stbuf->st_mode;
+    atst->nlink = stbuf->st_nlink;
+    atst->size = stbuf->st_size;
+    atst->blocks = stbuf->st_blocks;
+    atst->mtim = stbuf->st_mtim;
 
-    uid = geteuid();
-    pw_server = getpwuid(uid);
+    // Check if server id matches file id
+    if(server_uid == atst->uid)
+        atst->uid = 1;
+    else
+        atst->uid = 0;
 
-    char path[MAXIMUM_PATH] = { 0 };
-    read_len(client_fd, path, req_header.msg_len);
-    LOG("GETATTR: %s\n", path);
+    // Change bits to read-only
+    if(S_ISDIR(atst->mode))
+        atst->mode = atst->mode & (S_IFDIR | 0555);
+    else
+        atst->mode = atst->mode & (S_IFREG | 0555);
+}
 
-    // Return if at root directory
-    if(strcmp(path, "/") == 0)
-        return;
+/*
+ * Stats the file a node stands for, through the attribute cache while its
+ * path can be trusted, and makes sure it is still the same file. Sets watched
+ * like meta_cache_stat. Returns 0 or a negative errno, ESTALE if the file is
+ * gone.
+ */
+static int stat_node(struct node_ref *ref, struct attr_stat *atst, bool *watched)
+{
+    struct node *node = ref->node;
+    struct stat stbuf;
+    int res;
 
-    char full_path[MAXIMUM_PATH] = { 0 };
-    strcpy(full_path, ".");
-    strcat(full_path, path);
+    if(ref->path_current)
+    {
+        if(ref->parent == NULL)
+            res = meta_cache_stat(&meta_cache, "/", -1, NULL, atst, watched);
+        else
+            res = meta_cache_stat(&meta_cache, ref->path, ref->parent->fd, ref->name,
+                    atst, watched);
+        if(res == 0 && atst->ino == node->ino)
+            return 0;
+    }
+    *watched = false;
+
+    // Directories have a descriptor of their own, wherever they went
+    if(node->fd != -1)
+        res = fstatat(node->fd, "", &stbuf, AT_EMPTY_PATH);
+    else
+        res = fstatat(ref->parent->fd, ref->name, &stbuf, 0);
+    if(res == -1)
+        return errno == ENOENT ? -ESTALE : -errno;
+    if(stbuf.st_ino != node->ino)
+        return -ESTALE;
+    stat_to_attr(&stbuf, atst);
+    return 0;
+}
+
+/*
+ * Transmit the resulting struct directly over the network. Clients with
+ * leases get one on the path, which is recalled again straight away if its
+ * changes can't be watched.
+ */
+int getattr_handler(struct netfs_request *req, struct netfs_reply *reply) 
+{
+    char *path = req->path;
+    struct node_ref ref = { 0 };
+    int res;
+
+    if(req->header.node != 0)
+    {
+        res = node_get(&nodes, req->header.node, &ref);
+        if(res < 0)
+        {
+            reply->status = -res;
+            return 0;
+        }
+        path = ref.path;
+    }
+    LOG("GETATTR: %s\n", path);
 
-    struct stat stbuf;
     struct attr_stat atst = {0};
+    bool leased = req->session->leases && (ref.node == NULL || ref.path_current);
+    bool watched;
+
+    if(leased)
+        lease_grant(&leases, req->session, path);
+
+    // Usually answered from memory; see meta_cache.h
+    uint64_t start = stats_now();
+    struct dirfd_ref dir;
+    if(ref.node != NULL)
+        res = stat_node(&ref, &atst, &watched);
+    else if((res = dirfd_cache_resolve(&dirfds, path, &dir)) == 0)
+    {
+        res = meta_cache_stat(&meta_cache, path, dir.fd, dir.name, &atst, &watched);
+        dirfd_cache_release(&dirfds, &dir);
+    }
+    else
+        watched = false;
+    stats_time(TIMER_STAT, stats_now() - start);
+
+    if(leased && !watched)
+        lease_recall(&leases, req->session, path);
+    if(ref.node != NULL)
+        node_put(&nodes, &ref);
 
-    int stat_success = 0;
-    if(stat(full_path, &stbuf) < 0)
+    if(res < 0)
     {
         LOG("%s\n", "Stat function failed");
-        write_len(client_fd, &stat_success, sizeof(int));
-        close(client_fd);
-        return;
+        reply->status = -res;
+        return 0;
     }
-    else
+    LOG("%s\n", "Stat function success");
+
+    // Write custom struct to client
+    return reply_append(reply, &atst, sizeof(struct attr_stat));
+}
+
+/*
+ * Scan through a directory and transmit them across the network to the
+ * client, one page at a time. Listing resumes at the cookie the client sends
+ * (a getdents64() d_off from an earlier page) and stops once the reply frame
+ * is full, so huge directories are never held in memory on either side.
+ * Entries are read in bulk into a per-thread buffer. With plus set, each name
+ * is followed by the entry's attributes; entries that vanish before they can
+ * be stat'ed are sent with zeroed attributes. dir_path is the directory's
+ * client path, which entries are cached under while path_current says it
+ * can be trusted. dir is the directory's node if it was named by one, in
+ * which case a client that looks up nodes also gets a node for every entry.
+ */
+static int list_directory(struct netfs_request *req, struct netfs_reply *reply,
+        int dir_fd, const char *dir_path, bool path_current, struct node_ref *dir,
+        bool plus)
+{
+    static __thread char dents[DIR_FRAME_SIZE];
+
+    struct netfs_readdir_args args;
+    memcpy(&args, req->payload, sizeof(struct netfs_readdir_args));
+
+    uint64_t client = req->session->client_id;
+    bool with_nodes = plus && dir != NULL && client != 0;
+
+    struct netfs_dir_frame frame = { 0 };
+    frame.eof = 1;
+    size_t entry_max = sizeof(uint64_t) + sizeof(uint16_t) + NAME_MAX + 1
+        + (plus ? sizeof(struct attr_stat) : 0) + (with_nodes ? sizeof(uint64_t) : 0);
+
+    if(args.cookie != 0 && lseek(dir_fd, args.cookie, SEEK_SET) == -1)
     {
-        stat_success = 1;
-        LOG("%s\n", "Stat function success");
-        write_len(client_fd, &stat_success, sizeof(int));
+        perror("lseek");
+        reply->status = errno;
+        return 0;
     }
 
-    // Add attributes to custom struct
-    LOG("\n%s\n\n", "***IS FILE***");
-    atst.ino = stbuf.st_ino;
-    atst.uid = stbuf.st_uid; 
-    atst.gid = stbuf.st_gid;
-    atst.mode = stbuf.st_mode;
-    atst.nlink = stbuf.st_nlink;
-    atst.size = stbuf.st_size;
-    atst.blocks = stbuf.st_blocks;
-    atst.mtim = stbuf.st_mtim;
+    size_t frame_start = reply->len;
+    if(reply_append(reply, &frame, sizeof(struct netfs_dir_frame)) == -1)
+        return -1;
 
-    // Check if server id matches file id
-    if(pw_server->pw_uid == atst.uid)
-        atst.uid = 1;
+    frame.eof = 0;
+    bool full = false;
+    while(!full)
+    {
+        // Don't read many more entries than the frame has room for; the rest
+        // would be thrown away and read again for the next page
+        size_t room = DIR_FRAME_SIZE - (reply->len - frame_start);
+        if(room < 1024)
+            room = 1024;
+        if(room > sizeof(dents))
+            room = sizeof(dents);
+
+        ssize_t bytes = getdents64(dir_fd, dents, room);
+        if(bytes <= 0)
+        {
+            if(bytes == -1)
+                perror("getdents64");
+            frame.eof = 1;
+            break;
+        }
+
+        for(ssize_t pos = 0; pos < bytes; )
+        {
+            struct dirent64 *entry = (struct dirent64 *) (dents + pos);
+            pos += entry->d_reclen;
+
+            if(reply->len - frame_start + entry_max > DIR_FRAME_SIZE)
+            {
+                full = true;
+                break;
+            }
+
+            uint64_t cookie = entry->d_off;
+            uint16_t len = strlen(entry->d_name) + 1;
+            if(reply_append(reply, &cookie, sizeof(uint64_t)) == -1
+                    || reply_append(reply, &len, sizeof(uint16_t)) == -1
+                    || reply_append(reply, entry->d_name, len) == -1)
+                return -1;
+
+            if(plus)
+            {
+                struct attr_stat atst = { 0 };
+                char entry_path[MAXIMUM_PATH];
+                struct stat stbuf;
+                bool dots = strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0;
+                int path_len = snprintf(entry_path, sizeof(entry_path), "%s/%s",
+                        strcmp(dir_path, "/") == 0 ? "" : dir_path, entry->d_name);
+                bool path_ok = path_len > 0 && (size_t) path_len < sizeof(entry_path);
+
+                // Entries go through the attribute cache under their full
+                // path, so a listing warms it for the GETATTRs that follow
+                if(!dots && path_ok && path_current)
+                    meta_cache_stat(&meta_cache, entry_path, dir_fd, entry->d_name,
+                            &atst, NULL);
+                else if(fstatat(dir_fd, entry->d_name, &stbuf, 0) == 0)
+                    stat_to_attr(&stbuf, &atst);
+                if(reply_append(reply, &atst, sizeof(struct attr_stat)) == -1)
+                    return -1;
+
+                // An entry that can't be made a node is sent without one,
+                // and the client looks it up itself
+                uint64_t id = 0;
+                if(with_nodes && !dots && path_ok && atst.mode != 0)
+                    node_lookup(&nodes, client, dir, entry->d_name, entry_path,
+                            path_current, atst.ino, S_ISDIR(atst.mode), &id);
+                if(with_nodes && reply_append(reply, &id, sizeof(uint64_t)) == -1)
+                    return -1;
+            }
+            frame.count++;
+        }
+    }
+
+    frame.len = reply->len - frame_start - sizeof(struct netfs_dir_frame);
+    memcpy(reply->buf + frame_start, &frame, sizeof(struct netfs_dir_frame));
+    return 0;
+}
+
+/*
+ * Opens the directory a MSG_READDIR(PLUS) names and lists a page of it. A
+ * directory that can't be opened is answered with the errno.
+ */
+static int send_directory(struct netfs_request *req, struct netfs_reply *reply, bool plus)
+{
+    struct node_ref dir = { 0 };
+    int dir_fd;
+
+    if(req->header.node != 0)
+    {
+        int res = node_get(&nodes, req->header.node, &dir);
+        if(res < 0)
+        {
+            reply->status = -res;
+            return 0;
+        }
+        if(dir.node->fd == -1)
+        {
+            node_put(&nodes, &dir);
+            reply->status = ENOTDIR;
+            return 0;
+        }
+        dir_fd = openat(dir.node->fd, ".", O_RDONLY | O_DIRECTORY);
+    }
     else
-        atst.uid = 0;
-
-    // Change permissions to read-only
-    printf("File information for %s before change\n", path);
-    printf("---------------------------\n");
-    printf("File Permissions: \t");
-    printf( (S_ISDIR(atst.mode)) ? "d" : "-");
-    printf( (atst.mode & S_IRUSR) ? "r" : "-");
-    printf( (atst.mode & S_IWUSR) ? "w" : "-");
-    printf( (atst.mode & S_IXUSR) ? "x" : "-");
-    printf( (atst.mode & S_IRGRP) ? "r" : "-");
-    printf( (atst.mode & S_IWGRP) ? "w" : "-");
-    printf( (atst.mode & S_IXGRP) ? "x" : "-");
-    printf( (atst.mode & S_IROTH) ? "r" : "-");
-    printf( (atst.mode & S_IWOTH) ? "w" : "-");
-    printf( (atst.mode & S_IXOTH) ? "x" : "-");
-    printf("\n\n");
-
-    int statchmod = atst.mode & (S_IRWXU | S_IRWXG | S_IRWXO);
-    printf("********chmod: %o\n", statchmod);
+    {
+        struct dirfd_ref parent;
+        int res = dirfd_cache_resolve(&dirfds, req->path, &parent);
+        if(res < 0)
+        {
+            reply->status = -res;
+            return 0;
+        }
+        dir_fd = openat(parent.fd, parent.name, O_RDONLY | O_DIRECTORY);
+        int err = errno;
+        dirfd_cache_release(&dirfds, &parent);
+        errno = err;
+    }
 
-    // Change bits to read-only
-    if(S_ISDIR(atst.mode))
-        atst.mode = atst.mode & (S_IFDIR | 0555);
+    int res = 0;
+    if(dir_fd == -1)
+    {
+        perror("openat");
+        reply->status = errno;
+    }
+    else if(dir.node != NULL)
+        res = list_directory(req, reply, dir_fd, dir.path, dir.path_current, &dir, plus);
     else
-        atst.mode = atst.mode & (S_IFREG | 0555);
-
-    statchmod = atst.mode & (S_IRWXU | S_IRWXG | S_IRWXO);
-    printf("********chmod: %o\n\n", statchmod);
-
-    printf("File information for %s after change\n", path);
-    printf("---------------------------\n");
-    printf("File Permissions: \t");
-    printf( (S_ISDIR(atst.mode)) ? "d" : "-");
-    printf( (atst.mode & S_IRUSR) ? "r" : "-");
-    printf( (atst.mode & S_IWUSR) ? "w" : "-");
-    printf( (atst.mode & S_IXUSR) ? "x" : "-");
-    printf( (atst.mode & S_IRGRP) ? "r" : "-");
-    printf( (atst.mode & S_IWGRP) ? "w" : "-");
-    printf( (atst.mode & S_IXGRP) ? "x" : "-");
-    printf( (atst.mode & S_IROTH) ? "r" : "-");
-    printf( (atst.mode & S_IWOTH) ? "w" : "-");
-    printf( (atst.mode & S_IXOTH) ? "x" : "-");
-    printf("\n\n");
+        res = list_directory(req, reply, dir_fd, req->path, true, NULL, plus);
 
-    // Write custom struct to client
-    write_len(client_fd, &atst, sizeof(struct attr_stat));
+    if(dir_fd != -1)
+        close(dir_fd);
+    if(dir.node != NULL)
+        node_put(&nodes, &dir);
+    return res;
+}
+
+int readdir_handler(struct netfs_request *req, struct netfs_reply *reply) 
+{
+    LOG("READDIR: %s\n", req->path);
+    return send_directory(req, reply, false);
+}
 
-    close(client_fd); // Close socket connection
-    return;
+int readdirplus_handler(struct netfs_request *req, struct netfs_reply *reply)
+{
+    LOG("READDIRPLUS: %s\n", req->path);
+    return send_directory(req, reply, true);
 }
 
 /*
- * Opens file given and sends to file descriptor to client
+ * Opens a client path for reading as a name in its parent directory's cached
+ * descriptor. The handle table opens files with this. Returns the descriptor
+ * or -1 with errno set.
  */
-void open_handler(int client_fd, struct netfs_msg_header req_header)
+static int open_path(const char *path)
 {
-    char path[MAXIMUM_PATH] = { 0 };
-    read_len(client_fd, path, req_header.msg_len);
-    LOG("OPEN: %s\n", path);
+    struct dirfd_ref dir;
+    int res = dirfd_cache_resolve(&dirfds, path, &dir);
+    if(res < 0)
+    {
+        errno = -res;
+        return -1;
+    }
+    int fd = openat(dir.fd, dir.name, O_RDONLY);
+    int err = errno;
+    dirfd_cache_release(&dirfds, &dir);
+    errno = err;
+    return fd;
+}
+
+/*
+ * Opens the file a node stands for as name in its directory, and makes sure
+ * it is still that file. Returns the descriptor or a negative errno.
+ */
+static int open_node(struct node_ref *ref)
+{
+    if(ref->node->fd != -1)
+        return -EISDIR;
 
-    char full_path[MAXIMUM_PATH] = { 0 };
-    strcpy(full_path, ".");
-    strcat(full_path, path);
+    int fd = openat(ref->parent->fd, ref->name, O_RDONLY);
+    if(fd == -1)
+        return errno == ENOENT ? -ESTALE : -errno;
 
-    uint16_t success;
+    struct stat stbuf;
+    if(fstat(fd, &stbuf) == -1 || stbuf.st_ino != ref->node->ino)
+    {
+        close(fd);
+        return -ESTALE;
+    }
+    return fd;
+}
 
-    /* Check here if read_handler problems occur */
+/*
+ * Opens file given and sends a handle for it to the client. Small files are
+ * sent along whole instead, and closed again straight away.
+ */
+int open_handler(struct netfs_request *req, struct netfs_reply *reply)
+{
+    char *path = req->path;
+    struct node_ref ref = { 0 };
+    int res;
 
-    // Open file
-    int fd = open(full_path, O_RDONLY);
-    if(fd == -1)
+    if(req->header.node != 0)
     {
-        success = -1;
-        write_len(client_fd, &success, sizeof(uint16_t));
-        close(client_fd);
-        perror("open");
-        return;
+        res = node_get(&nodes, req->header.node, &ref);
+        if(res < 0)
+        {
+            reply->status = -res;
+            return 0;
+        }
+        path = ref.path;
     }
-    else
+    LOG("OPEN: %s\n", path);
+
+    struct netfs_open_args args;
+    memcpy(&args, req->payload, sizeof(struct netfs_open_args));
+    size_t inline_max = args.inline_max;
+    if(inline_max > inline_threshold)
+        inline_max = inline_threshold;
+
+    struct netfs_open_reply open_reply = { 0 };
+    uint64_t handle = 0;
+
+    // Open file; it stays open in the handle table until MSG_RELEASE. One
+    // named by node is opened in its directory, and one named by path in the
+    // cached descriptor of its parent; a node's path is only used if the
+    // handle has to be opened again.
+    uint64_t start = stats_now();
+    res = 0;
+    int node_fd = -1;
+    if(ref.node != NULL)
+    {
+        res = node_fd = open_node(&ref);
+        node_put(&nodes, &ref);
+    }
+    if(res >= 0)
+        res = handle_open(&handles, path, node_fd, &handle);
+    stats_time(TIMER_OPEN, stats_now() - start);
+    if(res < 0)
+    {
+        LOG("open: %s\n", strerror(-res));
+        reply->status = -res;
+        return 0;
+    }
+
+    // Ask for one byte more than may be inlined; the handle trims that to
+    // what the file actually has, so getting all of it back means it fits
+    size_t len = inline_max + 1;
+    int fd = -1;
+    if(inline_max > 0 && handle_acquire(&handles, handle, 0, &len, &fd, NULL) == 0)
     {
-        success = 0;
-        write_len(client_fd, &success, sizeof(uint16_t));
+        if(len <= inline_max)
+        {
+            handle_release(&handles, handle);
+            handle = 0;
+            open_reply.inlined = 1;
+        }
+        else
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    open_reply.handle = handle;
+
+    if(reply_append(reply, &open_reply, sizeof(struct netfs_open_reply)) == -1)
+    {
+        if(fd != -1)
+            close(fd);
+        return -1;
     }
 
-    close(client_fd);
-    return;
+    // Goes out with sendfile() like a read; the reply closes fd
+    if(fd != -1 && len > 0)
+    {
+        readahead(fd, 0, len);
+        reply_sendfile(reply, fd, 0, len);
+    }
+    else if(fd != -1)
+        close(fd);
+    return 0;
 }
 
 /*
- * Receives file information and and send file data with sendfile()
+ * Lets go of a hot file once a reply has been sent from it
  */
-void read_handler(int client_fd, struct netfs_msg_header req_header)
+static void hot_file_sent(void *arg)
 {
-    // int fd;
-    size_t size;
-    off_t offset;
+    hot_cache_put(&hot_cache, arg);
+}
 
-    char path[MAXIMUM_PATH] = { 0 };
-    read_len(client_fd, path, req_header.msg_len);
+/*
+ * Receives file information and and send file data with sendfile(), or from
+ * the hot file cache
+ */
+int read_handler(struct netfs_request *req, struct netfs_reply *reply)
+{
+    char *path = req->path;
     LOG("READ: %s\n", path);
 
-    char full_path[MAXIMUM_PATH] = { 0 };
-    strcpy(full_path, ".");
-    strcat(full_path, path);
+    struct netfs_read_args args;
+    memcpy(&args, req->payload, sizeof(struct netfs_read_args));
+    size_t size = args.size;
+    off_t offset = args.offset;
+
+    // The handle knows the descriptor and the size, so there is nothing to
+    // resolve or stat here. Only what is actually in the file past offset is
+    // sent, and the reply header tells the client how many bytes that is.
+    // Files read often are answered from memory, unless the reply has to be
+    // compressed or put in a compound, which read their data with pread().
+    struct handle_info info;
+    struct hot_file *hot = NULL;
+    bool promote = false;
+    int res = 0;
+    if(hot_cache_enabled(&hot_cache) && !req->nested
+            && !(req->session->compress_types & (1u << MSG_READ)))
+    {
+        res = handle_acquire(&handles, args.handle, offset, &size, NULL, &info);
+        if(res == 0 && size > 0)
+            hot = hot_cache_get(&hot_cache, &info, size, &promote);
+    }
 
-    struct stat stbuf;
-    struct attr_stat atst = {0};
+    int fd = -1;
+    if(res == 0 && hot == NULL)
+    {
+        res = handle_acquire(&handles, args.handle, offset, &size, &fd, &info);
+        if(res == 0 && promote)
+            hot = hot_cache_map(&hot_cache, &info, fd);
+    }
+    if(res < 0)
+    {
+        LOG("read: %s\n", strerror(-res));
+        reply->status = -res;
+        return 0;
+    }
 
-    int stat_success = 0;
-    if(stat(full_path, &stbuf) < 0)
+    // Its pages go straight from the mapping to the socket, and it stays
+    // mapped until they have
+    if(hot != NULL)
     {
-        LOG("%s\n", "Stat function failed");
-        write_len(client_fd, &stat_success, sizeof(int));
-        close(client_fd);
-        return;
+        if(fd != -1)
+            close(fd);
+        reply_send_mapped(reply, hot->data + offset, size, hot_file_sent, hot);
+        return 0;
+    }
+
+    size_t bytes_read = size;
+
+    // The file data itself goes out with sendfile() from the event loop once
+    // the socket is writable. Pull it into the page cache here, on the worker,
+    // so the loop never waits on the disk. The reply closes fd when it's done.
+    if(bytes_read > 0)
+    {
+        readahead(fd, offset, bytes_read);
+        reply_sendfile(reply, fd, offset, bytes_read);
     }
     else
+        close(fd);
+
+    return 0;
+}
+
+/*
+ * Closes a handle given out by open_handler
+ */
+int release_handler(struct netfs_request *req, struct netfs_reply *reply)
+{
+    (void) reply;
+    struct netfs_release_args args;
+    memcpy(&args, req->payload, sizeof(struct netfs_release_args));
+    LOG("RELEASE: %s\n", req->path);
+
+    // Releasing a handle twice, or one from an earlier run of the server,
+    // does no harm
+    if(handle_release(&handles, args.handle) < 0)
+        LOG("%s\n", "Handle already closed");
+    return 0;
+}
+
+/*
+ * Looks a name up in the directory the request's node stands for, and gives
+ * the client a node for what is there. Leases come with it like with
+ * MSG_GETATTR.
+ */
+int lookup_handler(struct netfs_request *req, struct netfs_reply *reply)
+{
+    const char *name = req->path;
+    LOG("LOOKUP: %llu %s\n", (unsigned long long) req->header.node, name);
+
+    uint64_t client = req->session->client_id;
+    if(client == 0 || req->header.node == 0 || name[0] == '\0'
+            || strchr(name, '/') != NULL || strcmp(name, ".") == 0
+            || strcmp(name, "..") == 0)
+    {
+        reply->status = EINVAL;
+        return 0;
+    }
+
+    struct node_ref dir;
+    int res = node_get(&nodes, req->header.node, &dir);
+    if(res < 0)
     {
-        stat_success = 1;
-        LOG("%s\n", "Stat function success");
-        write_len(client_fd, &stat_success, sizeof(int));
+        reply->status = -res;
+        return 0;
     }
 
-    int bytes_read = stbuf.st_size;
+    char path[MAXIMUM_PATH];
+    int path_len = snprintf(path, sizeof(path), "%s/%s",
+            strcmp(dir.path, "/") == 0 ? "" : dir.path, name);
+    if(dir.node->fd == -1)
+        res = -ENOTDIR;
+    else if(path_len < 0 || (size_t) path_len >= sizeof(path))
+        res = -ENAMETOOLONG;
+
+    struct attr_stat attr = { 0 };
+    bool leased = req->session->leases && dir.path_current && res == 0;
+    bool watched = false;
+    if(leased)
+        lease_grant(&leases, req->session, path);
+
+    uint64_t start = stats_now();
+    struct stat stbuf;
+    if(res == 0 && dir.path_current)
+        res = meta_cache_stat(&meta_cache, path, dir.node->fd, name, &attr, &watched);
+    else if(res == 0 && fstatat(dir.node->fd, name, &stbuf, 0) == 0)
+        stat_to_attr(&stbuf, &attr);
+    else if(res == 0)
+        res = -errno;
+    stats_time(TIMER_STAT, stats_now() - start);
+
+    if(leased && !watched)
+        lease_recall(&leases, req->session, path);
+
+    uint64_t node = 0;
+    if(res == 0)
+        res = node_lookup(&nodes, client, &dir, name, path, dir.path_current,
+                attr.ino, S_ISDIR(attr.mode), &node);
+    node_put(&nodes, &dir);
+    if(res < 0)
+    {
+        reply->status = -res;
+        return 0;
+    }
+
+    struct netfs_lookup_reply lookup_reply;
+    lookup_reply.node = node;
+    lookup_reply.attr = attr;
+    return reply_append(reply, &lookup_reply, sizeof(struct netfs_lookup_reply));
+}
 
-    // Open file
-    int fd = open(full_path, O_RDONLY);
+/*
+ * Drops references the client took with MSG_LOOKUP
+ */
+int forget_handler(struct netfs_request *req, struct netfs_reply *reply)
+{
+    struct netfs_forget_args args;
+    memcpy(&args, req->payload, sizeof(struct netfs_forget_args));
+    LOG("FORGET: %llu, %llu\n", (unsigned long long) req->header.node,
+            (unsigned long long) args.nlookup);
 
-    // size
-    read_len(client_fd, &size, sizeof(size_t));
-    // offset
-    read_len(client_fd, &offset, sizeof(off_t));
+    if(req->session->client_id == 0)
+        reply->status = EINVAL;
+    else
+        node_forget(&nodes, req->session->client_id, req->header.node, args.nlookup);
+    return 0;
+}
 
-    // Create buffer with size of file
-    // char *buf = malloc(sizeof(char) * size);
-    // Returns the number of bytes read, zero indicates end of file
-    // int bytes_read = pread(fd, buf, size, offset);
-    // printf("bytes read: %d\n", bytes_read);
+/*
+ * Copies the part of a reply that would have gone out with sendfile() into
+ * its buffer, and closes the file
+ */
+static int reply_inline_file(struct netfs_reply *reply)
+{
+    static __thread char chunk[64 * 1024];
 
-    write_len(client_fd, &bytes_read, sizeof(int));
-    
-    if(bytes_read > 0)
+    while(reply->file_len > 0)
     {
-        while(size > 0)
+        size_t len = reply->file_len < sizeof(chunk) ? reply->file_len : sizeof(chunk);
+        ssize_t bytes = pread(reply->file_fd, chunk, len, reply->file_offset);
+        if(bytes <= 0)
         {
-            ssize_t sent = sendfile(client_fd, fd, &offset, size);
-            printf("Sent: %d\n", sent);
-            printf("Offset: %lld\n", offset);
-            if(sent <= 0)
-            {
-                if(sent != 0)
-                    perror("Read failed");
-
-                break;
-            }
-            size -= sent;
+            // Same as a file shrinking during sendfile; the length is
+            // already promised
+            if(bytes == -1)
+                perror("pread");
+            return -1;
         }
+        if(reply_append(reply, chunk, bytes) == -1)
+            return -1;
+        reply->file_offset += bytes;
+        reply->file_len -= bytes;
     }
 
-    close(client_fd);
-    return;
+    close(reply->file_fd);
+    reply->file_fd = -1;
+    return 0;
 }
 
-int main(int argc, char *argv[]) 
+/*
+ * Runs the operations of a compound request one after the other through the
+ * ordinary handlers, and puts their results together in one reply. Handles
+ * given out by an OPEN are passed on to READ and RELEASE operations later in
+ * the same compound that leave theirs at 0. Operations left once the reply
+ * has grown to NETFS_COMPOUND_MAX_REPLY fail with E2BIG without being run,
+ * other than RELEASE and FORGET.
+ */
+int compound_handler(struct netfs_request *req, struct netfs_reply *reply)
 {
-    // Change to directory provided
-    chdir(argv[1]);
-    // Set port 
-    int port = DEFAULT_PORT;
-    if(argc == 3)
-        port = atoi(argv[2]);
+    struct netfs_compound_args args;
+    memcpy(&args, req->payload, sizeof(struct netfs_compound_args));
+    LOG("COMPOUND: %s, %d operations\n", req->path, args.count);
 
-    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd == -1) {
-        perror("socket");
-        return 1;
+    if(args.count > NETFS_COMPOUND_MAX_OPS)
+    {
+        reply->status = EINVAL;
+        return 0;
     }
 
-    struct sockaddr_in addr = { 0 };
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
-    if (bind(socket_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
-        perror("bind");
-        return 1;
+    struct netfs_request sub;
+    struct netfs_reply sub_reply;
+    reply_init(&sub_reply);
+    uint64_t last_handle = 0;
+    size_t pos = 0;
+    int res = 0;
+
+    for(int i = 0; i < args.count; i++)
+    {
+        // A body that doesn't hold as many operations as it claims fails the
+        // whole compound
+        struct netfs_compound_op op;
+        if(pos + sizeof(struct netfs_compound_op) > req->body_len)
+        {
+            reply->status = EINVAL;
+            break;
+        }
+        memcpy(&op, req->body + pos, sizeof(struct netfs_compound_op));
+        pos += sizeof(struct netfs_compound_op);
+
+        // Only the operations listed in net.h can be told apart in the body
+        if(op.msg_type != MSG_GETATTR && op.msg_type != MSG_OPEN
+                && op.msg_type != MSG_READ && op.msg_type != MSG_READDIR
+                && op.msg_type != MSG_READDIRPLUS && op.msg_type != MSG_RELEASE
+                && op.msg_type != MSG_LOOKUP && op.msg_type != MSG_FORGET)
+        {
+            reply->status = EINVAL;
+            break;
+        }
+
+        size_t payload_len = request_payload_len(op.msg_type);
+        if(op.path_len > MAXIMUM_PATH || pos + op.path_len + payload_len > req->body_len)
+        {
+            reply->status = EINVAL;
+            break;
+        }
+
+        memset(&sub.header, 0, sizeof(struct netfs_msg_header));
+        sub.header.msg_type = op.msg_type;
+        if(op.path_len > 0)
+        {
+            memcpy(sub.path, req->body + pos, op.path_len);
+            sub.path[op.path_len - 1] = '\0';
+            pos += op.path_len;
+            sub.header.node = op.node;
+        }
+        else
+        {
+            strcpy(sub.path, req->path);
+            sub.header.node = req->header.node;
+        }
+        sub.header.msg_len = strlen(sub.path) + 1;
+        memcpy(sub.payload, req->body + pos, payload_len);
+        pos += payload_len;
+        sub.body = NULL;
+        sub.body_len = 0;
+        sub.session = req->session;
+        sub.nested = true;
+
+        if(op.msg_type == MSG_READ)
+        {
+            struct netfs_read_args read_args;
+            memcpy(&read_args, sub.payload, sizeof(struct netfs_read_args));
+            if(read_args.handle == 0)
+                read_args.handle = last_handle;
+            if(read_args.size > NETFS_COMPOUND_MAX_READ)
+                read_args.size = NETFS_COMPOUND_MAX_READ;
+            memcpy(sub.payload, &read_args, sizeof(struct netfs_read_args));
+        }
+        else if(op.msg_type == MSG_RELEASE)
+        {
+            struct netfs_release_args release_args;
+            memcpy(&release_args, sub.payload, sizeof(struct netfs_release_args));
+            if(release_args.handle == 0)
+                release_args.handle = last_handle;
+            memcpy(sub.payload, &release_args, sizeof(struct netfs_release_args));
+        }
+
+        // An OPEN that sent the whole file leaves no handle to use
+        uint64_t handle = 0;
+        if(op.msg_type == MSG_READ)
+            memcpy(&handle, sub.payload + offsetof(struct netfs_read_args, handle),
+                    sizeof(uint64_t));
+        else if(op.msg_type == MSG_RELEASE)
+            memcpy(&handle, sub.payload + offsetof(struct netfs_release_args, handle),
+                    sizeof(uint64_t));
+
+        // RELEASE and FORGET reply with nothing, and still run so the
+        // compound leaves nothing open behind it
+        if(reply->len >= NETFS_COMPOUND_MAX_REPLY && op.msg_type != MSG_RELEASE
+                && op.msg_type != MSG_FORGET)
+            sub_reply.status = E2BIG;
+        else if((op.msg_type == MSG_READ || op.msg_type == MSG_RELEASE) && handle == 0)
+            sub_reply.status = EBADF;
+        else
+            res = handle_request(&sub, &sub_reply);
+        if(res == -1 || (sub_reply.file_fd != -1 && reply_inline_file(&sub_reply) == -1))
+        {
+            res = -1;
+            break;
+        }
+
+        if(op.msg_type == MSG_OPEN && sub_reply.status == 0)
+        {
+            struct netfs_open_reply open_reply;
+            memcpy(&open_reply, sub_reply.buf, sizeof(struct netfs_open_reply));
+            last_handle = open_reply.handle;
+        }
+
+        struct netfs_compound_result result;
+        result.msg_type = op.msg_type;
+        result.status = sub_reply.status;
+        result.len = sub_reply.len;
+        if(reply_append(reply, &result, sizeof(struct netfs_compound_result)) == -1
+                || (sub_reply.len > 0
+                    && reply_append(reply, sub_reply.buf, sub_reply.len) == -1))
+        {
+            res = -1;
+            break;
+        }
+        reply_reset(&sub_reply);
     }
 
-    if (listen(socket_fd, 10) == -1) {
-        perror("listen");
-        return 1;
+    reply_free(&sub_reply);
+    return res;
+}
+
+/*
+ * Agrees to compress whichever of the replies the client asked for can be
+ * compressed, if we share a codec, to leases if changes to the export are
+ * being watched, and to node IDs if the client says who it is
+ */
+int hello_handler(struct netfs_request *req, struct netfs_reply *reply)
+{
+    // Compounds can't carry a MSG_HELLO, so this is the connection's own
+    assert(!req->nested);
+
+    struct netfs_hello_args args;
+    memcpy(&args, req->payload, sizeof(struct netfs_hello_args));
+
+    struct netfs_hello_args agreed = { 0 };
+    if(args.codecs & NETFS_CODEC_LZ4)
+    {
+        agreed.compress_types = args.compress_types & COMPRESSIBLE_TYPES;
+        agreed.codecs = NETFS_CODEC_LZ4;
     }
+    if((args.features & NETFS_FEATURE_LEASES) && meta_cache_enabled(&meta_cache))
+        agreed.features |= NETFS_FEATURE_LEASES;
 
-    LOG("Listening on port %d\n", port);
+    // A connection belongs to one client for good
+    struct netfs_session *session = req->session;
+    if((args.features & NETFS_FEATURE_NODES) && args.client_id != 0
+            && session->client_id == 0)
+    {
+        session->client_id = args.client_id;
+        node_client_attach(&nodes, args.client_id);
+    }
+    if((args.features & NETFS_FEATURE_NODES) && args.client_id != 0
+            && session->client_id == args.client_id)
+    {
+        agreed.features |= NETFS_FEATURE_NODES;
+        agreed.client_id = args.client_id;
+    }
+    LOG("HELLO: compressing types %#x, features %#x\n", agreed.compress_types,
+            agreed.features);
 
-    // Limit the maximum number of processes to avoid overwhelming the system
-    int num_processes = 0;
-    int max_processes = 4;
+    req->session->compress_types = agreed.compress_types;
+    req->session->adapt.min_rate = compress_min_rate;
+    req->session->leases = (agreed.features & NETFS_FEATURE_LEASES) != 0;
 
-    while(true) {
+    return reply_append(reply, &agreed, sizeof(agreed));
+}
 
-        if (num_processes < max_processes) {
-            int wstat;
-            int ret = waitpid(-1, &wstat, WNOHANG);
-            if (ret > 0) {
-                num_processes--;
-            }
-        } else {
-            int wstat;
-            wait(&wstat);
-            num_processes--;
-        }
+void session_closed(struct netfs_session *session)
+{
+    lease_forget(&leases, session);
+    if(session->client_id != 0)
+        node_client_detach(&nodes, session->client_id);
+}
 
-        struct sockaddr_storage client_addr = { 0 };
-        socklen_t slen = sizeof(client_addr);
+/*
+ * Recalls the leases on whatever the attribute cache saw change. When it
+ * drops everything, directories may have been renamed, so the paths of nodes
+ * aren't trusted either. Directory descriptors cached under a changed path
+ * are closed.
+ */
+static void path_changed(const char *path, void *arg)
+{
+    (void) arg;
+    dirfd_cache_invalidate(&dirfds, path);
+    if(path != NULL)
+        lease_break(&leases, path);
+    else
+    {
+        node_paths_moved(&nodes);
+        lease_break_all(&leases);
+    }
+}
 
+/*
+ * Directory descriptors are only cached under paths whose renames the
+ * attribute cache sees
+ */
+static bool watch_dir(const char *dir, void *arg)
+{
+    (void) arg;
+    return meta_cache_watch(&meta_cache, dir);
+}
 
-        int client_fd = accept(
-            socket_fd,
-            (struct sockaddr *) &client_addr,
-            &slen);
+/*
+ * Sends a snapshot of the server's metrics as Prometheus text
+ */
+int stats_handler(struct netfs_request *req, struct netfs_reply *reply)
+{
+    (void) req;
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if(out == NULL)
+    {
+        perror("open_memstream");
+        reply->status = ENOMEM;
+        return 0;
+    }
 
-        if (client_fd == -1) {
-            perror("accept");
-            return 1;
-        }
+    int res = 0;
+    bool written = stats_write(out) == 0;
+    fclose(out);
+    if(written)
+        res = reply_append(reply, text, len);
+    else
+        reply->status = ENOMEM;
+    free(text);
+    return res;
+}
+
+static void usage(char *argv[])
+{
+    fprintf(stderr, "usage: %s [options] <directory> [port]\n\n", argv[0]);
+    fprintf(stderr, "    -l <n>    Number of event loops (default: one per core)\n"
+                    "    -w <n>    Number of worker threads for file system calls\n"
+                    "              (default: %d per core)\n"
+                    "    -f <n>    Maximum number of files kept open for clients\n"
+                    "              (default: %d)\n"
+                    "    -i <n>    Send files of up to n bytes whole when they are\n"
+                    "              opened, 0 to never do so (default: %d, at most %d)\n"
+                    "    -u        Do socket I/O through io_uring, falling back to\n"
+                    "              epoll if the kernel can't\n"
+                    "    -z <n>    Only compress replies while compression runs faster\n"
+                    "              than n MiB/s, the speed of the link (default: 0,\n"
+                    "              whenever it saves space)\n"
+                    "    -a <n>    Cache the attributes of up to n paths, kept current\n"
+                    "              with inotify; 0 to stat every time, and to grant\n"
+                    "              clients no leases (default: %d)\n"
+                    "    -d <n>    Keep up to n directories open to resolve paths in,\n"
+                    "              0 to resolve every path from the export root;\n"
+                    "              needs the attribute cache (default: %d)\n"
+                    "    -m <n>    Keep the files read most mapped in up to n MiB\n"
+                    "              of memory and send reads of them from there;\n"
+                    "              0 to always read from the file (default: %d)\n",
+                    WORKERS_PER_CORE, DEFAULT_MAX_OPEN_FILES,
+                    DEFAULT_INLINE_THRESHOLD, NETFS_INLINE_MAX,
+                    DEFAULT_META_CACHE_ENTRIES, DEFAULT_DIRFD_CACHE_ENTRIES,
+                    DEFAULT_HOT_CACHE_MB);
+}
 
-        char remote_host[INET_ADDRSTRLEN];
-        inet_ntop(
-                client_addr.ss_family,
-                (void *) &(((struct sockaddr_in *) &client_addr)->sin_addr),
-                remote_host,
-                sizeof(remote_host));
-        LOG("Accepted connection from %s\n", remote_host);
-
-        pid_t pid = fork();
-        num_processes++;
-        if(pid == 0) 
+int main(int argc, char *argv[]) 
+{
+    int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_cores < 1)
+        num_cores = 1;
+
+    // One event loop per core; the kernel balances connections across them.
+    // Workers spend most of their time blocked on the disk, so run more of
+    // them than there are cores.
+    int num_loops = num_cores;
+    int num_workers = num_cores * WORKERS_PER_CORE;
+    int max_open_files = DEFAULT_MAX_OPEN_FILES;
+
+    int opt;
+    int inline_bytes = DEFAULT_INLINE_THRESHOLD;
+    bool use_uring = false;
+    int min_rate = 0;
+    int meta_entries = DEFAULT_META_CACHE_ENTRIES;
+    int dir_entries = DEFAULT_DIRFD_CACHE_ENTRIES;
+    int hot_mb = DEFAULT_HOT_CACHE_MB;
+    while((opt = getopt(argc, argv, "l:w:f:i:uz:a:d:m:")) != -1)
+    {
+        switch(opt)
         {
-            handle_request(client_fd);
-            close(client_fd);  
+            case 'l':
+                num_loops = atoi(optarg);
+                break;
+            case 'w':
+                num_workers = atoi(optarg);
+                break;
+            case 'f':
+                max_open_files = atoi(optarg);
+                break;
+            case 'i':
+                inline_bytes = atoi(optarg);
+                break;
+            case 'u':
+                use_uring = true;
+                break;
+            case 'z':
+                min_rate = atoi(optarg);
+                break;
+            case 'a':
+                meta_entries = atoi(optarg);
+                break;
+            case 'd':
+                dir_entries = atoi(optarg);
+                break;
+            case 'm':
+                hot_mb = atoi(optarg);
+                break;
+            default:
+                usage(argv);
+                return 1;
         }
+    }
 
+    // Change to directory provided
+    if(optind >= argc || num_loops < 1 || num_workers < 1 || max_open_files < 1
+            || inline_bytes < 0 || inline_bytes > NETFS_INLINE_MAX || min_rate < 0
+            || meta_entries < 0 || dir_entries < 0 || hot_mb < 0
+            || chdir(argv[optind]) == -1)
+    {
+        usage(argv);
+        return 1;
+    }
+    // Set port 
+    int port = DEFAULT_PORT;
+    if(optind + 1 < argc)
+        port = atoi(argv[optind + 1]);
+
+    server_uid = geteuid();
+    inline_threshold = inline_bytes;
+    compress_min_rate = min_rate;
+    handle_table_init(&handles, max_open_files, open_path);
+    hot_cache_init(&hot_cache, (size_t) hot_mb * 1024 * 1024);
+
+    // Clients hold every directory they have a node for open, so allow as
+    // many descriptors as we're let
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if(node_table_init(&nodes) == -1 || dirfd_cache_init(&dirfds, dir_entries) == -1)
+        return 1;
 
-        // close(client_fd);  
+    // The export is served uncached, and without leases, if inotify isn't
+    // available
+    lease_table_init(&leases, DEFAULT_MAX_LEASES);
+    if(meta_cache_init(&meta_cache, meta_entries, stat_to_attr) == -1)
+        LOG_WARN("%s\n", "Can't watch the export, not caching attributes");
+    meta_cache_listen(&meta_cache, path_changed, NULL);
+    dirfd_cache_watch(&dirfds, watch_dir, NULL);
 
-    }
+    // Writes to clients that went away must fail with EPIPE, not kill us
+    signal(SIGPIPE, SIG_IGN);
 
-    // close(socket_fd);
+    struct work_pool pool;
+    if(work_pool_init(&pool, num_workers) == -1)
+        return 1;
 
-    return 0;
+    if(event_loops_run(port, num_loops, &pool, use_uring) == -1)
+        return 1;
 
-} 
+    return 0;
+}
@@ -0,0 +1,247 @@
+#include "node_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "logging.h"
+#include "net.h"
+
+/* FNV-1a */
+static size_t hash_path(const char *path)
+{
+    size_t hash = 14695981039346656037ULL;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash % NODE_CACHE_BUCKETS;
+}
+
+static struct node_entry *find_node(struct node_cache *cache, uint64_t node)
+{
+    struct node_entry *entry = cache->by_node[node % NODE_CACHE_BUCKETS];
+    while (entry != NULL && entry->node != node) {
+        entry = entry->node_next;
+    }
+    return entry;
+}
+
+static struct node_entry *find_path(struct node_cache *cache, const char *path)
+{
+    struct node_entry *entry = cache->by_path[hash_path(path)];
+    while (entry != NULL && strcmp(entry->path, path) != 0) {
+        entry = entry->path_next;
+    }
+    return entry;
+}
+
+static void unhash_path(struct node_cache *cache, struct node_entry *entry)
+{
+    if (!entry->path_hashed) {
+        return;
+    }
+    struct node_entry **link = &cache->by_path[hash_path(entry->path)];
+    while (*link != entry) {
+        link = &(*link)->path_next;
+    }
+    *link = entry->path_next;
+    entry->path_next = NULL;
+    entry->path_hashed = false;
+}
+
+/*
+ * Makes entry the node found under its path, in place of whatever was
+ * before. Called with the lock held.
+ */
+static void hash_path_of(struct node_cache *cache, struct node_entry *entry)
+{
+    struct node_entry *old = find_path(cache, entry->path);
+    if (old != NULL) {
+        unhash_path(cache, old);
+    }
+    struct node_entry **bucket = &cache->by_path[hash_path(entry->path)];
+    entry->path_next = *bucket;
+    *bucket = entry;
+    entry->path_hashed = true;
+}
+
+static bool path_current(struct node_cache *cache, const struct node_entry *entry)
+{
+    return entry == &cache->root || (entry->path_hashed
+            && entry->path_generation == cache->path_generation);
+}
+
+/*
+ * Sets up the cache with just the export root, which the kernel never looks
+ * up or forgets
+ */
+void node_cache_init(struct node_cache *cache)
+{
+    memset(cache, 0, sizeof(struct node_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->root.node = NETFS_ROOT_NODE;
+    cache->root.path = "/";
+    cache->by_node[NETFS_ROOT_NODE % NODE_CACHE_BUCKETS] = &cache->root;
+    hash_path_of(cache, &cache->root);
+}
+
+/*
+ * Read before asking the server about a node, and handed to node_cache_add
+ * with what it answered
+ */
+uint64_t node_cache_generation(struct node_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    uint64_t generation = cache->path_generation;
+    pthread_mutex_unlock(&cache->lock);
+    return generation;
+}
+
+/*
+ * Copies the path of node into path, which holds MAXIMUM_PATH bytes, and
+ * says whether it is current. Returns 0, or -ESTALE if the node isn't known.
+ */
+int node_cache_path(struct node_cache *cache, uint64_t node, char *path, bool *current)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct node_entry *entry = find_node(cache, node);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&cache->lock);
+        return -ESTALE;
+    }
+    snprintf(path, MAXIMUM_PATH, "%s", entry->path);
+    *current = path_current(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+/*
+ * Finds the node last found under path, current or not
+ */
+bool node_cache_find(struct node_cache *cache, const char *path, uint64_t *node)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct node_entry *entry = find_path(cache, path);
+    if (entry != NULL) {
+        *node = entry->node;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry != NULL;
+}
+
+/*
+ * Counts a kernel lookup of the node at path without asking the server, if
+ * path is current. Returns whether it was.
+ */
+bool node_cache_ref_path(struct node_cache *cache, const char *path, uint64_t *node)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct node_entry *entry = find_path(cache, path);
+    bool found = entry != NULL && entry != &cache->root && path_current(cache, entry);
+    if (found) {
+        entry->nlookup++;
+        *node = entry->node;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+/*
+ * Counts a kernel lookup of node, which the server just gave a reference to
+ * and found under path. current is whether the path it was found from was,
+ * and generation the cache's path generation from before the server was
+ * asked. Returns 0, or -ENOMEM if the node couldn't be kept, in which case
+ * the caller gives the reference back.
+ */
+int node_cache_add(struct node_cache *cache, uint64_t node, const char *path,
+        bool current, uint64_t generation)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct node_entry *entry = find_node(cache, node);
+    if (entry == &cache->root) {
+        // Reached through a symlink. The kernel never forgets the root, and
+        // the server never drops it, so neither count matters.
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(struct node_entry));
+        if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+            perror("malloc");
+            free(entry);
+            pthread_mutex_unlock(&cache->lock);
+            return -ENOMEM;
+        }
+        entry->node = node;
+        struct node_entry **bucket = &cache->by_node[node % NODE_CACHE_BUCKETS];
+        entry->node_next = *bucket;
+        *bucket = entry;
+        hash_path_of(cache, entry);
+    } else if (strcmp(entry->path, path) != 0) {
+        char *new_path = strdup(path);
+        if (new_path != NULL) {
+            unhash_path(cache, entry);
+            free(entry->path);
+            entry->path = new_path;
+            hash_path_of(cache, entry);
+        } else {
+            unhash_path(cache, entry);
+        }
+    } else if (!entry->path_hashed) {
+        hash_path_of(cache, entry);
+    }
+
+    entry->path_generation = current ? generation : generation - 1;
+    entry->nlookup++;
+    entry->server_refs++;
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+/*
+ * Drops nlookup of the kernel's lookups of node. Once the kernel has none
+ * left, the node is forgotten here too, and the number of references to give
+ * back to the server is returned; otherwise 0.
+ */
+uint64_t node_cache_forget(struct node_cache *cache, uint64_t node, uint64_t nlookup)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct node_entry *entry = find_node(cache, node);
+    if (entry == NULL || entry == &cache->root) {
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    entry->nlookup -= nlookup < entry->nlookup ? nlookup : entry->nlookup;
+    if (entry->nlookup > 0) {
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    struct node_entry **link = &cache->by_node[node % NODE_CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->node_next;
+    }
+    *link = entry->node_next;
+    unhash_path(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+
+    uint64_t server_refs = entry->server_refs;
+    free(entry->path);
+    free(entry);
+    return server_refs;
+}
+
+/*
+ * Stops trusting every path found so far, after the server recalled all
+ * leases
+ */
+void node_cache_paths_moved(struct node_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->path_generation++;
+    pthread_mutex_unlock(&cache->lock);
+}
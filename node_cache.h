@@ -0,0 +1,58 @@
+/**
+ * node_cache.h
+ *
+ * Client-side table of the server's node IDs the kernel knows about. The
+ * kernel's inode numbers are the node IDs themselves, so nothing has to be
+ * translated on the way to the server. What is kept here is each node's
+ * path, which the attribute and block caches are keyed by, and two counts:
+ * the kernel's lookups, which say when it has forgotten the node, and the
+ * references the client holds on the server. The two differ because lookups
+ * answered from the attribute cache take no reference on the server; all of
+ * them are given back with one MSG_FORGET once the kernel forgets the node.
+ *
+ * Paths are trusted the way the server trusts them. A node's path is current
+ * if it was found through current paths all the way down from the root, and
+ * every path stops being current when the server recalls all leases, which it
+ * does when directories may have been renamed. Only current paths are used to
+ * look things up in the attribute cache.
+ */
+
+#ifndef _NODE_CACHE_H_
+#define _NODE_CACHE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NODE_CACHE_BUCKETS 16384
+
+struct node_entry {
+    uint64_t node;
+    char *path;
+    uint64_t path_generation;   /* Cache's path generation when path was found */
+    bool path_hashed;           /* Still the node found under path */
+    uint64_t nlookup;           /* Kernel lookups not yet forgotten */
+    uint64_t server_refs;       /* References held on the server */
+    struct node_entry *node_next;
+    struct node_entry *path_next;
+};
+
+struct node_cache {
+    pthread_mutex_t lock;
+    uint64_t path_generation;   /* Bumped whenever paths may have moved */
+    struct node_entry root;
+    struct node_entry *by_node[NODE_CACHE_BUCKETS];
+    struct node_entry *by_path[NODE_CACHE_BUCKETS];
+};
+
+void node_cache_init(struct node_cache *cache);
+uint64_t node_cache_generation(struct node_cache *cache);
+int node_cache_path(struct node_cache *cache, uint64_t node, char *path, bool *current);
+bool node_cache_find(struct node_cache *cache, const char *path, uint64_t *node);
+bool node_cache_ref_path(struct node_cache *cache, const char *path, uint64_t *node);
+int node_cache_add(struct node_cache *cache, uint64_t node, const char *path,
+        bool current, uint64_t generation);
+uint64_t node_cache_forget(struct node_cache *cache, uint64_t node, uint64_t nlookup);
+void node_cache_paths_moved(struct node_cache *cache);
+
+#endif
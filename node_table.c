@@ -0,0 +1,429 @@
+#define _GNU_SOURCE
+
+#include "node_table.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "net.h"
+
+static struct node **id_bucket(struct node_table *table, uint64_t id)
+{
+    return &table->by_id[id % NODE_TABLE_BUCKETS];
+}
+
+static struct node **ino_bucket(struct node_table *table, dev_t dev, ino_t ino)
+{
+    uint64_t hash = ((uint64_t) dev * 1099511628211ULL) ^ (uint64_t) ino;
+    return &table->by_ino[hash % NODE_TABLE_BUCKETS];
+}
+
+static struct node *find_id(struct node_table *table, uint64_t id)
+{
+    struct node *node = *id_bucket(table, id);
+    while (node != NULL && node->id != id) {
+        node = node->id_next;
+    }
+    return node;
+}
+
+static struct node *find_ino(struct node_table *table, dev_t dev, ino_t ino)
+{
+    struct node *node = *ino_bucket(table, dev, ino);
+    while (node != NULL && (node->dev != dev || node->ino != ino)) {
+        node = node->ino_next;
+    }
+    return node;
+}
+
+static void insert_node(struct node_table *table, struct node *node)
+{
+    struct node **bucket = id_bucket(table, node->id);
+    node->id_next = *bucket;
+    *bucket = node;
+    bucket = ino_bucket(table, node->dev, node->ino);
+    node->ino_next = *bucket;
+    *bucket = node;
+    table->count++;
+}
+
+/*
+ * Frees node if nothing holds it any more, and then its parent, which it was
+ * holding, the same way. Called with the lock held.
+ */
+static void maybe_free(struct node_table *table, struct node *node)
+{
+    while (node != NULL && node != &table->root && node->pins == 0 && node->refs == NULL) {
+        struct node **link = id_bucket(table, node->id);
+        while (*link != node) {
+            link = &(*link)->id_next;
+        }
+        *link = node->id_next;
+        link = ino_bucket(table, node->dev, node->ino);
+        while (*link != node) {
+            link = &(*link)->ino_next;
+        }
+        *link = node->ino_next;
+        table->count--;
+
+        LOG("Dropping node %llu (%s)\n", (unsigned long long) node->id, node->path);
+        struct node *parent = node->parent;
+        if (node->fd != -1) {
+            close(node->fd);
+        }
+        free(node->name);
+        free(node->path);
+        free(node);
+
+        node = parent;
+        if (node != NULL) {
+            node->pins--;
+        }
+    }
+}
+
+static void unpin(struct node_table *table, struct node *node)
+{
+    if (node != NULL) {
+        node->pins--;
+        maybe_free(table, node);
+    }
+}
+
+/*
+ * Sets up the table with just the export root, which must be the current
+ * directory. Returns -1 if it can't be opened.
+ */
+int node_table_init(struct node_table *table)
+{
+    memset(table, 0, sizeof(struct node_table));
+    pthread_mutex_init(&table->lock, NULL);
+
+    // Start numbering from the clock so IDs given out by an earlier run of
+    // the server don't match any of ours, and fail with ESTALE instead
+    table->next_id = (uint64_t) time(NULL) << 24;
+
+    struct node *root = &table->root;
+    struct stat stbuf;
+    root->fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root->fd == -1 || fstat(root->fd, &stbuf) == -1) {
+        perror("open");
+        return -1;
+    }
+    root->id = NETFS_ROOT_NODE;
+    root->dev = stbuf.st_dev;
+    root->ino = stbuf.st_ino;
+    root->name = strdup("");
+    root->path = strdup("/");
+    root->pins = 1;
+    if (root->name == NULL || root->path == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    insert_node(table, root);
+    return 0;
+}
+
+/*
+ * Finds node id and fills in ref for using it. Returns 0, or -ESTALE if no
+ * such node is known.
+ */
+int node_get(struct node_table *table, uint64_t id, struct node_ref *ref)
+{
+    pthread_mutex_lock(&table->lock);
+    struct node *node = find_id(table, id);
+    if (node == NULL) {
+        pthread_mutex_unlock(&table->lock);
+        return -ESTALE;
+    }
+    node->pins++;
+    if (node->parent != NULL) {
+        node->parent->pins++;
+    }
+    ref->node = node;
+    ref->parent = node->parent;
+    snprintf(ref->name, sizeof(ref->name), "%s", node->name);
+    snprintf(ref->path, sizeof(ref->path), "%s", node->path);
+    ref->path_current = node == &table->root
+            || node->path_generation == table->path_generation;
+    pthread_mutex_unlock(&table->lock);
+    return 0;
+}
+
+/*
+ * Lets go of a node got with node_get
+ */
+void node_put(struct node_table *table, struct node_ref *ref)
+{
+    pthread_mutex_lock(&table->lock);
+    unpin(table, ref->node);
+    unpin(table, ref->parent);
+    pthread_mutex_unlock(&table->lock);
+    ref->node = NULL;
+    ref->parent = NULL;
+}
+
+/*
+ * Records that a node was found as name in directory dir and under client
+ * path, unless that would make it its own ancestor. Called with the lock
+ * held.
+ */
+static void move_node(struct node_table *table, struct node *node, struct node *dir,
+        const char *name, const char *path, bool path_current)
+{
+    if (node == &table->root) {
+        return;
+    }
+    for (struct node *ancestor = dir; ancestor != NULL; ancestor = ancestor->parent) {
+        if (ancestor == node) {
+            return;
+        }
+    }
+
+    if (node->parent != dir || strcmp(node->name, name) != 0) {
+        char *new_name = strdup(name);
+        if (new_name == NULL) {
+            return;
+        }
+        free(node->name);
+        node->name = new_name;
+        dir->pins++;
+        struct node *old_parent = node->parent;
+        node->parent = dir;
+        unpin(table, old_parent);
+    }
+    if (strcmp(node->path, path) != 0) {
+        char *new_path = strdup(path);
+        if (new_path == NULL) {
+            node->path_generation = table->path_generation - 1;
+            return;
+        }
+        free(node->path);
+        node->path = new_path;
+    }
+    node->path_generation = table->path_generation - (path_current ? 0 : 1);
+}
+
+/*
+ * Gives client a reference to the file with inode number ino, just stat'ed
+ * as name in directory dir, and returns its node ID in id. path is its
+ * client path, and path_current whether that can be trusted. Directories are
+ * opened here, and fail with ESTALE if what is at name was replaced since it
+ * was stat'ed; other files are taken to be on their directory's device.
+ * Returns 0 or a negative errno.
+ */
+int node_lookup(struct node_table *table, uint64_t client, struct node_ref *dir,
+        const char *name, const char *path, bool path_current, ino_t ino, bool is_dir,
+        uint64_t *id)
+{
+    dev_t dev = dir->node->dev;
+    int fd = -1;
+
+    if (is_dir) {
+        struct stat stbuf;
+        fd = openat(dir->node->fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            return -errno;
+        }
+        if (fstat(fd, &stbuf) == -1 || stbuf.st_ino != ino) {
+            close(fd);
+            return -ESTALE;
+        }
+        dev = stbuf.st_dev;
+    }
+
+    pthread_mutex_lock(&table->lock);
+    struct node *node = find_ino(table, dev, ino);
+    if (node == NULL) {
+        node = calloc(1, sizeof(struct node));
+        if (node == NULL || (node->name = strdup(name)) == NULL
+                || (node->path = strdup(path)) == NULL) {
+            if (node != NULL) {
+                free(node->name);
+            }
+            free(node);
+            pthread_mutex_unlock(&table->lock);
+            if (fd != -1) {
+                close(fd);
+            }
+            return -ENOMEM;
+        }
+        node->id = table->next_id++;
+        node->dev = dev;
+        node->ino = ino;
+        node->fd = fd;
+        fd = -1;
+        node->parent = dir->node;
+        dir->node->pins++;
+        node->path_generation = table->path_generation - (path_current ? 0 : 1);
+        insert_node(table, node);
+    } else {
+        move_node(table, node, dir->node, name, path, path_current);
+    }
+
+    struct node_ref_count *ref = node->refs;
+    while (ref != NULL && ref->client != client) {
+        ref = ref->next;
+    }
+    if (ref == NULL && (ref = calloc(1, sizeof(struct node_ref_count))) != NULL) {
+        ref->client = client;
+        ref->next = node->refs;
+        node->refs = ref;
+    }
+    int res = 0;
+    if (ref != NULL) {
+        ref->count++;
+        *id = node->id;
+    } else {
+        res = -ENOMEM;
+        maybe_free(table, node);
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    if (fd != -1) {
+        close(fd);
+    }
+    return res;
+}
+
+/*
+ * Drops count of client's references to node id. Unknown nodes and
+ * references are ignored.
+ */
+void node_forget(struct node_table *table, uint64_t client, uint64_t id, uint64_t count)
+{
+    pthread_mutex_lock(&table->lock);
+    struct node *node = find_id(table, id);
+    struct node_ref_count **link = node != NULL ? &node->refs : NULL;
+    while (link != NULL && *link != NULL && (*link)->client != client) {
+        link = &(*link)->next;
+    }
+    if (link != NULL && *link != NULL) {
+        struct node_ref_count *ref = *link;
+        ref->count -= count < ref->count ? count : ref->count;
+        if (ref->count == 0) {
+            *link = ref->next;
+            free(ref);
+            maybe_free(table, node);
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Counts a new connection of client
+ */
+void node_client_attach(struct node_table *table, uint64_t client)
+{
+    pthread_mutex_lock(&table->lock);
+    struct node_client *entry = table->clients;
+    while (entry != NULL && entry->id != client) {
+        entry = entry->next;
+    }
+    if (entry == NULL && (entry = calloc(1, sizeof(struct node_client))) != NULL) {
+        entry->id = client;
+        entry->next = table->clients;
+        table->clients = entry;
+    }
+    if (entry != NULL) {
+        entry->connections++;
+    } else {
+        perror("calloc");
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Drops client's reference to every node it holds, pinning those left
+ * without references and adding them to unreferenced, so freeing one can't
+ * free another the walk is still to reach. A node that can't be added is
+ * freed straight away instead, which may free others around it, so this
+ * returns false to be called again. Called with the lock held.
+ */
+static bool drop_client_refs(struct node_table *table, uint64_t client,
+        struct node ***unreferenced, size_t *count, size_t *cap)
+{
+    for (int i = 0; i < NODE_TABLE_BUCKETS; i++) {
+        for (struct node *node = table->by_id[i]; node != NULL; node = node->id_next) {
+            struct node_ref_count **ref = &node->refs;
+            while (*ref != NULL && (*ref)->client != client) {
+                ref = &(*ref)->next;
+            }
+            if (*ref == NULL) {
+                continue;
+            }
+            struct node_ref_count *dropped = *ref;
+            *ref = dropped->next;
+            free(dropped);
+            if (node->refs != NULL) {
+                continue;
+            }
+
+            if (*count == *cap) {
+                size_t new_cap = *cap > 0 ? *cap * 2 : 64;
+                struct node **grown = realloc(*unreferenced, new_cap * sizeof(struct node *));
+                if (grown == NULL) {
+                    perror("realloc");
+                    maybe_free(table, node);
+                    return false;
+                }
+                *unreferenced = grown;
+                *cap = new_cap;
+            }
+            node->pins++;
+            (*unreferenced)[(*count)++] = node;
+        }
+    }
+    return true;
+}
+
+/*
+ * Counts a connection of client closing. With the last one gone, all of the
+ * client's references are dropped.
+ */
+void node_client_detach(struct node_table *table, uint64_t client)
+{
+    pthread_mutex_lock(&table->lock);
+    struct node_client **link = &table->clients;
+    while (*link != NULL && (*link)->id != client) {
+        link = &(*link)->next;
+    }
+    struct node_client *entry = *link;
+    if (entry == NULL || --entry->connections > 0) {
+        pthread_mutex_unlock(&table->lock);
+        return;
+    }
+    *link = entry->next;
+    free(entry);
+
+    struct node **unreferenced = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    while (!drop_client_refs(table, client, &unreferenced, &count, &cap)) {
+        // Freed a node it couldn't pin; the walk starts over
+    }
+    for (size_t i = 0; i < count; i++) {
+        unpin(table, unreferenced[i]);
+    }
+    LOG("Client %llx gone, %zu nodes left\n", (unsigned long long) client, table->count);
+    pthread_mutex_unlock(&table->lock);
+    free(unreferenced);
+}
+
+/*
+ * Stops trusting every client path known so far, after directories were
+ * renamed
+ */
+void node_paths_moved(struct node_table *table)
+{
+    pthread_mutex_lock(&table->lock);
+    table->path_generation++;
+    pthread_mutex_unlock(&table->lock);
+}
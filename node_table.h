@@ -0,0 +1,100 @@
+/**
+ * node_table.h
+ *
+ * Server-side table of the node IDs handed out by MSG_LOOKUP. A node is a
+ * file found by (st_dev, st_ino), so the same file always gets the same ID
+ * while it is referenced, wherever it was found. Directories are held open
+ * with an O_PATH descriptor, which follows them through renames and lets
+ * their entries be stat'ed and opened without walking a path; other files
+ * are reached as a name in the directory they were last found in, and are
+ * checked to still be the same inode when they are.
+ *
+ * Each node also keeps the client path it was last found under, which is
+ * what the attribute cache and leases are keyed by. Renamed directories
+ * change the paths of everything below them, so when the attribute cache
+ * says directories were renamed, every path known so far stops being
+ * trusted until its node is looked up again.
+ *
+ * References are counted per client, not per connection, so one connection
+ * can forget what another looked up. A client's references all go when its
+ * last connection closes, and a node goes once no client references it and
+ * no request is using it.
+ */
+
+#ifndef _NODE_TABLE_H_
+#define _NODE_TABLE_H_
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+#define NODE_TABLE_BUCKETS 65536
+
+/* One client's lookups of a node */
+struct node_ref_count {
+    uint64_t client;
+    uint64_t count;
+    struct node_ref_count *next;
+};
+
+struct node {
+    uint64_t id;
+    dev_t dev;
+    ino_t ino;
+    int fd;                     /* O_PATH descriptor of a directory, else -1 */
+    struct node *parent;        /* Directory last found in; NULL for the root */
+    char *name;                 /* Name in parent */
+    char *path;                 /* Client path last found under */
+    uint64_t path_generation;   /* Table's path generation when path was set */
+    struct node_ref_count *refs;
+    unsigned pins;              /* Requests using it, and children */
+    struct node *id_next;
+    struct node *ino_next;
+};
+
+/* A client with connections open */
+struct node_client {
+    uint64_t id;
+    unsigned connections;
+    struct node_client *next;
+};
+
+struct node_table {
+    pthread_mutex_t lock;
+    uint64_t next_id;
+    uint64_t path_generation;   /* Bumped whenever paths may have moved */
+    size_t count;
+    struct node root;
+    struct node *by_id[NODE_TABLE_BUCKETS];
+    struct node *by_ino[NODE_TABLE_BUCKETS];
+    struct node_client *clients;
+};
+
+/*
+ * What a request needs of a node, copied out under the lock. node and parent
+ * are pinned until node_put(), so their descriptors stay open.
+ */
+struct node_ref {
+    struct node *node;
+    struct node *parent;        /* NULL for the root */
+    char name[NAME_MAX + 1];
+    char path[MAXIMUM_PATH];
+    bool path_current;          /* path still names the node, as far as is known */
+};
+
+int node_table_init(struct node_table *table);
+int node_get(struct node_table *table, uint64_t id, struct node_ref *ref);
+void node_put(struct node_table *table, struct node_ref *ref);
+int node_lookup(struct node_table *table, uint64_t client, struct node_ref *dir,
+        const char *name, const char *path, bool path_current, ino_t ino, bool is_dir,
+        uint64_t *id);
+void node_forget(struct node_table *table, uint64_t client, uint64_t id, uint64_t count);
+void node_client_attach(struct node_table *table, uint64_t client);
+void node_client_detach(struct node_table *table, uint64_t client);
+void node_paths_moved(struct node_table *table);
+
+#endif
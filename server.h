@@ -0,0 +1,107 @@
+/**
+ * server.h
+ *
+ * Types shared between the netfs server's connection engine and its request
+ * handlers. The engine parses a complete request off the wire, a handler turns
+ * it into a reply, and the engine writes the reply back without blocking.
+ * Requests from one connection may be handled by several workers at once.
+ */
+
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "compress.h"
+#include "net.h"
+
+struct lease;
+
+/*
+ * What a connection has negotiated with MSG_HELLO. Owned by the engine, one
+ * per connection, and filled in by the handler.
+ */
+struct netfs_session {
+    uint32_t compress_types;    /* Bit (1 << type) for compressed replies */
+    struct compress_adapt adapt;
+    bool leases;                /* Gets a lease with every MSG_GETATTR */
+    struct lease *leases_held;  /* Guarded by the lease table's lock */
+    uint64_t client_id;         /* Node references are counted against; 0 for none */
+};
+
+/*
+ * A fully received request: header, path, any fixed-size arguments and, for
+ * compound requests, the variable-length body. The body buffer belongs to the
+ * engine and is kept from one request to the next. session is that of the
+ * connection the request came in on. Operations inside a compound have nested
+ * set, and their replies aren't compressed on their own.
+ */
+struct netfs_request {
+    struct netfs_session *session;
+    bool nested;
+    struct netfs_msg_header header;
+    char path[MAXIMUM_PATH];
+    char payload[NETFS_MAX_PAYLOAD];
+    char *body;
+    size_t body_len;
+    size_t body_cap;
+};
+
+/*
+ * Reply under construction. The bytes in buf are sent first, followed by
+ * file_len bytes of file data: from file_fd starting at file_offset (sent
+ * with sendfile()), or from mapped memory at file_data (handed to the socket
+ * with vmsplice()), which is let go of by calling file_done on file_done_arg
+ * once sent. The engine puts a struct netfs_reply_header at the front of buf
+ * before the handler runs and fills it in afterwards; handlers append the
+ * body and set status to an errno if the request failed.
+ */
+struct netfs_reply {
+    int32_t status;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t sent;
+    int file_fd;
+    off_t file_offset;
+    size_t file_len;
+    const char *file_data;
+    void (*file_done)(void *arg);
+    void *file_done_arg;
+};
+
+void reply_init(struct netfs_reply *reply);
+void reply_reset(struct netfs_reply *reply);
+void reply_free(struct netfs_reply *reply);
+int reply_append(struct netfs_reply *reply, const void *data, size_t len);
+void reply_sendfile(struct netfs_reply *reply, int fd, off_t offset, size_t len);
+void reply_send_mapped(struct netfs_reply *reply, const char *data, size_t len,
+        void (*done)(void *arg), void *arg);
+
+/*
+ * Builds the reply for one request. Returns -1 if the connection should be
+ * closed instead of answered.
+ */
+int handle_request(struct netfs_request *req, struct netfs_reply *reply);
+
+/*
+ * Queues a message the client didn't ask for (a struct netfs_push and what
+ * follows it) on the session's connection, from any thread, to be sent after
+ * the replies already finished. The caller must know the session is still
+ * there: it is until session_closed() has returned for it. Pushes to a
+ * connection that already closed are dropped. If the message can't be
+ * queued the connection is shut down, and -1 returned.
+ */
+int session_push(struct netfs_session *session, const void *body, size_t len);
+
+/*
+ * Called by the engine on the loop thread once a connection has closed and
+ * none of its requests are being handled any more, to release what handlers
+ * keep for it.
+ */
+void session_closed(struct netfs_session *session);
+
+#endif
@@ -0,0 +1,241 @@
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "net.h"
+
+/* Labels for the message types, by number */
+static const char *op_names[STATS_MSG_TYPES] = {
+    [MSG_READDIR] = "readdir",
+    [MSG_GETATTR] = "getattr",
+    [MSG_OPEN] = "open",
+    [MSG_READ] = "read",
+    [MSG_READDIRPLUS] = "readdirplus",
+    [MSG_RELEASE] = "release",
+    [MSG_COMPOUND] = "compound",
+    [MSG_HELLO] = "hello",
+    [MSG_STATS] = "stats",
+    [MSG_LOOKUP] = "lookup",
+    [MSG_FORGET] = "forget",
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} timer_info[NUM_TIMERS] = {
+    [TIMER_QUEUE_WAIT] = { "netfs_queue_wait_seconds",
+        "Time requests wait for a worker" },
+    [TIMER_STAT] = { "netfs_stat_seconds",
+        "Time to look up attributes for MSG_GETATTR and MSG_LOOKUP, cached or not" },
+    [TIMER_OPEN] = { "netfs_open_seconds", "Time spent opening files for MSG_OPEN" },
+    [TIMER_SENDFILE] = { "netfs_sendfile_seconds",
+        "Time spent in each sendfile() of file data, without io_uring" },
+};
+
+/* Quantile 1 is the largest value seen */
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+
+/* Every thread's block, newest first. Blocks are never freed. */
+static struct thread_stats *all_stats;
+
+static __thread struct thread_stats *my_stats;
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Returns the calling thread's block, making and publishing it the first
+ * time. Returns NULL if there is no memory for it, and the thread's metrics
+ * go uncounted.
+ */
+static struct thread_stats *thread_stats(void)
+{
+    if (my_stats != NULL) {
+        return my_stats;
+    }
+
+    struct thread_stats *stats = calloc(1, sizeof(struct thread_stats));
+    if (stats == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    stats->next = __atomic_load_n(&all_stats, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&all_stats, &stats->next, stats, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        ;
+    }
+    my_stats = stats;
+    return stats;
+}
+
+/* Counters have one writer each, like the histograms */
+static void count(uint64_t *counter, uint64_t value)
+{
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Records a request that was handled in ns nanoseconds and answered with
+ * bytes of reply
+ */
+void stats_request(uint16_t type, int32_t status, size_t bytes, uint64_t ns)
+{
+    struct thread_stats *stats = thread_stats();
+    if (stats == NULL || type >= STATS_MSG_TYPES) {
+        return;
+    }
+
+    struct op_stats *op = &stats->ops[type];
+    count(&op->requests, 1);
+    if (status != 0) {
+        count(&op->errors, 1);
+    }
+    count(&op->bytes_sent, bytes);
+    histogram_record(&op->latency, ns);
+}
+
+void stats_time(enum stats_timer timer, uint64_t ns)
+{
+    struct thread_stats *stats = thread_stats();
+    if (stats != NULL) {
+        histogram_record(&stats->timers[timer], ns);
+    }
+}
+
+void stats_conn_opened(void)
+{
+    struct thread_stats *stats = thread_stats();
+    if (stats != NULL) {
+        count(&stats->conns_opened, 1);
+    }
+}
+
+void stats_conn_closed(void)
+{
+    struct thread_stats *stats = thread_stats();
+    if (stats != NULL) {
+        count(&stats->conns_closed, 1);
+    }
+}
+
+static uint64_t load(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*
+ * Writes one summary series: the quantiles, sum and count. labels is the
+ * series' own labels, each followed by a comma, or "".
+ */
+static void write_summary(FILE *out, const char *name, const char *labels,
+        const struct histogram *hist)
+{
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        fprintf(out, "%s{%squantile=\"%g\"} %.9f\n", name, labels, quantiles[i],
+                histogram_percentile(hist, quantiles[i] * 100.0) / 1e9);
+    }
+
+    // The same labels again without the trailing comma
+    int labels_len = strlen(labels);
+    if (labels_len > 0) {
+        fprintf(out, "%s_sum{%.*s} %.9f\n", name, labels_len - 1, labels, hist->sum / 1e9);
+        fprintf(out, "%s_count{%.*s} %llu\n", name, labels_len - 1, labels,
+                (unsigned long long) hist->total);
+    } else {
+        fprintf(out, "%s_sum %.9f\n", name, hist->sum / 1e9);
+        fprintf(out, "%s_count %llu\n", name, (unsigned long long) hist->total);
+    }
+}
+
+/*
+ * Writes a snapshot of the metrics of all threads, added up, to out. Threads
+ * carry on recording while it is taken. Returns -1 if there isn't the memory
+ * to add them up.
+ */
+int stats_write(FILE *out)
+{
+    struct thread_stats *total = calloc(1, sizeof(struct thread_stats));
+    if (total == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    struct thread_stats *stats = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE);
+    for (; stats != NULL; stats = stats->next) {
+        for (int type = 0; type < STATS_MSG_TYPES; type++) {
+            total->ops[type].requests += load(&stats->ops[type].requests);
+            total->ops[type].errors += load(&stats->ops[type].errors);
+            total->ops[type].bytes_sent += load(&stats->ops[type].bytes_sent);
+            histogram_merge(&total->ops[type].latency, &stats->ops[type].latency);
+        }
+        for (int timer = 0; timer < NUM_TIMERS; timer++) {
+            histogram_merge(&total->timers[timer], &stats->timers[timer]);
+        }
+        total->conns_opened += load(&stats->conns_opened);
+        total->conns_closed += load(&stats->conns_closed);
+    }
+
+    fprintf(out, "# HELP netfs_connections_active Clients connected\n");
+    fprintf(out, "# TYPE netfs_connections_active gauge\n");
+    fprintf(out, "netfs_connections_active %llu\n",
+            (unsigned long long) (total->conns_opened - total->conns_closed));
+    fprintf(out, "# HELP netfs_connections_total Clients accepted\n");
+    fprintf(out, "# TYPE netfs_connections_total counter\n");
+    fprintf(out, "netfs_connections_total %llu\n",
+            (unsigned long long) total->conns_opened);
+
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } counters[] = {
+        { "netfs_requests_total", "Requests handled",
+            offsetof(struct op_stats, requests) },
+        { "netfs_request_errors_total", "Requests answered with an error",
+            offsetof(struct op_stats, errors) },
+        { "netfs_reply_bytes_total", "Bytes of replies",
+            offsetof(struct op_stats, bytes_sent) },
+    };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        fprintf(out, "# HELP %s %s\n", counters[i].name, counters[i].help);
+        fprintf(out, "# TYPE %s counter\n", counters[i].name);
+        for (int type = 0; type < STATS_MSG_TYPES; type++) {
+            if (op_names[type] == NULL) {
+                continue;
+            }
+            uint64_t value;
+            memcpy(&value, (char *) &total->ops[type] + counters[i].offset,
+                    sizeof(uint64_t));
+            fprintf(out, "%s{op=\"%s\"} %llu\n", counters[i].name, op_names[type],
+                    (unsigned long long) value);
+        }
+    }
+
+    fprintf(out, "# HELP netfs_request_seconds Time to handle requests\n");
+    fprintf(out, "# TYPE netfs_request_seconds summary\n");
+    for (int type = 0; type < STATS_MSG_TYPES; type++) {
+        if (op_names[type] == NULL) {
+            continue;
+        }
+        char labels[64];
+        snprintf(labels, sizeof(labels), "op=\"%s\",", op_names[type]);
+        write_summary(out, "netfs_request_seconds", labels, &total->ops[type].latency);
+    }
+
+    for (int timer = 0; timer < NUM_TIMERS; timer++) {
+        fprintf(out, "# HELP %s %s\n", timer_info[timer].name, timer_info[timer].help);
+        fprintf(out, "# TYPE %s summary\n", timer_info[timer].name);
+        write_summary(out, timer_info[timer].name, "", &total->timers[timer]);
+    }
+
+    free(total);
+    return 0;
+}
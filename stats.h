@@ -0,0 +1,57 @@
+/**
+ * stats.h
+ *
+ * Server metrics. Every thread that records something gets its own block of
+ * counters and latency histograms the first time it does, so recording is a
+ * few plain stores with no locking or shared cache lines. A snapshot walks
+ * the blocks of all threads and adds them up while they keep being written
+ * to, and is formatted in the Prometheus text exposition format.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "histogram.h"
+
+/* Message types tracked, indexed by type; higher ones aren't counted */
+#define STATS_MSG_TYPES 16
+
+/* Times measured inside request handling, in nanoseconds */
+enum stats_timer {
+    TIMER_QUEUE_WAIT,   /* Parsed until a worker picks the request up */
+    TIMER_STAT,         /* Attribute lookup for MSG_GETATTR and MSG_LOOKUP */
+    TIMER_OPEN,         /* Opening the file for MSG_OPEN */
+    TIMER_SENDFILE,     /* Each sendfile() of file data (epoll engine) */
+    NUM_TIMERS
+};
+
+struct op_stats {
+    uint64_t requests;
+    uint64_t errors;            /* Answered with a non-zero status */
+    uint64_t bytes_sent;        /* Reply headers and bodies */
+    struct histogram latency;   /* Handling, from worker pickup to reply */
+};
+
+/* One thread's share of the metrics. Only that thread writes to it. */
+struct thread_stats {
+    struct op_stats ops[STATS_MSG_TYPES];
+    struct histogram timers[NUM_TIMERS];
+    uint64_t conns_opened;
+    uint64_t conns_closed;
+    struct thread_stats *next;
+};
+
+uint64_t stats_now(void);
+
+void stats_request(uint16_t type, int32_t status, size_t bytes, uint64_t ns);
+void stats_time(enum stats_timer timer, uint64_t ns);
+void stats_conn_opened(void);
+void stats_conn_closed(void);
+
+int stats_write(FILE *out);
+
+#endif
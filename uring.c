@@ -0,0 +1,236 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+            NULL, 0);
+}
+
+/*
+ * Sets up a ring with room for entries submissions at a time and cq_entries
+ * completions waiting to be reaped. Returns -1 if the kernel doesn't support
+ * io_uring or won't let us use it.
+ */
+int uring_init(struct uring *ring, unsigned entries, unsigned cq_entries)
+{
+    memset(ring, 0, sizeof(struct uring));
+
+    // Cooperative task running saves an interrupt per completion where the
+    // kernel has it
+    struct io_uring_params params = { 0 };
+    params.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+        ring->fd = sys_io_uring_setup(entries, &params);
+    }
+    if (ring->fd == -1) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes
+            + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        perror("mmap");
+        close(ring->fd);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            perror("mmap");
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("mmap");
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->sq_flags = (unsigned *) (sq + params.sq_off.flags);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cq_overflow = (unsigned *) (cq + params.cq_off.overflow);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * Checks that the kernel implements every one of the given opcodes. Returns
+ * -1 if any is missing or the kernel is too old to say.
+ */
+int uring_probe(struct uring *ring, const uint8_t *ops, size_t count)
+{
+    size_t size = sizeof(struct io_uring_probe)
+            + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    int res = 0;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+                probe, IORING_OP_LAST) == -1) {
+        perror("io_uring_register");
+        res = -1;
+    }
+    for (size_t i = 0; res == 0 && i < count; i++) {
+        if (ops[i] > probe->last_op
+                || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            res = -1;
+        }
+    }
+    free(probe);
+    return res;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/*
+ * Gets a cleared submission entry. If the queue is full, what is in it is
+ * submitted first to make room. Returns NULL if that fails.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        if (uring_submit_and_wait(ring, 0) == -1) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+/*
+ * Submits every entry filled in since the last call and waits until at least
+ * wait_nr completions are ready. Returns -1 with errno set on failure,
+ * including EINTR if a signal arrived before anything was submitted.
+ */
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr)
+{
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sqe_tail
+            - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    // Completions held back for want of room are only flushed into the queue
+    // when asked for
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    if (sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags) == -1) {
+        if (errno != EINTR) {
+            perror("io_uring_enter");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the oldest completion not yet marked seen, or NULL if there is none.
+ * Once the queue is drained, completions the kernel kept back are brought in.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (!(__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)) {
+            return NULL;
+        }
+        if (sys_io_uring_enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS) == -1
+                && errno != EINTR) {
+            perror("io_uring_enter");
+        }
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+    }
+
+    // Only kernels without IORING_FEAT_NODROP lose completions outright
+    unsigned dropped = __atomic_load_n(ring->cq_overflow, __ATOMIC_RELAXED);
+    if (dropped != ring->cq_dropped) {
+        LOG_WARN("%u io_uring completions dropped\n", dropped - ring->cq_dropped);
+        ring->cq_dropped = dropped;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,57 @@
+/**
+ * uring.h
+ *
+ * Minimal io_uring wrapper over the raw system calls, so the server doesn't
+ * need liburing to build. A ring is owned by one thread: it takes submission
+ * entries with uring_get_sqe, fills them in, and hands the whole batch to the
+ * kernel with one uring_submit_and_wait, which also waits for completions.
+ *
+ * Completions the completion queue has no room for are kept back by the
+ * kernel and flagged with IORING_SQ_CQ_OVERFLOW; they are flushed into the
+ * queue as it is drained.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct uring {
+    int fd;
+
+    /* Submission queue, shared with the kernel */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *sq_flags;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;          /* Entries handed out, not all yet published */
+
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    unsigned *cq_overflow;      /* Completions the kernel had to drop */
+    unsigned cq_dropped;        /* Last seen of cq_overflow */
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+int uring_init(struct uring *ring, unsigned entries, unsigned cq_entries);
+int uring_probe(struct uring *ring, const uint8_t *ops, size_t count);
+void uring_destroy(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+#endif
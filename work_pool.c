@@ -0,0 +1,185 @@
+#include "work_pool.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+
+#define WORK_DEQUE_INITIAL_CAP 64
+
+/* Worker running on this thread, or NULL for event loop threads */
+static __thread struct work_worker *current_worker;
+
+static int deque_init(struct work_deque *deque)
+{
+    memset(deque, 0, sizeof(struct work_deque));
+    deque->items = calloc(WORK_DEQUE_INITIAL_CAP, sizeof(struct work_item));
+    if (deque->items == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    deque->cap = WORK_DEQUE_INITIAL_CAP;
+    pthread_mutex_init(&deque->lock, NULL);
+    return 0;
+}
+
+static int deque_push(struct work_deque *deque, struct work_item item)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->cap) {
+        struct work_item *items = malloc(deque->cap * 2 * sizeof(struct work_item));
+        if (items == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            perror("malloc");
+            return -1;
+        }
+        for (size_t i = 0; i < deque->count; i++) {
+            items[i] = deque->items[(deque->head + i) % deque->cap];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->head = 0;
+        deque->cap *= 2;
+    }
+    deque->items[(deque->head + deque->count) % deque->cap] = item;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+/*
+ * The owner serves its own jobs oldest first so requests are answered in
+ * arrival order.
+ */
+static bool deque_pop(struct work_deque *deque, struct work_item *item)
+{
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        *item = deque->items[deque->head];
+        deque->head = (deque->head + 1) % deque->cap;
+        deque->count--;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/*
+ * Thieves take from the other end, so they rarely contend with the owner.
+ */
+static bool deque_steal(struct work_deque *deque, struct work_item *item)
+{
+    bool found = false;
+    if (pthread_mutex_trylock(&deque->lock) != 0) {
+        return false;
+    }
+    if (deque->count > 0) {
+        deque->count--;
+        *item = deque->items[(deque->head + deque->count) % deque->cap];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/*
+ * Claims one job: our own first, then any other worker's. The caller holds a
+ * token from thread_semaphore, so a job is guaranteed to be queued somewhere.
+ */
+static void take_job(struct work_worker *worker, struct work_item *item)
+{
+    struct work_pool *pool = worker->pool;
+
+    while (true) {
+        if (deque_pop(&worker->deque, item)) {
+            return;
+        }
+        for (int i = 1; i < pool->num_workers; i++) {
+            struct work_worker *victim =
+                &pool->workers[(worker->id + i) % pool->num_workers];
+            if (deque_steal(&victim->deque, item)) {
+                return;
+            }
+        }
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    struct work_worker *worker = arg;
+    current_worker = worker;
+
+    while (true) {
+        if (sem_wait(&worker->pool->thread_semaphore) == -1) {
+            if (errno != EINTR) {
+                perror("sem_wait");
+            }
+            continue;
+        }
+
+        struct work_item item;
+        take_job(worker, &item);
+        item.fn(item.arg);
+    }
+    return NULL;
+}
+
+int work_pool_init(struct work_pool *pool, int num_workers)
+{
+    memset(pool, 0, sizeof(struct work_pool));
+    pool->num_workers = num_workers;
+    pool->workers = calloc(num_workers, sizeof(struct work_worker));
+    if (pool->workers == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    if (sem_init(&pool->thread_semaphore, 0, 0) == -1) {
+        perror("sem_init");
+        return -1;
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        if (deque_init(&pool->workers[i].deque) == -1) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL,
+                    worker_thread, &pool->workers[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+
+    LOG_INFO("Started %d workers\n", num_workers);
+    return 0;
+}
+
+/*
+ * Queues fn(arg) to run on a worker. Jobs submitted by a worker stay on its
+ * own deque; everything else is spread round-robin.
+ */
+int work_pool_submit(struct work_pool *pool, work_fn fn, void *arg)
+{
+    struct work_item item = { fn, arg };
+    struct work_worker *worker = current_worker;
+
+    if (worker == NULL || worker->pool != pool) {
+        unsigned int next = __atomic_fetch_add(&pool->next_worker, 1, __ATOMIC_RELAXED);
+        worker = &pool->workers[next % pool->num_workers];
+    }
+
+    if (deque_push(&worker->deque, item) == -1) {
+        return -1;
+    }
+    sem_post(&pool->thread_semaphore);
+    return 0;
+}
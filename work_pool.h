@@ -0,0 +1,53 @@
+/**
+ * work_pool.h
+ *
+ * Fixed-size pool of worker threads for the blocking parts of request
+ * handling (stat, opendir, open, reading file data into the page cache).
+ * Every worker has its own deque; jobs are spread across the deques and idle
+ * workers steal from the busy ones, so one slow request only ever holds up a
+ * single worker.
+ */
+
+#ifndef _WORK_POOL_H_
+#define _WORK_POOL_H_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+
+typedef void (*work_fn)(void *arg);
+
+struct work_item {
+    work_fn fn;
+    void *arg;
+};
+
+/* Growable ring of jobs. The owner takes from the head, thieves from the tail */
+struct work_deque {
+    pthread_mutex_t lock;
+    struct work_item *items;
+    size_t head;
+    size_t count;
+    size_t cap;
+};
+
+struct work_pool;
+
+struct work_worker {
+    pthread_t thread;
+    struct work_pool *pool;
+    int id;
+    struct work_deque deque;
+};
+
+struct work_pool {
+    int num_workers;
+    struct work_worker *workers;
+    sem_t thread_semaphore;     /* Number of queued jobs not yet claimed */
+    unsigned int next_worker;   /* Round-robin target for outside submissions */
+};
+
+int work_pool_init(struct work_pool *pool, int num_workers);
+int work_pool_submit(struct work_pool *pool, work_fn fn, void *arg);
+
+#endif